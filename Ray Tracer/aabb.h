@@ -0,0 +1,86 @@
+#ifndef AABB_H
+#define AABB_H
+
+#include "utility_functions.h"
+
+// Axis-aligned bounding box
+class aabb {
+	public:
+		point3 minimum;
+		point3 maximum;
+
+	public:
+		// An empty box: growing it by anything gives that thing's bounds
+		aabb() : minimum(infinity, infinity, infinity), maximum(-infinity, -infinity, -infinity) {}
+		aabb(const point3& a, const point3& b) : minimum(a), maximum(b) {}
+
+		bool empty() const {
+			return minimum.x() > maximum.x() || minimum.y() > maximum.y() || minimum.z() > maximum.z();
+		}
+
+		point3 centroid() const {
+			return 0.5 * (minimum + maximum);
+		}
+
+		vec3 extent() const {
+			return maximum - minimum;
+		}
+
+		real surface_area() const {
+			if (empty()) {
+				return 0;
+			}
+			vec3 d = extent();
+			return 2 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+		}
+
+		// Index of the longest axis
+		int longest_axis() const {
+			vec3 d = extent();
+			if (d.x() > d.y() && d.x() > d.z()) {
+				return 0;
+			}
+			return d.y() > d.z() ? 1 : 2;
+		}
+
+		void grow(const point3& p) {
+			minimum = component_min(minimum, p);
+			maximum = component_max(maximum, p);
+		}
+
+		void grow(const aabb& box) {
+			minimum = component_min(minimum, box.minimum);
+			maximum = component_max(maximum, box.maximum);
+		}
+
+		// Slab test against a ray with precomputed inverse direction.
+		// Narrows [t_min, t_max] to the part of the ray inside the box.
+		bool hit(const point3& origin, const vec3& inv_dir, real& t_min, real& t_max) const {
+			for (int a = 0; a < 3; a++) {
+				auto t0 = (minimum.e[a] - origin.e[a]) * inv_dir.e[a];
+				auto t1 = (maximum.e[a] - origin.e[a]) * inv_dir.e[a];
+				if (inv_dir.e[a] < 0) {
+					std::swap(t0, t1);
+				}
+				t_min = t0 > t_min ? t0 : t_min;
+				t_max = t1 < t_max ? t1 : t_max;
+				if (t_max < t_min) {
+					return false;
+				}
+			}
+			return true;
+		}
+};
+
+inline aabb surrounding_box(const aabb& box0, const aabb& box1) {
+	aabb box = box0;
+	box.grow(box1);
+	return box;
+}
+
+// Overlap of two boxes (empty if they are disjoint)
+inline aabb intersection(const aabb& box0, const aabb& box1) {
+	return aabb(component_max(box0.minimum, box1.minimum), component_min(box0.maximum, box1.maximum));
+}
+
+#endif // !AABB_H
@@ -0,0 +1,45 @@
+#ifndef ACCELERATOR_H
+#define ACCELERATOR_H
+
+#include "hittable_list.h"
+#include "bvh_accel.h"
+#include "grid_accel.h"
+#include "kdtree_accel.h"
+#include "lazy_bvh_accel.h"
+#include "typed_bvh_accel.h"
+
+// Acceleration structures a scene can be traced with.
+//  bvh       - good default for any scene
+//  typed_bvh - bvh for scenes made mostly of spheres and boxes, tested
+//              without virtual calls
+//  lazy_bvh  - bvh built during rendering, only where rays go; for big scenes
+//              that are mostly out of view or hidden
+//  grid      - many evenly distributed objects of similar size
+//  kdtree    - static scenes where build time doesn't matter
+//  list      - no acceleration, for a handful of objects
+enum class accel_type { list, bvh, typed_bvh, lazy_bvh, grid, kdtree };
+
+inline const char* accel_name(accel_type type) {
+	switch (type) {
+		case accel_type::bvh: return "bvh";
+		case accel_type::typed_bvh: return "typed bvh";
+		case accel_type::lazy_bvh: return "lazy bvh";
+		case accel_type::grid: return "grid";
+		case accel_type::kdtree: return "kd-tree";
+		default: return "list";
+	}
+}
+
+// Builds the chosen acceleration structure over the objects of the world
+inline shared_ptr<hittable> make_accelerator(const hittable_list& world, accel_type type) {
+	switch (type) {
+		case accel_type::bvh: return make_shared<bvh_accel>(world.objects);
+		case accel_type::typed_bvh: return make_shared<typed_bvh_accel>(world.objects);
+		case accel_type::lazy_bvh: return make_shared<lazy_bvh_accel>(world.objects);
+		case accel_type::grid: return make_shared<grid_accel>(world.objects);
+		case accel_type::kdtree: return make_shared<kdtree_accel>(world.objects);
+		default: return make_shared<hittable_list>(world);
+	}
+}
+
+#endif // !ACCELERATOR_H
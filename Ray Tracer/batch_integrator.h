@@ -0,0 +1,547 @@
+#ifndef BATCH_INTEGRATOR_H
+#define BATCH_INTEGRATOR_H
+
+#include "direction_batch.h"
+#include "hittable.h"
+#include "light_list.h"
+#include "material_table.h"
+#include "path_guide.h"
+#include "photon_map.h"
+#include "radiance_cache.h"
+#include "ray_packet.h"
+#include "sampler.h"
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+// Traces many paths together, one bounce at a time. After each bounce the
+// hits are sorted by material type with a counting sort, and every type is
+// scattered by its own loop over the flat material_table. A loop only ever
+// runs one material's code, instead of a virtual call per hit that jumps
+// between all of them.
+//
+// At diffuse hits a point on one of the lights is sampled and, if nothing
+// blocks it, its light added directly. Emitters that a bounce happens to hit
+// are added too, and both are weighted by multiple importance sampling so
+// that each light is counted once, by whichever strategy finds it best.
+//
+// With a path_guide, diffuse bounces also draw directions from it, and while
+// it is training every path records the light that came back through them.
+// With a radiance_cache, paths that reach a diffuse surface after their first
+// bounce still sample the lights there, but take the rest of the light from
+// the cache and end when it knows that point. While it trains, every diffuse
+// bounce records the indirect irradiance its path found.
+// With a photon_map, diffuse hits gather the caustics from it, and light that
+// paths find through glass or metal after a diffuse bounce, from the lights
+// and background it traces, is left to it.
+class batch_integrator {
+	public:
+		material_table materials;
+		// Lights sampled at diffuse hits. Left empty, emitters only add light
+		// when a bounce hits them.
+		light_list lights;
+		// Guide for the directions of diffuse bounces, or null to draw them
+		// from the material alone
+		path_guide* guide = nullptr;
+		// Cache of the light at diffuse surfaces, or null to trace every path
+		// to its end
+		radiance_cache* cache = nullptr;
+		// Caustics to gather at diffuse hits, or null to find them by tracing
+		const photon_map* caustics = nullptr;
+		// Cap on the bounces of a path, a safety limit only: after
+		// roulette_depth bounces paths end by russian roulette, with a
+		// probability that grows as their throughput drops
+		int max_depth;
+		int roulette_depth;
+
+		// Paths traced and rays followed along them, over all calls of trace
+		long long paths_traced = 0;
+		long long path_segments = 0;
+
+	public:
+		batch_integrator(int max_depth, int roulette_depth = 8)
+			: max_depth(max_depth), roulette_depth(roulette_depth) {}
+
+		// Follows each ray until it leaves the scene, is absorbed or runs out of
+		// bounces, and stores the color it brings back in radiance. Path i
+		// draws its random numbers from samples[i].
+		// intersect(ray&, hit_record&) finds the closest hit of a ray, and
+		// background(ray&) is the color seen by a ray that hits nothing.
+		template <typename Intersect, typename Background>
+		void trace(std::vector<ray>& rays, std::vector<sample_stream>& samples, std::vector<color>& radiance,
+			Intersect&& intersect, Background&& background);
+
+		// Same, with the first bounce traced in packets of eight rays in the
+		// order they are given, which for camera rays keeps rays that go through
+		// the same nodes together. intersect_packet(ray8&, int active,
+		// hit_record*) returns the mask of the rays that hit something.
+		template <typename Intersect, typename IntersectPacket, typename Background>
+		void trace(std::vector<ray>& rays, std::vector<sample_stream>& samples, std::vector<color>& radiance,
+			Intersect&& intersect, IntersectPacket&& intersect_packet, Background&& background);
+
+	private:
+		std::vector<color> throughput; // of each path
+		// Where each path last bounced, the surface normal there, and the pdf
+		// of the direction it took when that bounce could also have sampled a
+		// light, 0 otherwise
+		std::vector<point3> last_vertex;
+		std::vector<vec3> last_normal;
+		std::vector<real> last_pdf;
+		std::vector<int> live, next_live; // paths still bouncing
+		std::vector<hit_record> hits; // of this bounce
+		std::vector<int> hit_path; // path of each hit
+		std::vector<int> hit_slot; // material entry of each hit
+		std::vector<int> order; // hits sorted by material type
+		direction_batch directions; // drawn for a whole material group at once
+		std::vector<real> group_pdf; // of each direction of the group
+		std::vector<const direction_tree*> group_guide; // of each hit of the group
+		// A diffuse bounce of a path while the guide trains: where it was, the
+		// direction taken and its pdf, the throughput past it and the radiance
+		// gathered so far, and the bounce before it on the same path or -1
+		struct guide_vertex {
+			point3 p;
+			vec3 direction;
+			real pdf;
+			color throughput;
+			color radiance;
+			int previous;
+		};
+		std::vector<guide_vertex> guide_vertices;
+		std::vector<int> last_guide_vertex; // of each path
+		// A diffuse hit of a path while the cache trains: where it was, the
+		// throughput times albedo / pi there, the radiance gathered up to its
+		// direct light, how far its bounce went and the hit before it on the
+		// same path or -1
+		struct cache_vertex {
+			point3 p;
+			vec3 normal;
+			color weight;
+			color radiance;
+			real distance;
+			int previous;
+		};
+		std::vector<cache_vertex> cache_vertices;
+		std::vector<int> last_cache_vertex; // of each path
+		std::vector<char> cached; // of each hit, whether it ends in the cache
+		// Of each path with caustics: 1 when it last bounced off a diffuse
+		// surface, 2 when it has bounced off glass or metal since, so that the
+		// light it finds now is the photon map's, else 0
+		std::vector<char> caustic_path;
+		std::vector<real> fuzz_radius; // of the metal hits, in the same order
+
+		// Scatters the hits order[first, last) with one material kernel, and
+		// plays russian roulette with the paths if asked to
+		template <typename Kernel>
+		void scatter_group(int first, int last, bool roulette, std::vector<ray>& rays,
+			std::vector<sample_stream>& samples, Kernel&& kernel);
+
+		// Adds the light of a sampled point on a light to each diffuse hit of
+		// order[first, last), when the shadow ray to it is unblocked
+		template <typename Intersect>
+		void sample_lights(int first, int last, std::vector<sample_stream>& samples,
+			std::vector<color>& radiance, Intersect&& intersect);
+};
+
+template <typename Intersect, typename Background>
+void batch_integrator::trace(std::vector<ray>& rays, std::vector<sample_stream>& samples, std::vector<color>& radiance,
+	Intersect&& intersect, Background&& background) {
+	trace(rays, samples, radiance, intersect, [&](ray8& packet, int active, hit_record* recs) {
+		int hit_mask = 0;
+		for (int i = 0; i < ray8::size; i++) {
+			ray r = packet.get(i);
+			if ((active & (1 << i)) && intersect(r, recs[i])) {
+				hit_mask |= 1 << i;
+			}
+		}
+		return hit_mask;
+	}, background);
+}
+
+template <typename Intersect, typename IntersectPacket, typename Background>
+void batch_integrator::trace(std::vector<ray>& rays, std::vector<sample_stream>& samples, std::vector<color>& radiance,
+	Intersect&& intersect, IntersectPacket&& intersect_packet, Background&& background) {
+	int n = static_cast<int>(rays.size());
+	radiance.assign(n, color(0, 0, 0));
+	throughput.assign(n, color(1, 1, 1));
+	last_vertex.resize(n);
+	last_normal.resize(n);
+	last_pdf.assign(n, 0);
+	hits.resize(n);
+	hit_path.resize(n);
+	hit_slot.resize(n);
+	order.resize(n);
+	live.resize(n);
+	for (int i = 0; i < n; i++) {
+		live[i] = i;
+	}
+	bool training = guide && guide->training;
+	guide_vertices.clear();
+	last_guide_vertex.assign(training ? n : 0, -1);
+	bool cache_training = cache && cache->training;
+	cache_vertices.clear();
+	last_cache_vertex.assign(cache_training ? n : 0, -1);
+	caustic_path.assign(caustics ? n : 0, 0);
+	bool caustic_background = caustics && caustics->lit_by_background();
+
+	paths_traced += n;
+
+	for (int depth = max_depth; depth > 0 && !live.empty(); depth--) {
+		path_segments += static_cast<long long>(live.size());
+		// Intersect, and count the hits on each material type
+		int type_start[material_type_count + 1] = {};
+		int hit_count = 0;
+		auto add_hit = [&](int path) {
+			const hit_record& rec = hits[hit_count];
+			int slot = materials.slot(rec.mat_ptr.get());
+			const material_entry& entry = materials.entries[slot];
+			if (entry.emissive && !(caustics && caustic_path[path] == 2 && caustics->traces(rec.object))) {
+				// Weighted against sampling the light from the last bounce
+				real weight = last_pdf[path] > 0 ? mis_weight(last_pdf[path], lights.pdf(last_vertex[path], last_normal[path], rec)) : 1;
+				radiance[path] += weight * throughput[path] * entry.source->emitted(0, 0, rec.p);
+			}
+			last_pdf[path] = 0;
+			// The first hit past a diffuse bounce tells how far it went. With
+			// lights, the emitter it hits is direct light, weighted against the
+			// light sample, and left out of the cache like the sample is.
+			if (cache_training && last_cache_vertex[path] >= 0) {
+				cache_vertex& c = cache_vertices[last_cache_vertex[path]];
+				if (c.distance == infinity) {
+					c.distance = rec.t;
+					if (!lights.empty()) {
+						c.radiance = radiance[path];
+					}
+				}
+			}
+			samples[path].start_bounce();
+			hit_path[hit_count] = path;
+			hit_slot[hit_count] = slot;
+			type_start[static_cast<int>(entry.type) + 1]++;
+			hit_count++;
+		};
+
+		int live_count = static_cast<int>(live.size());
+		if (depth == max_depth) {
+			for (int first = 0; first < live_count; first += ray8::size) {
+				int count = std::min(ray8::size, live_count - first);
+				ray8 packet;
+				hit_record recs[ray8::size];
+				for (int i = 0; i < ray8::size; i++) {
+					packet.set(i, rays[live[first + std::min(i, count - 1)]]);
+				}
+				int hit_mask = intersect_packet(packet, (1 << count) - 1, recs);
+				for (int i = 0; i < count; i++) {
+					int path = live[first + i];
+					if (!(hit_mask & (1 << i))) {
+						radiance[path] += throughput[path] * background(rays[path]);
+						continue;
+					}
+					hits[hit_count] = std::move(recs[i]);
+					add_hit(path);
+				}
+			}
+		}
+		else {
+			for (int path : live) {
+				if (!intersect(rays[path], hits[hit_count])) {
+					if (!(caustic_background && caustic_path[path] == 2)) {
+						radiance[path] += throughput[path] * background(rays[path]);
+					}
+					continue;
+				}
+				add_hit(path);
+			}
+		}
+
+		for (int type = 0; type < material_type_count; type++) {
+			type_start[type + 1] += type_start[type];
+		}
+		int next[material_type_count];
+		for (int type = 0; type < material_type_count; type++) {
+			next[type] = type_start[type];
+		}
+		for (int h = 0; h < hit_count; h++) {
+			order[next[static_cast<int>(materials.entries[hit_slot[h]].type)]++] = h;
+		}
+
+		auto range = [&](material_type type, int& first, int& last) {
+			first = type_start[static_cast<int>(type)];
+			last = type_start[static_cast<int>(type) + 1];
+		};
+		int first, last;
+		bool roulette = max_depth - depth >= roulette_depth;
+		next_live.clear();
+
+		range(material_type::lambertian, first, last);
+		int cached_first = last;
+		if (cache && !cache->training && depth < max_depth) {
+			// Hits the cache knows take its light and end after their light
+			// sample, moved to the back of the group so that they are not
+			// scattered
+			cached.resize(hit_count);
+			for (int i = first; i < last; i++) {
+				int h = order[i];
+				int path = hit_path[h];
+				const hit_record& rec = hits[h];
+				real u = samples[path].bounce_sample(cache_jitter_dimension);
+				real v = samples[path].bounce_sample(cache_jitter_dimension + 1);
+				color irradiance;
+				cached[h] = cache->lookup(rec.p, rec.normal, rec.t, u, v, irradiance);
+				if (cached[h]) {
+					radiance[path] += throughput[path] * materials.entries[hit_slot[h]].albedo * irradiance / pi;
+				}
+			}
+			cached_first = static_cast<int>(std::partition(order.begin() + first, order.begin() + last,
+				[&](int h) { return !cached[h]; }) - order.begin());
+		}
+		if (guide) {
+			group_guide.resize(last - first);
+			for (int i = first; i < last; i++) {
+				group_guide[i - first] = &guide->distribution(hits[order[i]].p);
+			}
+		}
+		if (!lights.empty()) {
+			sample_lights(first, last, samples, radiance, intersect);
+		}
+		if (caustics) {
+			for (int i = first; i < last; i++) {
+				int h = order[i];
+				int path = hit_path[h];
+				color albedo = materials.entries[hit_slot[h]].albedo;
+				radiance[path] += throughput[path] * albedo * caustics->irradiance(hits[h].p, hits[h].normal) / pi;
+			}
+		}
+		last = cached_first;
+		if (cache_training) {
+			for (int i = first; i < last; i++) {
+				int h = order[i];
+				int path = hit_path[h];
+				color weight = throughput[path] * materials.entries[hit_slot[h]].albedo / pi;
+				cache_vertices.push_back({ hits[h].p, hits[h].normal, weight, radiance[path], infinity,
+					last_cache_vertex[path] });
+				last_cache_vertex[path] = static_cast<int>(cache_vertices.size()) - 1;
+			}
+		}
+		// The directions of lambertian_scatter, drawn together and put in
+		// place of the incoming rays before the group is scattered
+		directions.resize(last - first);
+		for (int i = first; i < last; i++) {
+			int h = order[i];
+			int path = hit_path[h];
+			directions.u[i - first] = samples[path].next();
+			directions.v[i - first] = samples[path].next();
+			directions.set_normal(i - first, hits[h].normal);
+		}
+		directions.cosine_hemisphere();
+		group_pdf.resize(last - first);
+		for (int i = first; i < last; i++) {
+			int h = order[i];
+			int path = hit_path[h];
+			const hit_record& rec = hits[h];
+			vec3 direction = directions.direction(i - first);
+			real bsdf_pdf = std::max(real(0), dot(rec.normal, direction)) / pi;
+			real pdf = bsdf_pdf;
+			if (guide) {
+				// Some paths take the guide's direction for the same numbers
+				// instead, and all are weighted by the pdf of the mixture. Of the
+				// weight albedo * cos / pi / pdf, scatter_group applies the albedo.
+				const direction_tree& guided = *group_guide[i - first];
+				real share = guide->bsdf_share(guided);
+				real guided_pdf;
+				if (samples[path].next() >= share) {
+					direction = guided.sample(directions.u[i - first], directions.v[i - first], guided_pdf);
+					bsdf_pdf = std::max(real(0), dot(rec.normal, direction)) / pi;
+				}
+				else {
+					guided_pdf = guided.pdf(direction);
+				}
+				pdf = share * bsdf_pdf + (1 - share) * guided_pdf;
+				throughput[path] = pdf > 0 ? throughput[path] * (bsdf_pdf / pdf) : color(0, 0, 0);
+				if (training && pdf > 0) {
+					color past = throughput[path] * materials.entries[hit_slot[h]].albedo;
+					guide_vertices.push_back({ rec.p, direction, pdf, past, radiance[path], last_guide_vertex[path] });
+					last_guide_vertex[path] = static_cast<int>(guide_vertices.size()) - 1;
+				}
+			}
+			group_pdf[i - first] = pdf;
+			rays[path] = ray(rec.p, direction);
+		}
+		scatter_group(first, last, roulette, rays, samples, [](const material_entry& m, const ray& r_in,
+			const hit_record& rec, sample_stream& samples, color& attenuation, ray& scattered) {
+			attenuation = m.albedo;
+			return dot(scattered.dir, rec.normal) > 0;
+		});
+		if (!lights.empty()) {
+			// The pdfs of the directions, for weighting the emitters they hit
+			for (int i = first; i < last; i++) {
+				int h = order[i];
+				int path = hit_path[h];
+				last_vertex[path] = hits[h].p;
+				last_normal[path] = hits[h].normal;
+				last_pdf[path] = group_pdf[i - first];
+			}
+		}
+		if (caustics) {
+			for (int i = first; i < last; i++) {
+				caustic_path[hit_path[order[i]]] = 1;
+			}
+		}
+
+		// The same for metal_scatter: the mirror direction plus a point in
+		// the ball of the fuzz, whose direction is drawn together
+		range(material_type::metal, first, last);
+		directions.resize(last - first);
+		fuzz_radius.resize(last - first);
+		for (int i = first; i < last; i++) {
+			sample_stream& stream = samples[hit_path[order[i]]];
+			directions.u[i - first] = stream.next();
+			directions.v[i - first] = stream.next();
+			fuzz_radius[i - first] = cbrt(stream.next());
+		}
+		directions.unit_vectors();
+		for (int i = first; i < last; i++) {
+			int h = order[i];
+			int path = hit_path[h];
+			vec3 reflected = reflect(unit_vector(rays[path].dir), hits[h].normal);
+			real fuzz = materials.entries[hit_slot[h]].fuzzines * fuzz_radius[i - first];
+			rays[path] = ray(hits[h].p, reflected + fuzz * directions.direction(i - first));
+		}
+		scatter_group(first, last, roulette, rays, samples, [](const material_entry& m, const ray& r_in,
+			const hit_record& rec, sample_stream& samples, color& attenuation, ray& scattered) {
+			attenuation = m.albedo;
+			return dot(scattered.dir, rec.normal) > 0;
+		});
+
+		range(material_type::dielectric, first, last);
+		scatter_group(first, last, roulette, rays, samples, [](const material_entry& m, const ray& r_in,
+			const hit_record& rec, sample_stream& samples, color& attenuation, ray& scattered) {
+			dielectric_scatter(m.index_of_refraction, r_in, rec, samples, attenuation, scattered);
+			return true;
+		});
+
+		// Glass and metal carry on what a diffuse bounce started, anything
+		// else ends it
+		if (caustics) {
+			for (int i = type_start[static_cast<int>(material_type::metal)];
+				i < type_start[static_cast<int>(material_type::other)]; i++) {
+				char& state = caustic_path[hit_path[order[i]]];
+				state = state ? 2 : 0;
+			}
+			range(material_type::other, first, last);
+			for (int i = first; i < last; i++) {
+				caustic_path[hit_path[order[i]]] = 0;
+			}
+		}
+		range(material_type::other, first, last);
+		scatter_group(first, last, roulette, rays, samples, [](const material_entry& m, const ray& r_in,
+			const hit_record& rec, sample_stream& samples, color& attenuation, ray& scattered) {
+			ray in = r_in;
+			return m.source->scatter(in, rec, samples, attenuation, scattered);
+		});
+
+		live.swap(next_live);
+	}
+
+	// The light that came back through each guided bounce is what arrived
+	// at it from the direction taken, once the throughput up to there is
+	// divided out
+	if (training) {
+		for (int path = 0; path < n; path++) {
+			for (int v = last_guide_vertex[path]; v >= 0; v = guide_vertices[v].previous) {
+				const guide_vertex& g = guide_vertices[v];
+				color arrived = radiance[path] - g.radiance;
+				const color& t = g.throughput;
+				color incident(t.x() > 0 ? arrived.x() / t.x() : 0, t.y() > 0 ? arrived.y() / t.y() : 0,
+					t.z() > 0 ? arrived.z() / t.z() : 0);
+				guide->record(g.p, g.direction, luminance(incident) / g.pdf);
+			}
+		}
+	}
+	// Likewise the light gathered past the direct light of a diffuse hit,
+	// divided by the weight of the hit, is an estimate of the indirect
+	// irradiance there
+	if (cache_training) {
+		for (int path = 0; path < n; path++) {
+			for (int v = last_cache_vertex[path]; v >= 0; v = cache_vertices[v].previous) {
+				const cache_vertex& c = cache_vertices[v];
+				color gathered = radiance[path] - c.radiance;
+				const color& w = c.weight;
+				color irradiance(w.x() > 0 ? gathered.x() / w.x() : 0, w.y() > 0 ? gathered.y() / w.y() : 0,
+					w.z() > 0 ? gathered.z() / w.z() : 0);
+				cache->record(c.p, c.normal, irradiance, c.distance);
+			}
+		}
+	}
+}
+
+template <typename Kernel>
+void batch_integrator::scatter_group(int first, int last, bool roulette, std::vector<ray>& rays,
+	std::vector<sample_stream>& samples, Kernel&& kernel) {
+	for (int i = first; i < last; i++) {
+		int h = order[i];
+		int path = hit_path[h];
+		// The scattered ray replaces the incoming one
+		ray r_in = rays[path];
+		color attenuation;
+		if (!kernel(materials.entries[hit_slot[h]], r_in, hits[h], samples[path], attenuation, rays[path])) {
+			continue;
+		}
+		color& t = throughput[path];
+		t = t * attenuation;
+		if (roulette) {
+			// Survivors carry the weight of the paths that ended, which keeps
+			// the estimate unbiased. Capped so that paths through glass, which
+			// keep all their throughput, end too.
+			real survival = std::min(real(0.95), std::max(std::max(t.x(), t.y()), t.z()));
+			if (samples[path].bounce_sample(roulette_dimension) >= survival) {
+				continue;
+			}
+			t = t / survival;
+		}
+		next_live.push_back(path);
+	}
+}
+
+template <typename Intersect>
+void batch_integrator::sample_lights(int first, int last, std::vector<sample_stream>& samples,
+	std::vector<color>& radiance, Intersect&& intersect) {
+	hit_record blocker;
+	for (int i = first; i < last; i++) {
+		int h = order[i];
+		int path = hit_path[h];
+		const hit_record& rec = hits[h];
+		const sample_stream& stream = samples[path];
+		light_sample s;
+		if (!lights.sample(rec.p, rec.normal, stream.bounce_sample(light_pick_dimension),
+			stream.bounce_sample(light_point_dimension), stream.bounce_sample(light_point_dimension + 1), s)) {
+			continue;
+		}
+
+		vec3 to_light = s.p - rec.p;
+		real distance = to_light.length();
+		vec3 direction = to_light / distance;
+		real cos_theta = dot(rec.normal, direction);
+		if (cos_theta <= 0) {
+			continue;
+		}
+		// Blocked by anything in front of the light, short of the sampled
+		// point itself
+		ray shadow(rec.p, direction);
+		if (intersect(shadow, blocker) && blocker.t < distance * (1 - real(1e-3))) {
+			continue;
+		}
+
+		real bsdf_pdf = cos_theta / pi;
+		real scatter_pdf = bsdf_pdf;
+		if (guide) {
+			const direction_tree& guided = *group_guide[i - first];
+			real share = guide->bsdf_share(guided);
+			scatter_pdf = share * bsdf_pdf + (1 - share) * guided.pdf(direction);
+		}
+		real weight = mis_weight(s.pdf, scatter_pdf);
+		const color& albedo = materials.entries[hit_slot[h]].albedo;
+		radiance[path] += throughput[path] * albedo * s.emission * (weight * bsdf_pdf / s.pdf);
+	}
+}
+
+#endif // !BATCH_INTEGRATOR_H
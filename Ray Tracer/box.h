@@ -0,0 +1,143 @@
+#ifndef BOX_H
+#define BOX_H
+
+#include "hittable.h"
+#include "vec3.h"
+
+#include <algorithm>
+
+// Distance to the hit of a ray with an axis-aligned box, given the distances
+// at which the ray crosses the slab planes. Returns false if the box is missed
+// or the hit lies outside [t_min, t_max]. A ray starting inside hits the exit.
+inline bool hit_box_slabs(const vec3& t_near, const vec3& t_far, real t_min, real t_max, real& t) {
+	real enter = fmax(fmax(t_near.x(), t_near.y()), t_near.z());
+	real exit = fmin(fmin(t_far.x(), t_far.y()), t_far.z());
+	if (enter > exit) {
+		return false;
+	}
+
+	t = enter < t_min ? exit : enter;
+	return t >= t_min && t <= t_max;
+}
+
+// Outward normal of the face a ray crosses at a distance t found by
+// hit_box_slabs: the face is on the axis whose slab was entered last, or is
+// left first when t is the exit. Matching by nearest distance instead of
+// equality also accepts a t that went through a batched test.
+inline vec3 box_face_normal(const ray& ray, const vec3& t_near, const vec3& t_far, real t) {
+	real enter = fmax(fmax(t_near.x(), t_near.y()), t_near.z());
+	real exit = fmin(fmin(t_far.x(), t_far.y()), t_far.z());
+	bool leaving = fabs(t - exit) < fabs(t - enter);
+	vec3 d = leaving ? t_far - vec3(t, t, t) : t_near - vec3(t, t, t);
+	real dx = fabs(d.x()), dy = fabs(d.y()), dz = fabs(d.z());
+	int axis = dx <= dy ? (dx <= dz ? 0 : 2) : (dy <= dz ? 1 : 2);
+
+	// Entering against the direction, leaving along it
+	vec3 outward_normal(0, 0, 0);
+	outward_normal[axis] = (ray.dir[axis] < 0) != leaving ? 1 : -1;
+	return outward_normal;
+}
+
+// Axis-aligned box
+class box : public hittable {
+	public:
+		aabb bounds;
+		shared_ptr<material> mat_ptr;
+
+	public:
+		box() {}
+		// The corners may come in any order; bounds keeps them sorted so
+		// accelerators get a box that is not inside out
+		box(const point3& corner0, const point3& corner1, shared_ptr<material> m)
+			: bounds(component_min(corner0, corner1), component_max(corner0, corner1)), mat_ptr(m) {}
+
+		virtual bool intersect(const ray& ray, real t_min, real t_max, hit_info& hit) const override;
+		virtual void resolve_hit(const ray& ray, const hit_info& hit, hit_record& rec) const override;
+		virtual int intersect_packet(ray4& rays, int active, hit_info* hits) const override {
+			return intersect_rays(rays, active, hits);
+		}
+		virtual int intersect_packet(ray8& rays, int active, hit_info* hits) const override {
+			return intersect_rays(rays, active, hits);
+		}
+
+		virtual bool bounding_box(aabb& output_box) const override {
+			output_box = bounds;
+			return true;
+		}
+
+	private:
+		template <int N>
+		int intersect_rays(ray_packet<N>& rays, int active, hit_info* hits) const;
+};
+
+// Slab test without branches until the hit is known: the distances to both
+// planes of every axis are computed at once and sorted with min/max.
+bool box::intersect(const ray& ray, real t_min, real t_max, hit_info& hit) const {
+	vec3 inv_dir(1 / ray.dir.x(), 1 / ray.dir.y(), 1 / ray.dir.z());
+	vec3 t0 = (bounds.minimum - ray.orig) * inv_dir;
+	vec3 t1 = (bounds.maximum - ray.orig) * inv_dir;
+
+	real t;
+	if (!hit_box_slabs(component_min(t0, t1), component_max(t0, t1), t_min, t_max, t)) {
+		return false;
+	}
+	hit.t = t;
+	hit.object = this;
+	return true;
+}
+
+// Same slab test as intersect for all rays of the packet at once
+template <int N>
+int box::intersect_rays(ray_packet<N>& rays, int active, hit_info* hits) const {
+	const real* origin[3] = { rays.ox, rays.oy, rays.oz };
+	const real* direction[3] = { rays.dx, rays.dy, rays.dz };
+
+	real t_near[3][N], t_far[3][N];
+	for (int axis = 0; axis < 3; axis++) {
+		real minimum = bounds.minimum[axis], maximum = bounds.maximum[axis];
+		for (int i = 0; i < N; i++) {
+			real inv_dir = 1 / direction[axis][i];
+			real t0 = (minimum - origin[axis][i]) * inv_dir;
+			real t1 = (maximum - origin[axis][i]) * inv_dir;
+			t_near[axis][i] = t0 < t1 ? t0 : t1;
+			t_far[axis][i] = t0 > t1 ? t0 : t1;
+		}
+	}
+
+	// A miss is left at infinity
+	real t[N];
+	for (int i = 0; i < N; i++) {
+		real enter = std::max(std::max(t_near[0][i], t_near[1][i]), t_near[2][i]);
+		real exit = std::min(std::min(t_far[0][i], t_far[1][i]), t_far[2][i]);
+		real hit = enter < rays.t_min[i] ? exit : enter;
+		t[i] = enter <= exit && hit >= rays.t_min[i] && hit <= rays.t_max[i] ? hit : infinity;
+	}
+
+	int hit_mask = 0;
+	for (int i = 0; i < N; i++) {
+		hit_mask |= (t[i] < infinity) << i;
+	}
+
+	hit_mask &= active;
+	for (int i = 0; i < N; i++) {
+		if (hit_mask & (1 << i)) {
+			rays.t_max[i] = t[i];
+			hits[i].t = t[i];
+			hits[i].object = this;
+		}
+	}
+	return hit_mask;
+}
+
+void box::resolve_hit(const ray& ray, const hit_info& hit, hit_record& rec) const {
+	vec3 inv_dir(1 / ray.dir.x(), 1 / ray.dir.y(), 1 / ray.dir.z());
+	vec3 t0 = (bounds.minimum - ray.orig) * inv_dir;
+	vec3 t1 = (bounds.maximum - ray.orig) * inv_dir;
+
+	rec.t = hit.t;
+	rec.p = ray.at(hit.t);
+	rec.set_face_normal(ray, box_face_normal(ray, component_min(t0, t1), component_max(t0, t1), hit.t));
+	rec.mat_ptr = mat_ptr;
+}
+
+#endif // !BOX_H
@@ -0,0 +1,247 @@
+#ifndef BOX_SET_H
+#define BOX_SET_H
+
+#include "box.h"
+#include "bvh.h"
+#include "simd.h"
+
+#include <limits>
+#include <unordered_map>
+#include <vector>
+
+// Many axis-aligned boxes in one object, e.g. the voxels of a scene. Like
+// sphere_set the bounds are kept in separate arrays in the leaf order of a
+// bvh, and a leaf is slab tested a full register of boxes per instruction.
+//
+// Add the boxes, then call build() before tracing. build() picks the batch
+// kernel for the current kernel_isa().
+class box_set : public hittable {
+	public:
+		std::vector<real> min_x, min_y, min_z;
+		std::vector<real> max_x, max_y, max_z;
+		std::vector<int> material_index;
+		std::vector<shared_ptr<material>> materials;
+		bvh accel;
+		cpu_isa isa = cpu_isa::scalar; // of the batch kernel
+
+	public:
+		box_set() {}
+
+		// Adds the box between two opposite corners, in any order
+		void add(const point3& corner0, const point3& corner1, shared_ptr<material> m);
+		void add_cube(const point3& center, real half_side, shared_ptr<material> m) {
+			vec3 h(half_side, half_side, half_side);
+			add(center - h, center + h, m);
+		}
+		void build(bvh_build_options options = bvh_build_options());
+
+		int size() const { return count; }
+
+		virtual bool intersect(const ray& ray, real t_min, real t_max, hit_info& hit) const override;
+		virtual void resolve_hit(const ray& ray, const hit_info& hit, hit_record& rec) const override;
+		virtual bool bounding_box(aabb& output_box) const override;
+
+	private:
+		int count = 0;
+		std::unordered_map<const material*, int> material_slot;
+
+		aabb box_bounds(int i) const {
+			return aabb(point3(min_x[i], min_y[i], min_z[i]), point3(max_x[i], max_y[i], max_z[i]));
+		}
+
+		// Nearest hit in [t_min, t_max] of boxes [first, first + n), or -1
+		int hit_batch(int first, int n, const point3& origin, const vec3& inv_dir, real t_min, real& t_max) const;
+		template <typename V>
+		int hit_batch(int first, int n, const point3& origin, const vec3& inv_dir, real t_min, real& t_max) const;
+		// One instance of the kernel per instruction set
+		int hit_batch_scalar(int first, int n, const point3& origin, const vec3& inv_dir, real t_min, real& t_max) const;
+#ifdef CPU_X86
+		SIMD_SSE4 int hit_batch_sse4(int first, int n, const point3& origin, const vec3& inv_dir, real t_min, real& t_max) const;
+		SIMD_AVX2 int hit_batch_avx2(int first, int n, const point3& origin, const vec3& inv_dir, real t_min, real& t_max) const;
+		SIMD_AVX512 int hit_batch_avx512(int first, int n, const point3& origin, const vec3& inv_dir, real t_min, real& t_max) const;
+#endif
+};
+
+void box_set::add(const point3& corner0, const point3& corner1, shared_ptr<material> m) {
+	// Drop the padding of the last build
+	for (auto values : { &min_x, &min_y, &min_z, &max_x, &max_y, &max_z }) {
+		values->resize(count);
+	}
+
+	// The corners may come in any order, as for box
+	point3 minimum = component_min(corner0, corner1);
+	point3 maximum = component_max(corner0, corner1);
+	min_x.push_back(minimum.x());
+	min_y.push_back(minimum.y());
+	min_z.push_back(minimum.z());
+	max_x.push_back(maximum.x());
+	max_y.push_back(maximum.y());
+	max_z.push_back(maximum.z());
+
+	auto slot = material_slot.find(m.get());
+	if (slot == material_slot.end()) {
+		slot = material_slot.emplace(m.get(), static_cast<int>(materials.size())).first;
+		materials.push_back(m);
+	}
+	material_index.push_back(slot->second);
+	count++;
+}
+
+void box_set::build(bvh_build_options options) {
+	// A batch tests a full register, so leaves of about that many boxes
+	// cost little more than leaves of one
+	isa = kernel_isa();
+	int width = simd_width(isa);
+	options.spatial_splits = false;
+	options.max_leaf_size = width > options.max_leaf_size ? width : options.max_leaf_size;
+	options.intersection_cost /= width;
+
+	std::vector<aabb> bounds(count);
+	for (int i = 0; i < count; i++) {
+		bounds[i] = box_bounds(i);
+	}
+	accel.build(bounds, options);
+
+	// Store the boxes in leaf order, each leaf is then a contiguous range.
+	// The tree leaves out boxes with empty bounds, which no ray could hit,
+	// so only the ones it holds are kept.
+	const int* order = accel.prim_array();
+	int kept = static_cast<int>(accel.prim_count());
+	auto reorder = [&](auto& values) {
+		auto sorted = values;
+		sorted.resize(kept);
+		for (int i = 0; i < kept; i++) {
+			sorted[i] = values[order[i]];
+		}
+		values.swap(sorted);
+	};
+	for (auto values : { &min_x, &min_y, &min_z, &max_x, &max_y, &max_z }) {
+		reorder(*values);
+	}
+	reorder(material_index);
+	count = kept;
+
+	// Full registers may be loaded past the last box; padding boxes are
+	// empty (minimum above maximum) and never hit
+	for (auto values : { &min_x, &min_y, &min_z }) {
+		values->resize(count + simd_max_width - 1, infinity);
+	}
+	for (auto values : { &max_x, &max_y, &max_z }) {
+		values->resize(count + simd_max_width - 1, -infinity);
+	}
+}
+
+int box_set::hit_batch(int first, int n, const point3& origin, const vec3& inv_dir, real t_min, real& t_max) const {
+	switch (isa) {
+#ifdef CPU_X86
+		case cpu_isa::avx512: return hit_batch_avx512(first, n, origin, inv_dir, t_min, t_max);
+		case cpu_isa::avx2: return hit_batch_avx2(first, n, origin, inv_dir, t_min, t_max);
+		case cpu_isa::sse4_2: return hit_batch_sse4(first, n, origin, inv_dir, t_min, t_max);
+#endif
+		default: return hit_batch_scalar(first, n, origin, inv_dir, t_min, t_max);
+	}
+}
+
+SIMD_FLATTEN int box_set::hit_batch_scalar(int first, int n, const point3& origin, const vec3& inv_dir, real t_min, real& t_max) const {
+	return hit_batch<simd_real_scalar>(first, n, origin, inv_dir, t_min, t_max);
+}
+
+#ifdef CPU_X86
+SIMD_SSE4 SIMD_FLATTEN int box_set::hit_batch_sse4(int first, int n, const point3& origin, const vec3& inv_dir, real t_min, real& t_max) const {
+	return hit_batch<simd_real_sse4>(first, n, origin, inv_dir, t_min, t_max);
+}
+
+SIMD_AVX2 SIMD_FLATTEN int box_set::hit_batch_avx2(int first, int n, const point3& origin, const vec3& inv_dir, real t_min, real& t_max) const {
+	return hit_batch<simd_real_avx2>(first, n, origin, inv_dir, t_min, t_max);
+}
+
+SIMD_AVX512 SIMD_FLATTEN int box_set::hit_batch_avx512(int first, int n, const point3& origin, const vec3& inv_dir, real t_min, real& t_max) const {
+	return hit_batch<simd_real_avx512>(first, n, origin, inv_dir, t_min, t_max);
+}
+#endif
+
+template <typename V>
+int box_set::hit_batch(int first, int n, const point3& origin, const vec3& inv_dir, real t_min, real& t_max) const {
+	typedef typename V::mask M;
+	static const real lane_index[16] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
+
+	const V ox = V::set1(origin.x()), oy = V::set1(origin.y()), oz = V::set1(origin.z());
+	const V ix = V::set1(inv_dir.x()), iy = V::set1(inv_dir.y()), iz = V::set1(inv_dir.z());
+	const V lo = V::set1(t_min);
+	int nearest = -1;
+
+	for (int i = first; i < first + n; i += V::width) {
+		V hi = V::set1(t_max);
+		V t0x = (V::load(&min_x[i]) - ox) * ix, t1x = (V::load(&max_x[i]) - ox) * ix;
+		V t0y = (V::load(&min_y[i]) - oy) * iy, t1y = (V::load(&max_y[i]) - oy) * iy;
+		V t0z = (V::load(&min_z[i]) - oz) * iz, t1z = (V::load(&max_z[i]) - oz) * iz;
+
+		V enter = simd_max(simd_max(simd_min(t0x, t1x), simd_min(t0y, t1y)), simd_min(t0z, t1z));
+		V exit = simd_min(simd_min(simd_max(t0x, t1x), simd_max(t0y, t1y)), simd_max(t0z, t1z));
+		// From inside a box the hit is where the ray leaves it
+		V t = simd_select(enter >= lo, enter, exit);
+		M valid = (enter <= exit) & (t >= lo) & (t <= hi) &
+			(V::load(lane_index) < V::set1(real(first + n - i)));
+		int hits = simd_bits(valid);
+		if (hits == 0) {
+			continue;
+		}
+
+		real ts[16];
+		simd_store(ts, t);
+		for (int lane = 0; lane < V::width; lane++) {
+			if ((hits >> lane & 1) && ts[lane] < t_max) {
+				t_max = ts[lane];
+				nearest = i + lane;
+			}
+		}
+	}
+	return nearest;
+}
+
+bool box_set::intersect(const ray& ray, real t_min, real t_max, hit_info& hit) const {
+	if (count == 0) {
+		return false;
+	}
+
+	vec3 inv_dir(1 / ray.dir.x(), 1 / ray.dir.y(), 1 / ray.dir.z());
+	int nearest = -1;
+	real nearest_t = t_max;
+	accel.intersect_leaves(ray, t_min, t_max, [&](int first, int n, real& max_t) {
+		int index = hit_batch(first, n, ray.orig, inv_dir, t_min, max_t);
+		if (index < 0) {
+			return false;
+		}
+		nearest = index;
+		nearest_t = max_t;
+		return true;
+	});
+	if (nearest < 0) {
+		return false;
+	}
+
+	hit.t = nearest_t;
+	hit.object = this;
+	hit.prim = nearest;
+	return true;
+}
+
+void box_set::resolve_hit(const ray& ray, const hit_info& hit, hit_record& rec) const {
+	// Only the nearest box needs its face
+	aabb bounds = box_bounds(hit.prim);
+	vec3 inv_dir(1 / ray.dir.x(), 1 / ray.dir.y(), 1 / ray.dir.z());
+	vec3 t0 = (bounds.minimum - ray.orig) * inv_dir;
+	vec3 t1 = (bounds.maximum - ray.orig) * inv_dir;
+
+	rec.t = hit.t;
+	rec.p = ray.at(hit.t);
+	rec.set_face_normal(ray, box_face_normal(ray, component_min(t0, t1), component_max(t0, t1), hit.t));
+	rec.mat_ptr = materials[material_index[hit.prim]];
+}
+
+bool box_set::bounding_box(aabb& output_box) const {
+	output_box = accel.bounds();
+	return accel.prim_count() > 0;
+}
+
+#endif // !BOX_SET_H
@@ -0,0 +1,1182 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "aabb.h"
+#include "ray_packet.h"
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <xmmintrin.h>
+#define BVH_PREFETCH(address) _mm_prefetch(reinterpret_cast<const char*>(address), _MM_HINT_T0)
+#else
+#define BVH_PREFETCH(address) __builtin_prefetch(address)
+#endif
+
+// Order of the nodes in memory after building
+enum class bvh_layout {
+	build_order, // as the builder created them
+	depth_first, // depth first, the child more likely to be hit (larger) right after its parent
+	treelet      // subtrees of likely visited nodes packed together (cache-oblivious)
+};
+
+// Settings for building a bvh
+struct bvh_build_options {
+	int max_leaf_size = 4;
+	int bins = 16; // candidate split planes per axis
+	double traversal_cost = 1.0;
+	double intersection_cost = 1.0;
+
+	// Spatial splits (SBVH): references straddling a split plane are clipped
+	// and put on both sides instead of letting the children overlap.
+	bool spatial_splits = false;
+	// Spatial splits are only tried when the children of the best object split
+	// overlap by more than this fraction of the root surface area
+	double split_alpha = 1e-5;
+	// Extra references allowed by spatial splits, relative to the primitive count
+	double max_reference_growth = 0.3;
+
+	bvh_layout layout = bvh_layout::depth_first;
+	int treelet_size = 64; // nodes per treelet, 64 nodes fill a 4KB page
+};
+
+// Counters for comparing the quality of different builds
+struct bvh_stats {
+	long long rays = 0;
+	long long nodes_visited = 0;
+	long long primitives_tested = 0;
+};
+
+// Bounds stored in a node. Unlike aabb it has no SIMD padding, which keeps
+// a node at 64 bytes, one cache line (40 bytes in float builds).
+struct bvh_box {
+	real minimum[3];
+	real maximum[3];
+
+	bvh_box() : bvh_box(aabb()) {}
+	bvh_box(const aabb& box)
+		: minimum{ box.minimum.x(), box.minimum.y(), box.minimum.z() },
+		maximum{ box.maximum.x(), box.maximum.y(), box.maximum.z() } {}
+
+	operator aabb() const {
+		return aabb(point3(minimum[0], minimum[1], minimum[2]), point3(maximum[0], maximum[1], maximum[2]));
+	}
+
+	double surface_area() const { return aabb(*this).surface_area(); }
+	void grow(const aabb& box) { *this = surrounding_box(*this, box); }
+
+	// Same slab test as aabb::hit
+	bool hit(const point3& origin, const vec3& inv_dir, real& t_min, real& t_max) const {
+		for (int a = 0; a < 3; a++) {
+			auto t0 = (minimum[a] - origin.e[a]) * inv_dir.e[a];
+			auto t1 = (maximum[a] - origin.e[a]) * inv_dir.e[a];
+			if (inv_dir.e[a] < 0) {
+				std::swap(t0, t1);
+			}
+			t_min = t0 > t_min ? t0 : t_min;
+			t_max = t1 < t_max ? t1 : t_max;
+			if (t_max < t_min) {
+				return false;
+			}
+		}
+		return true;
+	}
+};
+
+// Flattened tree node
+struct bvh_node {
+	bvh_box box;
+	int left;  // inner node: index of the left child, leaf: first entry in prim_indices
+	int right; // inner node: index of the right child
+	int count; // number of primitives in a leaf, 0 for inner nodes
+	int axis;  // split axis, used to visit the nearer child first
+
+	bool is_leaf() const { return count > 0; }
+};
+
+// Bounding volume hierarchy over primitives given only by their bounds.
+// The owner does the actual primitive tests in a callback during traversal.
+class bvh {
+	public:
+		// Clips primitive `prim`, already limited to `box`, at the plane `pos` on `axis`
+		// and returns the bounds of the parts on each side of it.
+		using split_function = std::function<void(
+			int prim, int axis, real pos, const aabb& box, aabb& left, aabb& right)>;
+
+		// Storage of a tree built in memory. Empty when the tree lives in
+		// external storage instead, see attach().
+		std::vector<bvh_node> nodes;
+		std::vector<int> prim_indices; // primitives of the leaves, may contain duplicates with spatial splits
+		mutable bvh_stats stats;
+
+	public:
+		bvh() {}
+		bvh(const std::vector<aabb>& bounds, const bvh_build_options& options = bvh_build_options(),
+			split_function split = nullptr) {
+			build(bounds, options, split);
+		}
+
+		// Traversal points into the own storage, so copies would dangle
+		bvh(const bvh&) = delete;
+		bvh& operator=(const bvh&) = delete;
+
+		void build(const std::vector<aabb>& bounds, const bvh_build_options& options = bvh_build_options(),
+			split_function split = nullptr);
+
+		// Uses a tree kept in external storage, e.g. a memory-mapped cache file.
+		// `storage` is held on to for as long as the tree is in use.
+		void attach(shared_ptr<const void> storage, const bvh_node* node_array, size_t node_count,
+			const int* prim_array, size_t prim_count);
+
+		size_t node_count() const { return node_total; }
+		size_t prim_count() const { return prim_total; }
+		const bvh_node* node_array() const { return node_data; }
+		const int* prim_array() const { return prim_data; }
+
+		aabb bounds() const {
+			return node_total == 0 ? aabb() : aabb(node_data[0].box);
+		}
+
+		// Rearranges the nodes in memory, keeping the tree the same
+		void reorder(bvh_layout layout, int treelet_size = 64);
+
+		// Incremental updates, for trees built without spatial splits.
+		// insert() puts the primitive next to the node where it adds the least
+		// surface area. Both return the depth of the deepest leaf afterwards,
+		// which rotations can change anywhere on the way up; a depth of
+		// max_depth - 1 or more means the tree has to be rebuilt before tracing.
+		// remove() needs the bounds of all primitives still in the tree.
+		int insert(int prim, const aabb& box);
+		int remove(int prim, const std::vector<aabb>& prim_bounds);
+
+		static const int max_depth = 64;
+
+		// Visits the leaves the ray passes through, nearest first.
+		// hit_primitive(prim, t_max) returns true on a hit and lowers t_max to its distance.
+		template <typename F>
+		bool intersect(const ray& r, real t_min, real t_max, F&& hit_primitive) const;
+
+		// Same, but hands over whole leaves, for owners that test their primitives
+		// in batches: hit_leaf(first, count, t_max) tests the primitives
+		// prim_array()[first] to prim_array()[first + count - 1].
+		template <typename F>
+		bool intersect_leaves(const ray& r, real t_min, real t_max, F&& hit_leaf) const;
+
+		// Visits the leaves that any active ray of the packet passes through,
+		// with the mask of the rays that reach each one. hit_leaf(first, count,
+		// active) tests those rays against the leaf, lowers rays.t_max of the
+		// ones it hits and returns them as a mask; returns all rays that hit.
+		template <int N, typename F>
+		int intersect_packet(ray_packet<N>& rays, int active, F&& hit_leaf) const;
+
+	private:
+		struct reference {
+			aabb box;
+			int prim;
+		};
+
+		struct bin {
+			aabb box;
+			int count = 0; // references whose centroid falls in the bin (object splits)
+			int enter = 0; // references starting in the bin (spatial splits)
+			int exit = 0;  // references ending in the bin (spatial splits)
+		};
+
+		struct split_candidate {
+			double cost = infinity;
+			int axis = -1;
+			real pos = 0;
+			bool spatial = false;
+			aabb left_box;
+			aabb right_box;
+		};
+
+		// What traversal reads: the vectors above or external storage
+		const bvh_node* node_data = nullptr;
+		const int* prim_data = nullptr;
+		size_t node_total = 0;
+		size_t prim_total = 0;
+		shared_ptr<const void> external;
+
+		bvh_build_options opts;
+		split_function splitter;
+		double root_area = 0;
+		size_t reference_count = 0;
+		size_t reference_budget = 0;
+
+		void use_own_storage() {
+			external.reset();
+			node_data = nodes.data();
+			node_total = nodes.size();
+			prim_data = prim_indices.data();
+			prim_total = prim_indices.size();
+		}
+
+		// State for incremental updates, set up on the first edit
+		bool edits_ready = false;
+		std::vector<int> parents;
+		std::vector<int> heights; // levels below each node, 0 for leaves
+		std::vector<int> prim_leaf; // leaf holding each primitive, -1 if none
+		std::vector<int> free_nodes;
+		std::vector<int> free_prims; // entries of prim_indices no leaf uses
+
+		void prepare_edits();
+		int find_heights(int index);
+		int allocate_node();
+		int allocate_prim(int prim);
+		int find_sibling(const aabb& box) const;
+		void replace_child(int parent, int old_child, int new_child);
+		void move_node(int from, int to);
+		void update_inner(int index);
+		void rotate(int index);
+		void refit(int index);
+
+		int build_node(std::vector<reference>& refs, int depth);
+		int make_leaf(int index, const std::vector<reference>& refs);
+		split_candidate find_object_split(const std::vector<reference>& refs, const aabb& box) const;
+		split_candidate find_spatial_split(const std::vector<reference>& refs, const aabb& box) const;
+		void partition_object(const std::vector<reference>& refs, const split_candidate& split,
+			std::vector<reference>& left, std::vector<reference>& right) const;
+		void partition_spatial(const std::vector<reference>& refs, const split_candidate& split,
+			std::vector<reference>& left, std::vector<reference>& right) const;
+
+		double sah_cost(const aabb& left, int left_count, const aabb& right, int right_count, double area) const {
+			return opts.traversal_cost + opts.intersection_cost *
+				(left.surface_area() * left_count + right.surface_area() * right_count) / area;
+		}
+
+		int bin_index(real value, real start, real scale) const {
+			int b = static_cast<int>((value - start) * scale);
+			return b < 0 ? 0 : (b >= opts.bins ? opts.bins - 1 : b);
+		}
+};
+
+void bvh::build(const std::vector<aabb>& bounds, const bvh_build_options& options, split_function split) {
+	opts = options;
+	splitter = split;
+	nodes.clear();
+	prim_indices.clear();
+	stats = bvh_stats();
+	edits_ready = false;
+	use_own_storage();
+
+	std::vector<reference> refs;
+	refs.reserve(bounds.size());
+	aabb root;
+	for (int i = 0; i < static_cast<int>(bounds.size()); i++) {
+		if (!bounds[i].empty()) {
+			refs.push_back({ bounds[i], i });
+			root.grow(bounds[i]);
+		}
+	}
+	if (refs.empty()) {
+		return;
+	}
+
+	root_area = root.surface_area();
+	reference_count = refs.size();
+	reference_budget = static_cast<size_t>(refs.size() * (1 + opts.max_reference_growth));
+	nodes.reserve(2 * refs.size());
+	build_node(refs, 0);
+	reorder(opts.layout, opts.treelet_size);
+	use_own_storage();
+}
+
+void bvh::attach(shared_ptr<const void> storage, const bvh_node* node_array, size_t node_count,
+	const int* prim_array, size_t prim_count) {
+	std::vector<bvh_node>().swap(nodes);
+	std::vector<int>().swap(prim_indices);
+	stats = bvh_stats();
+	edits_ready = false;
+	external = storage;
+	node_data = node_array;
+	node_total = node_count;
+	prim_data = prim_array;
+	prim_total = prim_count;
+}
+
+void bvh::reorder(bvh_layout layout, int treelet_size) {
+	if (layout == bvh_layout::build_order || nodes.empty()) {
+		return;
+	}
+
+	// The child with the larger surface area is the one rays hit more often
+	auto larger_first = [this](const bvh_node& node) {
+		bool left_larger = nodes[node.left].box.surface_area() >= nodes[node.right].box.surface_area();
+		return left_larger ? std::make_pair(node.left, node.right) : std::make_pair(node.right, node.left);
+	};
+
+	std::vector<int> order; // old node indices in their new order
+	order.reserve(nodes.size());
+
+	if (layout == bvh_layout::depth_first) {
+		std::vector<int> stack{ 0 };
+		while (!stack.empty()) {
+			int index = stack.back();
+			stack.pop_back();
+			order.push_back(index);
+			if (!nodes[index].is_leaf()) {
+				auto children = larger_first(nodes[index]);
+				stack.push_back(children.second);
+				stack.push_back(children.first);
+			}
+		}
+	}
+	else {
+		// Grow each treelet from its root by always adding the largest node on
+		// its border; the border left over becomes the roots of the next treelets
+		auto by_area = [this](int a, int b) {
+			return nodes[a].box.surface_area() < nodes[b].box.surface_area();
+		};
+		std::vector<int> roots{ 0 };
+		while (!roots.empty()) {
+			int root = roots.back();
+			roots.pop_back();
+
+			std::priority_queue<int, std::vector<int>, decltype(by_area)> border(by_area);
+			border.push(root);
+			for (int count = 0; count < treelet_size && !border.empty(); count++) {
+				int index = border.top();
+				border.pop();
+				order.push_back(index);
+				if (!nodes[index].is_leaf()) {
+					border.push(nodes[index].left);
+					border.push(nodes[index].right);
+				}
+			}
+
+			std::vector<int> next;
+			while (!border.empty()) {
+				next.push_back(border.top());
+				border.pop();
+			}
+			// Largest subtree on top of the stack
+			roots.insert(roots.end(), next.rbegin(), next.rend());
+		}
+	}
+
+	std::vector<int> new_index(nodes.size());
+	for (int i = 0; i < static_cast<int>(order.size()); i++) {
+		new_index[order[i]] = i;
+	}
+	std::vector<bvh_node> reordered(nodes.size());
+	for (int i = 0; i < static_cast<int>(order.size()); i++) {
+		bvh_node node = nodes[order[i]];
+		if (!node.is_leaf()) {
+			node.left = new_index[node.left];
+			node.right = new_index[node.right];
+		}
+		reordered[i] = node;
+	}
+	nodes.swap(reordered);
+	edits_ready = false;
+	use_own_storage();
+}
+
+void bvh::prepare_edits() {
+	if (edits_ready) {
+		return;
+	}
+	if (nodes.empty() && node_total > 0) {
+		// Attached trees are read-only, edit a copy
+		nodes.assign(node_data, node_data + node_total);
+		prim_indices.assign(prim_data, prim_data + prim_total);
+		use_own_storage();
+	}
+
+	parents.assign(nodes.size(), -1);
+	heights.assign(nodes.size(), 0);
+	prim_leaf.clear();
+	free_nodes.clear();
+	free_prims.clear();
+	std::vector<char> used(prim_indices.size(), 0);
+	for (int i = 0; i < static_cast<int>(nodes.size()); i++) {
+		const bvh_node& node = nodes[i];
+		if (!node.is_leaf()) {
+			parents[node.left] = i;
+			parents[node.right] = i;
+			continue;
+		}
+		for (int k = node.left; k < node.left + node.count; k++) {
+			if (prim_indices[k] >= static_cast<int>(prim_leaf.size())) {
+				prim_leaf.resize(prim_indices[k] + 1, -1);
+			}
+			prim_leaf[prim_indices[k]] = i;
+			used[k] = 1;
+		}
+	}
+	for (int k = static_cast<int>(used.size()) - 1; k >= 0; k--) {
+		if (!used[k]) {
+			free_prims.push_back(k);
+		}
+	}
+	if (!nodes.empty()) {
+		find_heights(0);
+	}
+	edits_ready = true;
+}
+
+// Fills in the heights of a subtree, recursing as deep as the tree goes
+int bvh::find_heights(int index) {
+	const bvh_node& node = nodes[index];
+	if (node.is_leaf()) {
+		return heights[index] = 0;
+	}
+	return heights[index] = 1 + std::max(find_heights(node.left), find_heights(node.right));
+}
+
+int bvh::allocate_node() {
+	if (!free_nodes.empty()) {
+		int index = free_nodes.back();
+		free_nodes.pop_back();
+		return index;
+	}
+	nodes.emplace_back();
+	parents.push_back(-1);
+	heights.push_back(0);
+	return static_cast<int>(nodes.size()) - 1;
+}
+
+// An entry of prim_indices for a new leaf, taking back one that removals
+// freed before growing the array
+int bvh::allocate_prim(int prim) {
+	if (!free_prims.empty()) {
+		int index = free_prims.back();
+		free_prims.pop_back();
+		prim_indices[index] = prim;
+		return index;
+	}
+	prim_indices.push_back(prim);
+	return static_cast<int>(prim_indices.size()) - 1;
+}
+
+// Branch and bound search for the node whose bounds grow the tree least when
+// the box is put next to it. Growing a node also grows all its ancestors.
+int bvh::find_sibling(const aabb& box) const {
+	double box_area = box.surface_area();
+	int best = 0;
+	double best_cost = surrounding_box(nodes[0].box, box).surface_area();
+
+	// (lower bound of the cost below the node, node, area its ancestors grew by)
+	using candidate = std::tuple<double, int, double>;
+	std::priority_queue<candidate, std::vector<candidate>, std::greater<candidate>> queue;
+	queue.emplace(box_area, 0, 0.0);
+
+	while (!queue.empty()) {
+		double bound = std::get<0>(queue.top());
+		int index = std::get<1>(queue.top());
+		double inherited = std::get<2>(queue.top());
+		queue.pop();
+		if (bound >= best_cost) {
+			break;
+		}
+
+		const bvh_node& node = nodes[index];
+		double direct = surrounding_box(node.box, box).surface_area();
+		if (direct + inherited < best_cost) {
+			best_cost = direct + inherited;
+			best = index;
+		}
+
+		if (!node.is_leaf()) {
+			double child_inherited = inherited + direct - node.box.surface_area();
+			double child_bound = box_area + child_inherited;
+			if (child_bound < best_cost) {
+				queue.emplace(child_bound, node.left, child_inherited);
+				queue.emplace(child_bound, node.right, child_inherited);
+			}
+		}
+	}
+	return best;
+}
+
+void bvh::replace_child(int parent, int old_child, int new_child) {
+	if (nodes[parent].left == old_child) {
+		nodes[parent].left = new_child;
+	}
+	else {
+		nodes[parent].right = new_child;
+	}
+	parents[new_child] = parent;
+}
+
+// Moves a node to another slot, relinking its parent and children
+void bvh::move_node(int from, int to) {
+	nodes[to] = nodes[from];
+	parents[to] = parents[from];
+	heights[to] = heights[from];
+	const bvh_node& node = nodes[to];
+	if (node.is_leaf()) {
+		for (int k = node.left; k < node.left + node.count; k++) {
+			prim_leaf[prim_indices[k]] = to;
+		}
+	}
+	else {
+		parents[node.left] = to;
+		parents[node.right] = to;
+	}
+	if (parents[to] >= 0) {
+		replace_child(parents[to], from, to);
+	}
+}
+
+void bvh::update_inner(int index) {
+	bvh_node& node = nodes[index];
+	const aabb& left = nodes[node.left].box;
+	const aabb& right = nodes[node.right].box;
+	node.box = surrounding_box(left, right);
+	node.count = 0;
+	heights[index] = 1 + std::max(heights[node.left], heights[node.right]);
+
+	// Split axis: the one the children are furthest apart on
+	vec3 d = right.centroid() - left.centroid();
+	node.axis = fabs(d.x()) > fabs(d.y()) ? (fabs(d.x()) > fabs(d.z()) ? 0 : 2) : (fabs(d.y()) > fabs(d.z()) ? 1 : 2);
+	// The traversal takes the left child as the one on the lower side
+	if (d[node.axis] < 0) {
+		std::swap(node.left, node.right);
+	}
+}
+
+// Tree rotation: swaps a child with a grandchild on the other side when that
+// shrinks the other child's bounds
+void bvh::rotate(int index) {
+	const bvh_node& node = nodes[index];
+	int children[2] = { node.left, node.right };
+
+	double best_gain = 0;
+	int best_child = -1, best_grandchild = -1;
+	for (int c = 0; c < 2; c++) {
+		int other = children[1 - c];
+		const bvh_node& sibling = nodes[children[c]];
+		if (sibling.is_leaf()) {
+			continue;
+		}
+		int grandchildren[2] = { sibling.left, sibling.right };
+		for (int g = 0; g < 2; g++) {
+			// `other` takes the place of grandchild g
+			double area = surrounding_box(nodes[other].box, nodes[grandchildren[1 - g]].box).surface_area();
+			double gain = sibling.box.surface_area() - area;
+			if (gain > best_gain) {
+				best_gain = gain;
+				best_child = other;
+				best_grandchild = grandchildren[g];
+			}
+		}
+	}
+	if (best_child < 0) {
+		return;
+	}
+
+	int sibling = parents[best_grandchild];
+	replace_child(index, best_child, best_grandchild);
+	replace_child(sibling, best_grandchild, best_child);
+	update_inner(sibling);
+	update_inner(index);
+}
+
+// Recomputes the bounds from a node up to the root, rotating on the way
+void bvh::refit(int index) {
+	while (index >= 0) {
+		update_inner(index);
+		rotate(index);
+		index = parents[index];
+	}
+}
+
+int bvh::insert(int prim, const aabb& box) {
+	prepare_edits();
+	if (prim >= static_cast<int>(prim_leaf.size())) {
+		prim_leaf.resize(prim + 1, -1);
+	}
+
+	int leaf = allocate_node();
+	nodes[leaf].box = box;
+	nodes[leaf].left = allocate_prim(prim);
+	nodes[leaf].right = -1;
+	nodes[leaf].count = 1;
+	nodes[leaf].axis = 0;
+	heights[leaf] = 0;
+	prim_leaf[prim] = leaf;
+
+	if (leaf == 0) {
+		// First primitive of an empty tree
+		use_own_storage();
+		return 0;
+	}
+
+	int sibling = find_sibling(box);
+	int inner = allocate_node();
+	int parent = parents[sibling];
+	if (sibling == 0) {
+		// Traversal starts at node 0, so the new parent has to take its slot
+		move_node(0, inner);
+		sibling = inner;
+		inner = 0;
+	}
+	nodes[inner].left = sibling;
+	nodes[inner].right = leaf;
+	parents[sibling] = inner;
+	parents[leaf] = inner;
+	parents[inner] = parent;
+	if (parent >= 0) {
+		replace_child(parent, sibling, inner);
+	}
+	refit(inner);
+	use_own_storage();
+	return heights[0];
+}
+
+int bvh::remove(int prim, const std::vector<aabb>& prim_bounds) {
+	prepare_edits();
+	if (prim >= static_cast<int>(prim_leaf.size()) || prim_leaf[prim] < 0) {
+		return nodes.empty() ? 0 : heights[0];
+	}
+	int leaf = prim_leaf[prim];
+	prim_leaf[prim] = -1;
+
+	bvh_node& node = nodes[leaf];
+	if (node.count > 1) {
+		// Swap it to the end of the leaf's range and shrink the range
+		int last = node.left + node.count - 1;
+		for (int k = node.left; k < last; k++) {
+			if (prim_indices[k] == prim) {
+				std::swap(prim_indices[k], prim_indices[last]);
+				break;
+			}
+		}
+		node.count--;
+		free_prims.push_back(last);
+		node.box = aabb();
+		for (int k = node.left; k < node.left + node.count; k++) {
+			node.box.grow(prim_bounds[prim_indices[k]]);
+		}
+		if (parents[leaf] >= 0) {
+			refit(parents[leaf]);
+		}
+		use_own_storage();
+		return heights[0];
+	}
+
+	int parent = parents[leaf];
+	if (parent < 0) {
+		// That was the last primitive
+		nodes.clear();
+		prim_indices.clear();
+		parents.clear();
+		heights.clear();
+		free_nodes.clear();
+		free_prims.clear();
+		use_own_storage();
+		return 0;
+	}
+
+	// The sibling takes the place of the parent
+	int sibling = nodes[parent].left == leaf ? nodes[parent].right : nodes[parent].left;
+	int grandparent = parents[parent];
+	free_nodes.push_back(leaf);
+	free_prims.push_back(nodes[leaf].left);
+	if (grandparent < 0) {
+		parents[sibling] = -1;
+		move_node(sibling, 0);
+		free_nodes.push_back(sibling);
+	}
+	else {
+		replace_child(grandparent, parent, sibling);
+		free_nodes.push_back(parent);
+		refit(grandparent);
+	}
+	use_own_storage();
+	return heights[0];
+}
+
+int bvh::make_leaf(int index, const std::vector<reference>& refs) {
+	bvh_node& node = nodes[index];
+	node.left = static_cast<int>(prim_indices.size());
+	node.right = -1;
+	node.count = static_cast<int>(refs.size());
+	node.axis = 0;
+	for (const auto& ref : refs) {
+		prim_indices.push_back(ref.prim);
+	}
+	return index;
+}
+
+int bvh::build_node(std::vector<reference>& refs, int depth) {
+	int index = static_cast<int>(nodes.size());
+	nodes.emplace_back();
+
+	aabb box;
+	for (const auto& ref : refs) {
+		box.grow(ref.box);
+	}
+	nodes[index].box = box;
+
+	int n = static_cast<int>(refs.size());
+	if (n == 1 || depth >= max_depth - 2) {
+		return make_leaf(index, refs);
+	}
+
+	split_candidate split = find_object_split(refs, box);
+
+	// Overlapping children mean rays have to visit both of them; clipping the
+	// straddling references may give a cheaper split.
+	if (opts.spatial_splits && splitter && reference_count < reference_budget && split.axis >= 0) {
+		aabb overlap = intersection(split.left_box, split.right_box);
+		if (overlap.surface_area() > opts.split_alpha * root_area) {
+			split_candidate spatial = find_spatial_split(refs, box);
+			if (spatial.cost < split.cost) {
+				split = spatial;
+			}
+		}
+	}
+
+	if (n <= opts.max_leaf_size && opts.intersection_cost * n <= split.cost) {
+		return make_leaf(index, refs);
+	}
+
+	std::vector<reference> left, right;
+	if (split.spatial) {
+		partition_spatial(refs, split, left, right);
+		if (left.empty() || right.empty()) {
+			left.clear();
+			right.clear();
+			split = find_object_split(refs, box);
+			split.spatial = false;
+		}
+		else {
+			reference_count += left.size() + right.size() - refs.size();
+		}
+	}
+	if (!split.spatial) {
+		if (split.axis >= 0) {
+			partition_object(refs, split, left, right);
+		}
+		if (left.empty() || right.empty()) {
+			// All centroids coincide: any split is as good as another
+			if (n <= opts.max_leaf_size) {
+				return make_leaf(index, refs);
+			}
+			left.assign(refs.begin(), refs.begin() + n / 2);
+			right.assign(refs.begin() + n / 2, refs.end());
+		}
+	}
+
+	nodes[index].axis = split.axis < 0 ? 0 : split.axis;
+	nodes[index].count = 0;
+
+	// The parent's references are no longer needed
+	std::vector<reference>().swap(refs);
+
+	int l = build_node(left, depth + 1);
+	int r = build_node(right, depth + 1);
+	nodes[index].left = l;
+	nodes[index].right = r;
+	return index;
+}
+
+bvh::split_candidate bvh::find_object_split(const std::vector<reference>& refs, const aabb& box) const {
+	split_candidate best;
+
+	aabb centroids;
+	for (const auto& ref : refs) {
+		centroids.grow(ref.box.centroid());
+	}
+
+	double area = box.surface_area();
+	std::vector<bin> bins(opts.bins);
+	std::vector<aabb> right_boxes(opts.bins);
+
+	for (int axis = 0; axis < 3; axis++) {
+		real start = centroids.minimum[axis];
+		real extent = centroids.maximum[axis] - start;
+		if (extent <= 0) {
+			continue;
+		}
+		real scale = opts.bins / extent;
+
+		std::fill(bins.begin(), bins.end(), bin());
+		for (const auto& ref : refs) {
+			bin& b = bins[bin_index(ref.box.centroid()[axis], start, scale)];
+			b.box.grow(ref.box);
+			b.count++;
+		}
+
+		// Sweep from the right to get the bounds of everything right of each plane
+		aabb right_box;
+		for (int i = opts.bins - 1; i > 0; i--) {
+			right_box.grow(bins[i].box);
+			right_boxes[i] = right_box;
+		}
+
+		aabb left_box;
+		int left_count = 0;
+		int right_count = static_cast<int>(refs.size());
+		for (int i = 0; i < opts.bins - 1; i++) {
+			left_box.grow(bins[i].box);
+			left_count += bins[i].count;
+			right_count -= bins[i].count;
+			if (left_count == 0 || right_count == 0) {
+				continue;
+			}
+			double cost = sah_cost(left_box, left_count, right_boxes[i + 1], right_count, area);
+			if (cost < best.cost) {
+				best.cost = cost;
+				best.axis = axis;
+				best.pos = start + (i + 1) / scale;
+				best.spatial = false;
+				best.left_box = left_box;
+				best.right_box = right_boxes[i + 1];
+			}
+		}
+	}
+	return best;
+}
+
+bvh::split_candidate bvh::find_spatial_split(const std::vector<reference>& refs, const aabb& box) const {
+	split_candidate best;
+
+	double area = box.surface_area();
+	std::vector<bin> bins(opts.bins);
+	std::vector<aabb> right_boxes(opts.bins);
+
+	for (int axis = 0; axis < 3; axis++) {
+		real start = box.minimum[axis];
+		real extent = box.maximum[axis] - start;
+		if (extent <= 0) {
+			continue;
+		}
+		real scale = opts.bins / extent;
+		real width = extent / opts.bins;
+
+		std::fill(bins.begin(), bins.end(), bin());
+		for (const auto& ref : refs) {
+			int first = bin_index(ref.box.minimum[axis], start, scale);
+			int last = bin_index(ref.box.maximum[axis], start, scale);
+
+			// Chop the reference into one piece per bin it covers
+			aabb rest = ref.box;
+			for (int i = first; i < last; i++) {
+				aabb left, right;
+				splitter(ref.prim, axis, start + (i + 1) * width, rest, left, right);
+				bins[i].box.grow(left);
+				rest = right;
+			}
+			bins[last].box.grow(rest);
+			bins[first].enter++;
+			bins[last].exit++;
+		}
+
+		aabb right_box;
+		for (int i = opts.bins - 1; i > 0; i--) {
+			right_box.grow(bins[i].box);
+			right_boxes[i] = right_box;
+		}
+
+		aabb left_box;
+		int left_count = 0;
+		int right_count = static_cast<int>(refs.size());
+		for (int i = 0; i < opts.bins - 1; i++) {
+			left_box.grow(bins[i].box);
+			left_count += bins[i].enter;
+			right_count -= bins[i].exit;
+			if (left_count == 0 || right_count == 0) {
+				continue;
+			}
+			double cost = sah_cost(left_box, left_count, right_boxes[i + 1], right_count, area);
+			if (cost < best.cost) {
+				best.cost = cost;
+				best.axis = axis;
+				best.pos = start + (i + 1) * width;
+				best.spatial = true;
+				best.left_box = left_box;
+				best.right_box = right_boxes[i + 1];
+			}
+		}
+	}
+	return best;
+}
+
+void bvh::partition_object(const std::vector<reference>& refs, const split_candidate& split,
+	std::vector<reference>& left, std::vector<reference>& right) const {
+	for (const auto& ref : refs) {
+		if (ref.box.centroid()[split.axis] < split.pos) {
+			left.push_back(ref);
+		}
+		else {
+			right.push_back(ref);
+		}
+	}
+}
+
+void bvh::partition_spatial(const std::vector<reference>& refs, const split_candidate& split,
+	std::vector<reference>& left, std::vector<reference>& right) const {
+	int axis = split.axis;
+	aabb left_box, right_box;
+	std::vector<const reference*> straddling;
+
+	for (const auto& ref : refs) {
+		if (ref.box.maximum[axis] <= split.pos) {
+			left.push_back(ref);
+			left_box.grow(ref.box);
+		}
+		else if (ref.box.minimum[axis] >= split.pos) {
+			right.push_back(ref);
+			right_box.grow(ref.box);
+		}
+		else {
+			straddling.push_back(&ref);
+		}
+	}
+
+	// Reference unsplitting: keep a straddling reference whole on one side when
+	// that is cheaper than duplicating it
+	for (const reference* ref : straddling) {
+		aabb l, r;
+		splitter(ref->prim, axis, split.pos, ref->box, l, r);
+		if (l.empty() || r.empty()) {
+			if (l.empty()) {
+				right.push_back({ r.empty() ? ref->box : r, ref->prim });
+				right_box.grow(ref->box);
+			}
+			else {
+				left.push_back({ l, ref->prim });
+				left_box.grow(l);
+			}
+			continue;
+		}
+
+		double n_left = static_cast<double>(left.size());
+		double n_right = static_cast<double>(right.size());
+		double split_cost = surrounding_box(left_box, l).surface_area() * (n_left + 1) +
+			surrounding_box(right_box, r).surface_area() * (n_right + 1);
+		double left_cost = surrounding_box(left_box, ref->box).surface_area() * (n_left + 1) +
+			right_box.surface_area() * n_right;
+		double right_cost = left_box.surface_area() * n_left +
+			surrounding_box(right_box, ref->box).surface_area() * (n_right + 1);
+
+		if (left_cost < split_cost && left_cost <= right_cost) {
+			left.push_back(*ref);
+			left_box.grow(ref->box);
+		}
+		else if (right_cost < split_cost) {
+			right.push_back(*ref);
+			right_box.grow(ref->box);
+		}
+		else {
+			left.push_back({ l, ref->prim });
+			right.push_back({ r, ref->prim });
+			left_box.grow(l);
+			right_box.grow(r);
+		}
+	}
+}
+
+template <typename F>
+bool bvh::intersect(const ray& r, real t_min, real t_max, F&& hit_primitive) const {
+	return intersect_leaves(r, t_min, t_max, [&](int first, int count, real& max_t) {
+		bool hit_anything = false;
+		for (int i = first; i < first + count; i++) {
+			if (hit_primitive(prim_data[i], max_t)) {
+				hit_anything = true;
+			}
+		}
+		return hit_anything;
+	});
+}
+
+template <typename F>
+bool bvh::intersect_leaves(const ray& r, real t_min, real t_max, F&& hit_leaf) const {
+	if (node_total == 0) {
+		return false;
+	}
+	stats.rays++;
+
+	vec3 inv_dir(1 / r.dir.x(), 1 / r.dir.y(), 1 / r.dir.z());
+	bool dir_is_neg[3] = { inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0 };
+
+	int stack[max_depth];
+	int top = 0;
+	stack[top++] = 0;
+	bool hit_anything = false;
+
+	while (top > 0) {
+		const bvh_node& node = node_data[stack[--top]];
+		stats.nodes_visited++;
+
+		real t0 = t_min, t1 = t_max;
+		if (!node.box.hit(r.orig, inv_dir, t0, t1)) {
+			continue;
+		}
+
+		if (node.is_leaf()) {
+			stats.primitives_tested += node.count;
+			if (hit_leaf(node.left, node.count, t_max)) {
+				hit_anything = true;
+			}
+		}
+		else {
+			// Pushed last, popped first: the nearer child. Start loading the far
+			// one while the near subtree is tested.
+			int near_child = dir_is_neg[node.axis] ? node.right : node.left;
+			int far_child = dir_is_neg[node.axis] ? node.left : node.right;
+			BVH_PREFETCH(&node_data[far_child]);
+			stack[top++] = far_child;
+			stack[top++] = near_child;
+		}
+	}
+	return hit_anything;
+}
+
+// Inner nodes are tested against the whole packet at once: with the origins
+// and inverse directions of the rays bounded by intervals, interval
+// arithmetic gives the earliest entry and latest exit of any of them, and if
+// even those don't overlap no ray can hit the node (frustum culling). Only
+// leaves test each ray, so their primitives see just the rays that reach
+// them. The bounds only hold when all rays go the same way on each axis;
+// other packets test each ray at every node.
+template <int N, typename F>
+int bvh::intersect_packet(ray_packet<N>& rays, int active, F&& hit_leaf) const {
+	if (node_total == 0 || active == 0) {
+		return 0;
+	}
+
+	const real* origin[3] = { rays.ox, rays.oy, rays.oz };
+	const real* direction[3] = { rays.dx, rays.dy, rays.dz };
+	real inv_dir[3][N];
+	for (int a = 0; a < 3; a++) {
+		for (int i = 0; i < N; i++) {
+			inv_dir[a][i] = 1 / direction[a][i];
+		}
+	}
+
+	// Bounds of the active rays
+	real origin_lo[3], origin_hi[3], inv_lo[3], inv_hi[3];
+	real t_lo = infinity, t_hi = -infinity;
+	bool coherent = true;
+	int first_ray = 0;
+	while (!(active & (1 << first_ray))) {
+		first_ray++;
+	}
+	for (int a = 0; a < 3; a++) {
+		origin_lo[a] = origin_hi[a] = origin[a][first_ray];
+		inv_lo[a] = inv_hi[a] = inv_dir[a][first_ray];
+	}
+	for (int i = 0; i < N; i++) {
+		if (!(active & (1 << i))) {
+			continue;
+		}
+		stats.rays++;
+		for (int a = 0; a < 3; a++) {
+			origin_lo[a] = std::min(origin_lo[a], origin[a][i]);
+			origin_hi[a] = std::max(origin_hi[a], origin[a][i]);
+			inv_lo[a] = std::min(inv_lo[a], inv_dir[a][i]);
+			inv_hi[a] = std::max(inv_hi[a], inv_dir[a][i]);
+		}
+		t_lo = std::min(t_lo, rays.t_min[i]);
+		t_hi = std::max(t_hi, rays.t_max[i]);
+	}
+	for (int a = 0; a < 3; a++) {
+		coherent = coherent && (inv_lo[a] > 0 || inv_hi[a] < 0)
+			&& std::isfinite(inv_lo[a]) && std::isfinite(inv_hi[a]);
+	}
+
+	bool dir_is_neg[3] = { inv_lo[0] < 0, inv_lo[1] < 0, inv_lo[2] < 0 };
+
+	auto misses_packet = [&](const bvh_box& box) {
+		real enter = t_lo, exit = t_hi;
+		for (int a = 0; a < 3; a++) {
+			real near_plane = dir_is_neg[a] ? box.maximum[a] : box.minimum[a];
+			real far_plane = dir_is_neg[a] ? box.minimum[a] : box.maximum[a];
+			real near_lo = near_plane - origin_hi[a], near_hi = near_plane - origin_lo[a];
+			real far_lo = far_plane - origin_hi[a], far_hi = far_plane - origin_lo[a];
+			enter = std::max(enter, std::min(std::min(near_lo * inv_lo[a], near_lo * inv_hi[a]),
+				std::min(near_hi * inv_lo[a], near_hi * inv_hi[a])));
+			exit = std::min(exit, std::max(std::max(far_lo * inv_lo[a], far_lo * inv_hi[a]),
+				std::max(far_hi * inv_lo[a], far_hi * inv_hi[a])));
+		}
+		return enter > exit;
+	};
+
+	// Slab test of every ray, an axis at a time so the loops over the rays
+	// vectorize
+	auto hit_rays = [&](const bvh_box& box, int mask) {
+		real enter[N], exit[N];
+		for (int i = 0; i < N; i++) {
+			enter[i] = rays.t_min[i];
+			exit[i] = rays.t_max[i];
+		}
+		for (int a = 0; a < 3; a++) {
+			real minimum = box.minimum[a], maximum = box.maximum[a];
+			for (int i = 0; i < N; i++) {
+				real t0 = (minimum - origin[a][i]) * inv_dir[a][i];
+				real t1 = (maximum - origin[a][i]) * inv_dir[a][i];
+				real near = t0 < t1 ? t0 : t1;
+				real far = t0 < t1 ? t1 : t0;
+				enter[i] = near > enter[i] ? near : enter[i];
+				exit[i] = far < exit[i] ? far : exit[i];
+			}
+		}
+		int hits = 0;
+		for (int i = 0; i < N; i++) {
+			hits |= (exit[i] >= enter[i]) << i;
+		}
+		return hits & mask;
+	};
+
+	struct entry {
+		int node;
+		int mask;
+	};
+	entry stack[max_depth];
+	int top = 0;
+	stack[top++] = { 0, active };
+	int hit_mask = 0;
+
+	while (top > 0) {
+		entry e = stack[--top];
+		const bvh_node& node = node_data[e.node];
+		stats.nodes_visited++;
+
+		if (coherent && misses_packet(node.box)) {
+			continue;
+		}
+		int mask = e.mask;
+		if (!coherent || node.is_leaf()) {
+			mask = hit_rays(node.box, mask);
+			if (mask == 0) {
+				continue;
+			}
+		}
+
+		if (node.is_leaf()) {
+			stats.primitives_tested += node.count;
+			int leaf_hits = hit_leaf(node.left, node.count, mask);
+			if (leaf_hits) {
+				hit_mask |= leaf_hits;
+				// Rays got shorter, and so does the packet
+				t_hi = -infinity;
+				for (int i = 0; i < N; i++) {
+					if (active & (1 << i)) {
+						t_hi = std::max(t_hi, rays.t_max[i]);
+					}
+				}
+			}
+		}
+		else {
+			int near_child = dir_is_neg[node.axis] ? node.right : node.left;
+			int far_child = dir_is_neg[node.axis] ? node.left : node.right;
+			BVH_PREFETCH(&node_data[far_child]);
+			stack[top++] = { far_child, mask };
+			stack[top++] = { near_child, mask };
+		}
+	}
+	return hit_mask;
+}
+
+#endif // !BVH_H
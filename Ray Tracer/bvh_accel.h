@@ -0,0 +1,177 @@
+#ifndef BVH_ACCEL_H
+#define BVH_ACCEL_H
+
+#include "hittable.h"
+#include "bvh.h"
+
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+
+// Bounding volume hierarchy over the objects of a scene
+class bvh_accel : public hittable {
+	public:
+		std::vector<shared_ptr<hittable>> objects; // indexed by bvh primitive, nullptr where removed
+		std::vector<shared_ptr<hittable>> unbounded; // objects without bounds, tested for every ray
+		bvh accel;
+
+	public:
+		bvh_accel(const std::vector<shared_ptr<hittable>>& scene_objects,
+			const bvh_build_options& options = bvh_build_options());
+
+		// Scene edits, updating the tree in place instead of rebuilding it
+		void add(shared_ptr<hittable> object);
+		bool remove(const shared_ptr<hittable>& object);
+
+		virtual bool intersect(const ray& ray, real t_min, real t_max, hit_info& hit) const override;
+		virtual int intersect_packet(ray4& rays, int active, hit_info* hits) const override {
+			return intersect_rays(rays, active, hits);
+		}
+		virtual int intersect_packet(ray8& rays, int active, hit_info* hits) const override {
+			return intersect_rays(rays, active, hits);
+		}
+		virtual bool bounding_box(aabb& output_box) const override;
+
+	private:
+		bvh_build_options opts;
+		std::vector<aabb> object_boxes;
+		std::vector<int> free_slots;
+		// Slot of each object in `objects`, filled in on the first removal
+		std::unordered_map<const hittable*, int> slot_of;
+		bool slots_indexed = false;
+
+		template <int N>
+		int intersect_rays(ray_packet<N>& rays, int active, hit_info* hits) const;
+};
+
+bvh_accel::bvh_accel(const std::vector<shared_ptr<hittable>>& scene_objects, const bvh_build_options& options)
+	: opts(options) {
+	// Objects have no splitter, and edits need every object in a single leaf
+	opts.spatial_splits = false;
+
+	aabb box;
+	for (const auto& object : scene_objects) {
+		if (object->bounding_box(box)) {
+			objects.push_back(object);
+			object_boxes.push_back(box);
+		}
+		else {
+			unbounded.push_back(object);
+		}
+	}
+	accel.build(object_boxes, opts);
+}
+
+void bvh_accel::add(shared_ptr<hittable> object) {
+	aabb box;
+	if (!object->bounding_box(box)) {
+		unbounded.push_back(object);
+		return;
+	}
+
+	int slot;
+	if (!free_slots.empty()) {
+		slot = free_slots.back();
+		free_slots.pop_back();
+		objects[slot] = object;
+		object_boxes[slot] = box;
+	}
+	else {
+		slot = static_cast<int>(objects.size());
+		objects.push_back(object);
+		object_boxes.push_back(box);
+	}
+	if (slots_indexed) {
+		slot_of[object.get()] = slot;
+	}
+
+	if (accel.insert(slot, box) >= bvh::max_depth - 1) {
+		// Too deep to traverse, removed objects have empty boxes and are skipped
+		accel.build(object_boxes, opts);
+	}
+}
+
+bool bvh_accel::remove(const shared_ptr<hittable>& object) {
+	auto it = std::find(unbounded.begin(), unbounded.end(), object);
+	if (it != unbounded.end()) {
+		unbounded.erase(it);
+		return true;
+	}
+
+	if (!slots_indexed) {
+		for (int i = 0; i < static_cast<int>(objects.size()); i++) {
+			if (objects[i]) {
+				slot_of[objects[i].get()] = i;
+			}
+		}
+		slots_indexed = true;
+	}
+	auto slot = slot_of.find(object.get());
+	if (slot == slot_of.end()) {
+		return false;
+	}
+
+	int index = slot->second;
+	slot_of.erase(slot);
+	int depth = accel.remove(index, object_boxes);
+	objects[index] = nullptr;
+	object_boxes[index] = aabb();
+	free_slots.push_back(index);
+	if (depth >= bvh::max_depth - 1) {
+		// Rotations on the way up can deepen other parts of the tree
+		accel.build(object_boxes, opts);
+	}
+	return true;
+}
+
+bool bvh_accel::intersect(const ray& ray, real t_min, real t_max, hit_info& hit) const {
+	bool hit_anything = false;
+	auto closest_so_far = t_max;
+
+	for (const auto& object : unbounded) {
+		if (object->intersect(ray, t_min, closest_so_far, hit)) {
+			hit_anything = true;
+			closest_so_far = hit.t;
+		}
+	}
+
+	if (accel.intersect(ray, t_min, closest_so_far, [&](int object, real& max_t) {
+			if (!objects[object]->intersect(ray, t_min, max_t, hit)) {
+				return false;
+			}
+			max_t = hit.t;
+			return true;
+		})) {
+		hit_anything = true;
+	}
+
+	return hit_anything;
+}
+
+template <int N>
+int bvh_accel::intersect_rays(ray_packet<N>& rays, int active, hit_info* hits) const {
+	int hit_mask = 0;
+	for (const auto& object : unbounded) {
+		hit_mask |= object->intersect_packet(rays, active, hits);
+	}
+
+	hit_mask |= accel.intersect_packet(rays, active, [&](int first, int count, int mask) {
+		const int* prims = accel.prim_array();
+		int leaf_hits = 0;
+		for (int i = first; i < first + count; i++) {
+			leaf_hits |= objects[prims[i]]->intersect_packet(rays, mask, hits);
+		}
+		return leaf_hits;
+	});
+
+	return hit_mask;
+}
+
+bool bvh_accel::bounding_box(aabb& output_box) const {
+	output_box = accel.bounds();
+	// Removed objects leave their slots behind, empty
+	bool any_live = objects.size() > free_slots.size();
+	return unbounded.empty() && any_live;
+}
+
+#endif // !BVH_ACCEL_H
@@ -0,0 +1,112 @@
+#ifndef BVH_CACHE_H
+#define BVH_CACHE_H
+
+#include "bvh.h"
+#include "mapped_file.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+// On-disk cache of built bvhs. A cache file holds a header followed by the
+// node array and the primitive indices exactly as they are in memory, so a
+// valid file is memory-mapped and traced directly without building anything.
+//
+// The file is keyed by a hash of the geometry and of the build options; a
+// different key, version or node layout means the tree is rebuilt.
+
+// Bump when the file layout or the builder output changes
+const uint32_t bvh_cache_version = 1;
+
+struct bvh_cache_header {
+	char magic[8];       // "RTBVH\0\0\0"
+	uint32_t version;
+	uint32_t node_size;  // sizeof(bvh_node), catches layout or padding changes
+	uint64_t key;
+	uint64_t node_count;
+	uint64_t prim_count;
+	uint64_t reserved[3]; // pads the header to 64 bytes, keeping the nodes aligned
+};
+
+// FNV-1a, can be chained by passing the previous hash
+inline uint64_t hash_bytes(const void* data, size_t size, uint64_t hash = 14695981039346656037ull) {
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+template <typename T>
+inline uint64_t hash_value(const T& value, uint64_t hash) {
+	return hash_bytes(&value, sizeof(T), hash);
+}
+
+// Key of the bvh built over the given geometry with the given options
+inline uint64_t bvh_cache_key(const void* vertices, size_t vertex_bytes, const void* indices, size_t index_bytes,
+	const bvh_build_options& options) {
+	uint64_t hash = hash_bytes(vertices, vertex_bytes);
+	hash = hash_bytes(indices, index_bytes, hash);
+	hash = hash_value(options.max_leaf_size, hash);
+	hash = hash_value(options.bins, hash);
+	hash = hash_value(options.traversal_cost, hash);
+	hash = hash_value(options.intersection_cost, hash);
+	hash = hash_value(options.spatial_splits, hash);
+	hash = hash_value(options.split_alpha, hash);
+	hash = hash_value(options.max_reference_growth, hash);
+	hash = hash_value(options.layout, hash);
+	hash = hash_value(options.treelet_size, hash);
+	return hash;
+}
+
+// Maps the cache file into memory and attaches the tree in it.
+// Returns false (leaving the bvh alone) if the file is missing or stale.
+inline bool load_bvh_cache(const std::string& path, uint64_t key, bvh& accel) {
+	auto file = mapped_file::open(path);
+	if (!file || file->size() < sizeof(bvh_cache_header)) {
+		return false;
+	}
+
+	bvh_cache_header header;
+	memcpy(&header, file->data(), sizeof(header));
+	if (memcmp(header.magic, "RTBVH", 6) != 0 || header.version != bvh_cache_version ||
+		header.node_size != sizeof(bvh_node) || header.key != key) {
+		return false;
+	}
+	size_t expected = sizeof(header) + header.node_count * sizeof(bvh_node) + header.prim_count * sizeof(int);
+	if (file->size() != expected || header.node_count == 0) {
+		return false;
+	}
+
+	const char* nodes = file->data() + sizeof(header);
+	const char* prims = nodes + header.node_count * sizeof(bvh_node);
+	accel.attach(file, reinterpret_cast<const bvh_node*>(nodes), static_cast<size_t>(header.node_count),
+		reinterpret_cast<const int*>(prims), static_cast<size_t>(header.prim_count));
+	return true;
+}
+
+inline bool save_bvh_cache(const std::string& path, uint64_t key, const bvh& accel) {
+	bvh_cache_header header = {};
+	memcpy(header.magic, "RTBVH", 6);
+	header.version = bvh_cache_version;
+	header.node_size = sizeof(bvh_node);
+	header.key = key;
+	header.node_count = accel.node_count();
+	header.prim_count = accel.prim_count();
+
+	std::ofstream out(path, std::ios::out | std::ios::binary | std::ios::trunc);
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	out.write(reinterpret_cast<const char*>(accel.node_array()), accel.node_count() * sizeof(bvh_node));
+	out.write(reinterpret_cast<const char*>(accel.prim_array()), accel.prim_count() * sizeof(int));
+	out.close();
+	if (!out) {
+		std::remove(path.c_str());
+		return false;
+	}
+	return true;
+}
+
+#endif // !BVH_CACHE_H
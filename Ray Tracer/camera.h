@@ -2,6 +2,7 @@
 #define CAMERA_H
 
 #include "utility_functions.h"
+#include "ray_packet.h"
 
 class camera {
 	private:
@@ -15,8 +16,8 @@ class camera {
 			point3 lookfrom, //the position we place the camera
 			point3 lookat,
 			vec3 vup,
-			double vfov, //vertical field of view in degrees
-			double aspect_ratio
+			real vfov, //vertical field of view in degrees
+			real aspect_ratio
 		) {
 			auto theta = degrees_to_radians(vfov);
 			auto h = tan(theta / 2);
@@ -33,9 +34,42 @@ class camera {
 			lower_left_corner = origin - horizontal / 2 - vertical / 2 - w;
 		}
 
-		ray get_ray(double s, double t) const {
+		ray get_ray(real s, real t) const {
 			return ray(origin, lower_left_corner + s * horizontal + t * vertical - origin);
 		}
+
+		const point3& position() const {
+			return origin;
+		}
+
+		// The (s, t) that get_ray takes to aim at p. False when p is behind
+		// the camera.
+		bool project(const point3& p, real& s, real& t) const {
+			vec3 forward = lower_left_corner + horizontal / 2 + vertical / 2 - origin;
+			vec3 d = p - origin;
+			real depth = dot(d, forward) / forward.length_squared();
+			if (depth <= 0) {
+				return false;
+			}
+			vec3 on_viewport = d / depth - (lower_left_corner - origin);
+			s = dot(on_viewport, horizontal) / horizontal.length_squared();
+			t = dot(on_viewport, vertical) / vertical.length_squared();
+			return true;
+		}
+
+		// get_ray for N points (s[i], t[i]) at once, e.g. the samples of a
+		// pixel. The range of the rays is left to the caller.
+		template <int N>
+		void get_ray_packet(const real* s, const real* t, ray_packet<N>& rays) const {
+			for (int i = 0; i < N; i++) {
+				rays.ox[i] = origin.x();
+				rays.oy[i] = origin.y();
+				rays.oz[i] = origin.z();
+				rays.dx[i] = lower_left_corner.x() + s[i] * horizontal.x() + t[i] * vertical.x() - origin.x();
+				rays.dy[i] = lower_left_corner.y() + s[i] * horizontal.y() + t[i] * vertical.y() - origin.y();
+				rays.dz[i] = lower_left_corner.z() + s[i] * horizontal.z() + t[i] * vertical.z() - origin.z();
+			}
+		}
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,124 @@
+#ifndef CPU_DISPATCH_H
+#define CPU_DISPATCH_H
+
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define CPU_X86
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+// Instruction sets the kernels are compiled for, from oldest to newest. The
+// binary holds all of them and picks one once, at startup, for the cpu it
+// runs on, so one build runs on Haswell as well as on AVX-512 nodes.
+enum class cpu_isa : int { scalar, sse4_2, avx2, avx512 };
+
+inline const char* cpu_isa_name(cpu_isa isa) {
+	switch (isa) {
+		case cpu_isa::sse4_2: return "sse4.2";
+		case cpu_isa::avx2: return "avx2";
+		case cpu_isa::avx512: return "avx512";
+		default: return "scalar";
+	}
+}
+
+// Parses a name given by cpu_isa_name
+inline bool parse_cpu_isa(const std::string& name, cpu_isa& isa) {
+	for (cpu_isa i : { cpu_isa::scalar, cpu_isa::sse4_2, cpu_isa::avx2, cpu_isa::avx512 }) {
+		if (name == cpu_isa_name(i)) {
+			isa = i;
+			return true;
+		}
+	}
+	return false;
+}
+
+#ifdef CPU_X86
+inline void cpuid(unsigned leaf, unsigned subleaf, unsigned regs[4]) {
+#if defined(_MSC_VER)
+	int r[4];
+	__cpuidex(r, leaf, subleaf);
+	for (int i = 0; i < 4; i++) {
+		regs[i] = static_cast<unsigned>(r[i]);
+	}
+#else
+	if (!__get_cpuid_count(leaf, subleaf, &regs[0], &regs[1], &regs[2], &regs[3])) {
+		regs[0] = regs[1] = regs[2] = regs[3] = 0;
+	}
+#endif
+}
+
+// Register state the operating system saves on a context switch
+inline unsigned long long xgetbv0() {
+#if defined(_MSC_VER)
+	return _xgetbv(0);
+#else
+	unsigned lo, hi;
+	__asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+	return (static_cast<unsigned long long>(hi) << 32) | lo;
+#endif
+}
+#endif
+
+// Newest instruction set that both the cpu and the operating system support
+inline cpu_isa detect_cpu_isa() {
+#ifdef CPU_X86
+	unsigned leaf0[4], leaf1[4], leaf7[4];
+	cpuid(0, 0, leaf0);
+	cpuid(1, 0, leaf1);
+	if (leaf0[0] >= 7) {
+		cpuid(7, 0, leaf7);
+	}
+	else {
+		leaf7[0] = leaf7[1] = leaf7[2] = leaf7[3] = 0;
+	}
+
+	bool sse4_2 = leaf1[2] & (1u << 20);
+	bool osxsave = leaf1[2] & (1u << 27);
+	bool avx = leaf1[2] & (1u << 28);
+	bool fma = leaf1[2] & (1u << 12);
+	bool avx2 = leaf7[1] & (1u << 5);
+	bool avx512f = leaf7[1] & (1u << 16);
+
+	// The ymm, and for AVX-512 the zmm and mask, registers must be enabled
+	unsigned long long xcr0 = osxsave ? xgetbv0() : 0;
+	bool ymm_state = (xcr0 & 0x6) == 0x6;
+	bool zmm_state = (xcr0 & 0xe6) == 0xe6;
+
+	if (avx && avx2 && fma && avx512f && zmm_state) {
+		return cpu_isa::avx512;
+	}
+	if (avx && avx2 && fma && ymm_state) {
+		return cpu_isa::avx2;
+	}
+	if (sse4_2) {
+		return cpu_isa::sse4_2;
+	}
+#endif
+	return cpu_isa::scalar;
+}
+
+// Instruction set of the kernels. Detected on first use unless chosen before
+// with select_kernel_isa.
+inline cpu_isa& kernel_isa_state() {
+	static cpu_isa isa = detect_cpu_isa();
+	return isa;
+}
+
+inline cpu_isa kernel_isa() {
+	return kernel_isa_state();
+}
+
+// Makes the kernels use isa, or the detected one if the cpu can't run it.
+// Returns the instruction set in use. Objects built before keep theirs.
+inline cpu_isa select_kernel_isa(cpu_isa isa) {
+	cpu_isa detected = detect_cpu_isa();
+	kernel_isa_state() = isa <= detected ? isa : detected;
+	return kernel_isa_state();
+}
+
+#endif // !CPU_DISPATCH_H
@@ -0,0 +1,213 @@
+#ifndef GRID_ACCEL_H
+#define GRID_ACCEL_H
+
+#include "hittable.h"
+
+#include <vector>
+
+// Uniform grid traversed with a 3D-DDA. Best for many objects of similar
+// size spread evenly over the scene, e.g. particles.
+class grid_accel : public hittable {
+	public:
+		std::vector<shared_ptr<hittable>> objects;
+		// Objects that would cover a large part of the grid (or have no bounds),
+		// tested for every ray instead
+		std::vector<shared_ptr<hittable>> large;
+
+	public:
+		// density: cells along the longest axis per cube root of the object count
+		grid_accel(const std::vector<shared_ptr<hittable>>& scene_objects, double density = 3.0);
+
+		virtual bool intersect(const ray& ray, real t_min, real t_max, hit_info& hit) const override;
+		virtual bool bounding_box(aabb& output_box) const override;
+
+	private:
+		static const int max_resolution = 512;
+
+		aabb bounds;
+		int resolution[3];
+		vec3 cell_size;
+		std::vector<int> cell_start;   // offsets into cell_objects, one extra entry at the end
+		std::vector<int> cell_objects; // object indices, grouped by cell
+
+		int cell_index(int x, int y, int z) const {
+			return (z * resolution[1] + y) * resolution[0] + x;
+		}
+
+		int cell_coordinate(real p, int axis) const {
+			int c = static_cast<int>((p - bounds.minimum[axis]) / cell_size[axis]);
+			return c < 0 ? 0 : (c >= resolution[axis] ? resolution[axis] - 1 : c);
+		}
+};
+
+grid_accel::grid_accel(const std::vector<shared_ptr<hittable>>& scene_objects, double density) {
+	std::vector<shared_ptr<hittable>> bounded;
+	std::vector<aabb> boxes;
+	aabb box, scene_bounds;
+	for (const auto& object : scene_objects) {
+		if (object->bounding_box(box)) {
+			bounded.push_back(object);
+			boxes.push_back(box);
+			scene_bounds.grow(box);
+		}
+		else {
+			large.push_back(object);
+		}
+	}
+
+	// Something as big as the whole scene along every axis (like a ground
+	// sphere) would end up in every cell and stretch the grid around it
+	vec3 scene_extent = scene_bounds.extent();
+	std::vector<aabb> object_boxes;
+	for (size_t i = 0; i < bounded.size(); i++) {
+		vec3 extent = boxes[i].extent();
+		if (bounded.size() > 1 && extent.x() > 0.5 * scene_extent.x() &&
+			extent.y() > 0.5 * scene_extent.y() && extent.z() > 0.5 * scene_extent.z()) {
+			large.push_back(bounded[i]);
+			continue;
+		}
+		objects.push_back(bounded[i]);
+		object_boxes.push_back(boxes[i]);
+		bounds.grow(boxes[i]);
+	}
+
+	if (objects.empty()) {
+		resolution[0] = resolution[1] = resolution[2] = 0;
+		return;
+	}
+
+	// About density * cbrt(N) cells along the longest axis, cubic cells
+	vec3 extent = bounds.extent();
+	double cells_per_unit = density * std::cbrt(static_cast<double>(objects.size())) / extent[bounds.longest_axis()];
+	for (int a = 0; a < 3; a++) {
+		int r = static_cast<int>(extent[a] * cells_per_unit + 0.5);
+		resolution[a] = r < 1 ? 1 : (r > max_resolution ? max_resolution : r);
+		cell_size[a] = extent[a] > 0 ? extent[a] / resolution[a] : 1;
+	}
+
+	// Count the objects per cell, then fill the cells in a second pass
+	size_t cell_count = static_cast<size_t>(resolution[0]) * resolution[1] * resolution[2];
+	cell_start.assign(cell_count + 1, 0);
+	for (int pass = 0; pass < 2; pass++) {
+		for (int i = 0; i < static_cast<int>(objects.size()); i++) {
+			const aabb& ob = object_boxes[i];
+			int lo[3], hi[3];
+			for (int a = 0; a < 3; a++) {
+				lo[a] = cell_coordinate(ob.minimum[a], a);
+				hi[a] = cell_coordinate(ob.maximum[a], a);
+			}
+			for (int z = lo[2]; z <= hi[2]; z++) {
+				for (int y = lo[1]; y <= hi[1]; y++) {
+					for (int x = lo[0]; x <= hi[0]; x++) {
+						if (pass == 0) {
+							cell_start[cell_index(x, y, z) + 1]++;
+						}
+						else {
+							cell_objects[cell_start[cell_index(x, y, z) + 1]++] = i;
+						}
+					}
+				}
+			}
+		}
+		if (pass == 0) {
+			// Prefix sum; cell_start[c + 1] is used as the insertion cursor of cell c
+			for (size_t c = 1; c <= cell_count; c++) {
+				cell_start[c] += cell_start[c - 1];
+			}
+			cell_objects.resize(cell_start[cell_count]);
+			for (size_t c = cell_count; c > 0; c--) {
+				cell_start[c] = cell_start[c - 1];
+			}
+		}
+	}
+}
+
+bool grid_accel::intersect(const ray& ray, real t_min, real t_max, hit_info& hit) const {
+	bool hit_anything = false;
+	auto closest_so_far = t_max;
+
+	for (const auto& object : large) {
+		if (object->intersect(ray, t_min, closest_so_far, hit)) {
+			hit_anything = true;
+			closest_so_far = hit.t;
+		}
+	}
+
+	if (objects.empty()) {
+		return hit_anything;
+	}
+
+	vec3 inv_dir(1 / ray.dir.x(), 1 / ray.dir.y(), 1 / ray.dir.z());
+	real t0 = t_min, t1 = closest_so_far;
+	if (!bounds.hit(ray.orig, inv_dir, t0, t1)) {
+		return hit_anything;
+	}
+
+	// Set up the 3D-DDA at the point where the ray enters the grid
+	point3 entry = ray.at(t0);
+	int cell[3], step[3], stop[3];
+	real next_t[3], delta_t[3];
+	for (int a = 0; a < 3; a++) {
+		cell[a] = cell_coordinate(entry[a], a);
+		if (ray.dir[a] > 0) {
+			step[a] = 1;
+			stop[a] = resolution[a];
+			next_t[a] = t0 + (bounds.minimum[a] + (cell[a] + 1) * cell_size[a] - entry[a]) * inv_dir[a];
+			delta_t[a] = cell_size[a] * inv_dir[a];
+		}
+		else if (ray.dir[a] < 0) {
+			step[a] = -1;
+			stop[a] = -1;
+			next_t[a] = t0 + (bounds.minimum[a] + cell[a] * cell_size[a] - entry[a]) * inv_dir[a];
+			delta_t[a] = -cell_size[a] * inv_dir[a];
+		}
+		else {
+			step[a] = 0;
+			stop[a] = -1;
+			next_t[a] = infinity;
+			delta_t[a] = infinity;
+		}
+	}
+
+	while (true) {
+		int c = cell_index(cell[0], cell[1], cell[2]);
+		for (int i = cell_start[c]; i < cell_start[c + 1]; i++) {
+			if (objects[cell_objects[i]]->intersect(ray, t_min, closest_so_far, hit)) {
+				hit_anything = true;
+				closest_so_far = hit.t;
+			}
+		}
+
+		// Step to the neighbouring cell across the nearest boundary
+		int axis = next_t[0] < next_t[1] ? (next_t[0] < next_t[2] ? 0 : 2) : (next_t[1] < next_t[2] ? 1 : 2);
+
+		// Hits inside the current cell can't be beaten by anything further on
+		if (closest_so_far <= next_t[axis] || next_t[axis] > t1) {
+			break;
+		}
+		cell[axis] += step[axis];
+		if (cell[axis] == stop[axis]) {
+			break;
+		}
+		next_t[axis] += delta_t[axis];
+	}
+
+	return hit_anything;
+}
+
+bool grid_accel::bounding_box(aabb& output_box) const {
+	if (objects.empty() && large.empty()) {
+		return false;
+	}
+	output_box = bounds;
+	aabb box;
+	for (const auto& object : large) {
+		if (!object->bounding_box(box)) {
+			return false;
+		}
+		output_box.grow(box);
+	}
+	return true;
+}
+
+#endif // !GRID_ACCEL_H
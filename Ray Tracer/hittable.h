@@ -1,28 +1,105 @@
 #ifndef HITTABLE_H
 #define HITTABLE_H
 
+#include "aabb.h"
 #include "ray.h"
+#include "ray_packet.h"
 #include "utility_functions.h"
 
 class material;
+class hittable;
 
 struct hit_record {
 	point3 p;
 	vec3 normal;
 	shared_ptr<material> mat_ptr;
-	double t;
+	real t;
 	bool front_face;
+	// What was hit, as in hit_info; null for hits found outside the hittables
+	const hittable* object = nullptr;
+	int prim = 0;
 
-	inline void set_face_normal(ray& ray, const vec3& outward_normal) {
-		front_face = dot(ray.direction(), outward_normal) < 0;
+	inline void set_face_normal(const ray& ray, const vec3& outward_normal) {
+		front_face = dot(ray.dir, outward_normal) < 0;
 		normal = front_face ? outward_normal : -outward_normal;
 	}
 };
 
+// What intersecting a ray finds out, just enough to tell which hit is the
+// closest. The shading data is only computed for that one, by resolve_hit.
+struct hit_info {
+	real t;
+	const hittable* object; // primitive that was hit
+	int prim = 0; // part of that object, e.g. a triangle of a mesh
+	real u, v; // barycentric coordinates on triangles
+};
+
 class hittable {
 	public:
-		virtual bool hit(ray& ray, double t_min, double t_max, hit_record& rec) const = 0;
+		// Nearest hit in [t_min, t_max]. hit is only written when there is one.
+		virtual bool intersect(const ray& ray, real t_min, real t_max, hit_info& hit) const = 0;
+		// Fills in rec for a hit that intersect reported on this object. Objects
+		// that only group others never end up in hit_info and keep the default.
+		virtual void resolve_hit(const ray& ray, const hit_info& hit, hit_record& rec) const {}
+		// Returns false for objects without finite bounds
+		virtual bool bounding_box(aabb& output_box) const = 0;
+
+		// Nearest hits of the active rays of a packet, each in its own
+		// [t_min, t_max]. Lowers t_max of the rays that hit, writes their hits
+		// and returns them as a mask. By default the rays are intersected one by
+		// one; primitives and accelerators that can share work override these.
+		virtual int intersect_packet(ray4& rays, int active, hit_info* hits) const {
+			return intersect_lanes(rays, active, hits);
+		}
+		virtual int intersect_packet(ray8& rays, int active, hit_info* hits) const {
+			return intersect_lanes(rays, active, hits);
+		}
+
+		bool hit(const ray& ray, real t_min, real t_max, hit_record& rec) const {
+			hit_info closest;
+			if (!intersect(ray, t_min, t_max, closest)) {
+				return false;
+			}
+			closest.object->resolve_hit(ray, closest, rec);
+			rec.object = closest.object;
+			rec.prim = closest.prim;
+			return true;
+		}
+
+		// Packet version of hit, filling recs[i] for every ray i that hits
+		template <int N>
+		int hit_packet(ray_packet<N>& rays, int active, hit_record* recs) const;
+
+	protected:
+		template <int N>
+		int intersect_lanes(ray_packet<N>& rays, int active, hit_info* hits) const;
 };
 
+template <int N>
+int hittable::hit_packet(ray_packet<N>& rays, int active, hit_record* recs) const {
+	hit_info hits[N];
+	int hit_mask = intersect_packet(rays, active, hits);
+	for (int i = 0; i < N; i++) {
+		if (hit_mask & (1 << i)) {
+			hits[i].object->resolve_hit(rays.get(i), hits[i], recs[i]);
+			recs[i].object = hits[i].object;
+			recs[i].prim = hits[i].prim;
+		}
+	}
+	return hit_mask;
+}
+
+template <int N>
+int hittable::intersect_lanes(ray_packet<N>& rays, int active, hit_info* hits) const {
+	int hit_mask = 0;
+	for (int i = 0; i < N; i++) {
+		if ((active & (1 << i)) && intersect(rays.get(i), rays.t_min[i], rays.t_max[i], hits[i])) {
+			rays.t_max[i] = hits[i].t;
+			hit_mask |= 1 << i;
+		}
+	}
+	return hit_mask;
+}
+
 #endif // !HITTABLE_H
 
@@ -26,19 +26,28 @@ class hittable_list : public hittable {
 			objects.push_back(object);
 		}
 
-		virtual bool hit(ray& ray, double t_min, double t_max, hit_record& rec) const override;
+		virtual bool intersect(const ray& ray, real t_min, real t_max, hit_info& hit) const override;
+		virtual int intersect_packet(ray4& rays, int active, hit_info* hits) const override {
+			return intersect_rays(rays, active, hits);
+		}
+		virtual int intersect_packet(ray8& rays, int active, hit_info* hits) const override {
+			return intersect_rays(rays, active, hits);
+		}
+		virtual bool bounding_box(aabb& output_box) const override;
+
+	private:
+		template <int N>
+		int intersect_rays(ray_packet<N>& rays, int active, hit_info* hits) const;
 };
 
-bool hittable_list::hit(ray& ray, double t_min, double t_max, hit_record& rec) const {
-	hit_record temp_rec;
+bool hittable_list::intersect(const ray& ray, real t_min, real t_max, hit_info& hit) const {
 	bool hit_anything = false;
 	auto closest_so_far = t_max;
 
 	for (auto& object : objects) {
-		if (object->hit(ray, t_min, closest_so_far, temp_rec)) {
+		if (object->intersect(ray, t_min, closest_so_far, hit)) {
 			hit_anything = true;
-			closest_so_far = temp_rec.t;
-			rec = temp_rec;
+			closest_so_far = hit.t;
 			//break;
 		}
 	}
@@ -46,5 +55,30 @@ bool hittable_list::hit(ray& ray, double t_min, double t_max, hit_record& rec) c
 	return hit_anything;
 }
 
+template <int N>
+int hittable_list::intersect_rays(ray_packet<N>& rays, int active, hit_info* hits) const {
+	int hit_mask = 0;
+	for (auto& object : objects) {
+		hit_mask |= object->intersect_packet(rays, active, hits);
+	}
+	return hit_mask;
+}
+
+bool hittable_list::bounding_box(aabb& output_box) const {
+	if (objects.empty()) {
+		return false;
+	}
+
+	output_box = aabb();
+	aabb temp_box;
+	for (const auto& object : objects) {
+		if (!object->bounding_box(temp_box)) {
+			return false;
+		}
+		output_box.grow(temp_box);
+	}
+	return true;
+}
+
 #endif // !HITTABLE_LIST_H
 
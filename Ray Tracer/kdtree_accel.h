@@ -0,0 +1,275 @@
+#ifndef KDTREE_ACCEL_H
+#define KDTREE_ACCEL_H
+
+#include "hittable.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// Kd-tree over the objects of a scene, built with the surface area heuristic.
+// Objects straddling a split plane are referenced from both sides.
+class kdtree_accel : public hittable {
+	public:
+		std::vector<shared_ptr<hittable>> objects;
+		std::vector<shared_ptr<hittable>> unbounded; // objects without bounds, tested for every ray
+
+	public:
+		kdtree_accel(const std::vector<shared_ptr<hittable>>& scene_objects,
+			double intersection_cost = 80, double traversal_cost = 1, double empty_bonus = 0.5, int max_objects = 1);
+
+		virtual bool intersect(const ray& ray, real t_min, real t_max, hit_info& hit) const override;
+		virtual bool bounding_box(aabb& output_box) const override;
+
+	private:
+		struct kd_node {
+			real split;
+			int axis;        // 0-2 for inner nodes, 3 for leaves
+			int above_child; // inner node: index of the child above the plane (the one below follows the node)
+			int first;       // leaf: first entry in object_indices
+			int count;       // leaf: number of objects
+
+			bool is_leaf() const { return axis == 3; }
+		};
+
+		struct edge {
+			real t;
+			int object;
+			bool start;
+
+			bool operator<(const edge& e) const {
+				if (t == e.t) {
+					return start && !e.start;
+				}
+				return t < e.t;
+			}
+		};
+
+		double intersection_cost;
+		double traversal_cost;
+		double empty_bonus;
+		int max_objects;
+
+		aabb bounds;
+		std::vector<kd_node> nodes;
+		std::vector<int> object_indices;
+		std::vector<aabb> object_boxes;
+		std::vector<edge> edges[3];
+
+		void build_node(const aabb& box, const std::vector<int>& objs, int depth, int bad_refines);
+		void make_leaf(int index, const std::vector<int>& objs);
+};
+
+kdtree_accel::kdtree_accel(const std::vector<shared_ptr<hittable>>& scene_objects,
+	double intersection_cost, double traversal_cost, double empty_bonus, int max_objects)
+	: intersection_cost(intersection_cost), traversal_cost(traversal_cost),
+	empty_bonus(empty_bonus), max_objects(max_objects) {
+	aabb box;
+	for (const auto& object : scene_objects) {
+		if (object->bounding_box(box)) {
+			objects.push_back(object);
+			object_boxes.push_back(box);
+			bounds.grow(box);
+		}
+		else {
+			unbounded.push_back(object);
+		}
+	}
+	if (objects.empty()) {
+		return;
+	}
+
+	std::vector<int> all(objects.size());
+	for (int i = 0; i < static_cast<int>(all.size()); i++) {
+		all[i] = i;
+	}
+	for (int a = 0; a < 3; a++) {
+		edges[a].resize(2 * objects.size());
+	}
+
+	int max_depth = static_cast<int>(8 + 1.3 * std::log2(static_cast<double>(objects.size())));
+	build_node(bounds, all, max_depth, 0);
+
+	// Only needed while building
+	for (int a = 0; a < 3; a++) {
+		std::vector<edge>().swap(edges[a]);
+	}
+	std::vector<aabb>().swap(object_boxes);
+}
+
+void kdtree_accel::make_leaf(int index, const std::vector<int>& objs) {
+	kd_node& node = nodes[index];
+	node.axis = 3;
+	node.first = static_cast<int>(object_indices.size());
+	node.count = static_cast<int>(objs.size());
+	object_indices.insert(object_indices.end(), objs.begin(), objs.end());
+}
+
+void kdtree_accel::build_node(const aabb& box, const std::vector<int>& objs, int depth, int bad_refines) {
+	int index = static_cast<int>(nodes.size());
+	nodes.emplace_back();
+
+	int n = static_cast<int>(objs.size());
+	if (n <= max_objects || depth == 0) {
+		make_leaf(index, objs);
+		return;
+	}
+
+	// Sweep the object extents along each axis for the cheapest plane
+	double best_cost = infinity;
+	int best_axis = -1;
+	int best_offset = -1;
+	double leaf_cost = intersection_cost * n;
+	double inv_area = 1 / box.surface_area();
+	vec3 d = box.extent();
+
+	int axis = box.longest_axis();
+	for (int retries = 0; retries < 3 && best_axis == -1; retries++, axis = (axis + 1) % 3) {
+		for (int i = 0; i < n; i++) {
+			const aabb& ob = object_boxes[objs[i]];
+			edges[axis][2 * i] = { ob.minimum[axis], objs[i], true };
+			edges[axis][2 * i + 1] = { ob.maximum[axis], objs[i], false };
+		}
+		std::sort(edges[axis].begin(), edges[axis].begin() + 2 * n);
+
+		int below = 0, above = n;
+		int other0 = (axis + 1) % 3, other1 = (axis + 2) % 3;
+		for (int i = 0; i < 2 * n; i++) {
+			const edge& e = edges[axis][i];
+			if (!e.start) {
+				above--;
+			}
+			if (e.t > box.minimum[axis] && e.t < box.maximum[axis]) {
+				double below_area = 2 * (d[other0] * d[other1] + (e.t - box.minimum[axis]) * (d[other0] + d[other1]));
+				double above_area = 2 * (d[other0] * d[other1] + (box.maximum[axis] - e.t) * (d[other0] + d[other1]));
+				double bonus = (above == 0 || below == 0) ? empty_bonus : 0;
+				double cost = traversal_cost + intersection_cost * (1 - bonus) *
+					(below_area * inv_area * below + above_area * inv_area * above);
+				if (cost < best_cost) {
+					best_cost = cost;
+					best_axis = axis;
+					best_offset = i;
+				}
+			}
+			if (e.start) {
+				below++;
+			}
+		}
+	}
+
+	if (best_cost > leaf_cost) {
+		bad_refines++;
+	}
+	if ((best_cost > 4 * leaf_cost && n < 16) || best_axis == -1 || bad_refines == 3) {
+		make_leaf(index, objs);
+		return;
+	}
+
+	std::vector<int> below_objs, above_objs;
+	for (int i = 0; i < best_offset; i++) {
+		if (edges[best_axis][i].start) {
+			below_objs.push_back(edges[best_axis][i].object);
+		}
+	}
+	for (int i = best_offset + 1; i < 2 * n; i++) {
+		if (!edges[best_axis][i].start) {
+			above_objs.push_back(edges[best_axis][i].object);
+		}
+	}
+
+	real split = edges[best_axis][best_offset].t;
+	aabb below_box = box, above_box = box;
+	below_box.maximum[best_axis] = split;
+	above_box.minimum[best_axis] = split;
+
+	nodes[index].axis = best_axis;
+	nodes[index].split = split;
+	build_node(below_box, below_objs, depth - 1, bad_refines);
+	nodes[index].above_child = static_cast<int>(nodes.size());
+	build_node(above_box, above_objs, depth - 1, bad_refines);
+}
+
+bool kdtree_accel::intersect(const ray& ray, real t_min, real t_max, hit_info& hit) const {
+	bool hit_anything = false;
+	auto closest_so_far = t_max;
+
+	for (const auto& object : unbounded) {
+		if (object->intersect(ray, t_min, closest_so_far, hit)) {
+			hit_anything = true;
+			closest_so_far = hit.t;
+		}
+	}
+
+	if (nodes.empty()) {
+		return hit_anything;
+	}
+
+	vec3 inv_dir(1 / ray.dir.x(), 1 / ray.dir.y(), 1 / ray.dir.z());
+	real node_min = t_min, node_max = closest_so_far;
+	if (!bounds.hit(ray.orig, inv_dir, node_min, node_max)) {
+		return hit_anything;
+	}
+
+	struct todo_entry {
+		int node;
+		real t_min, t_max;
+	};
+	todo_entry todo[64];
+	int todo_count = 0;
+
+	int index = 0;
+	while (true) {
+		// Nothing left to visit can be nearer than the closest hit
+		if (closest_so_far < node_min) {
+			break;
+		}
+
+		const kd_node& node = nodes[index];
+		if (!node.is_leaf()) {
+			int axis = node.axis;
+			real t_plane = (node.split - ray.orig[axis]) * inv_dir[axis];
+
+			bool below_first = (ray.orig[axis] < node.split) ||
+				(ray.orig[axis] == node.split && ray.dir[axis] <= 0);
+			int first = below_first ? index + 1 : node.above_child;
+			int second = below_first ? node.above_child : index + 1;
+
+			if (t_plane > node_max || t_plane <= 0) {
+				index = first;
+			}
+			else if (t_plane < node_min) {
+				index = second;
+			}
+			else {
+				todo[todo_count++] = { second, t_plane, node_max };
+				index = first;
+				node_max = t_plane;
+			}
+			continue;
+		}
+
+		for (int i = node.first; i < node.first + node.count; i++) {
+			if (objects[object_indices[i]]->intersect(ray, t_min, closest_so_far, hit)) {
+				hit_anything = true;
+				closest_so_far = hit.t;
+			}
+		}
+
+		if (todo_count == 0) {
+			break;
+		}
+		todo_count--;
+		index = todo[todo_count].node;
+		node_min = todo[todo_count].t_min;
+		node_max = todo[todo_count].t_max;
+	}
+
+	return hit_anything;
+}
+
+bool kdtree_accel::bounding_box(aabb& output_box) const {
+	output_box = bounds;
+	return unbounded.empty() && !objects.empty();
+}
+
+#endif // !KDTREE_ACCEL_H
@@ -0,0 +1,270 @@
+#ifndef LAZY_BVH_ACCEL_H
+#define LAZY_BVH_ACCEL_H
+
+#include "hittable.h"
+
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <thread>
+#include <vector>
+
+// Bvh over the objects of a scene that is only built where rays go.
+// Nodes start out holding a range of objects and are split the first time a
+// ray reaches them, so objects no ray gets near cost nothing but their bounds.
+//
+// Safe to trace from several threads: the first thread to reach an unbuilt
+// node claims it with a compare-and-swap, splits it and publishes the children
+// with a release store; others reaching it meanwhile wait for that store.
+class lazy_bvh_accel : public hittable {
+	public:
+		std::vector<shared_ptr<hittable>> objects;
+		std::vector<shared_ptr<hittable>> unbounded; // objects without bounds, tested for every ray
+
+	public:
+		lazy_bvh_accel(const std::vector<shared_ptr<hittable>>& scene_objects, int max_leaf_size = 4, int bins = 16);
+		~lazy_bvh_accel();
+
+		lazy_bvh_accel(const lazy_bvh_accel&) = delete;
+		lazy_bvh_accel& operator=(const lazy_bvh_accel&) = delete;
+
+		virtual bool intersect(const ray& ray, real t_min, real t_max, hit_info& hit) const override;
+		virtual bool bounding_box(aabb& output_box) const override;
+
+		// Number of nodes created so far
+		int built_nodes() const { return next_node.load(std::memory_order_relaxed); }
+
+	private:
+		static const int max_depth = 64;
+
+		enum node_state { unbuilt, building, inner, leaf };
+
+		struct lazy_node {
+			aabb box;
+			std::atomic<int> state;
+			int first; // range of `order` holding the node's objects
+			int count;
+			int left;  // inner node: the children are left and left + 1
+			int axis;
+			int depth;
+		};
+
+		std::vector<aabb> object_boxes;
+		int max_leaf_size;
+		int bins;
+
+		// Splitting a node only reorders its own range and creates nodes past
+		// next_node, neither of which is read before the node is published.
+		mutable std::vector<int> order;
+		lazy_node* nodes = nullptr; // room for the 2N - 1 nodes a full tree can have
+		mutable std::atomic<int> next_node;
+
+		lazy_node* create_node(int index, int first, int count, int depth) const;
+		int expand(lazy_node& node) const;
+		void split(lazy_node& node) const;
+};
+
+lazy_bvh_accel::lazy_bvh_accel(const std::vector<shared_ptr<hittable>>& scene_objects, int max_leaf_size, int bins)
+	: max_leaf_size(max_leaf_size), bins(bins), next_node(0) {
+	aabb box;
+	for (const auto& object : scene_objects) {
+		if (object->bounding_box(box)) {
+			objects.push_back(object);
+			object_boxes.push_back(box);
+		}
+		else {
+			unbounded.push_back(object);
+		}
+	}
+	if (objects.empty()) {
+		return;
+	}
+
+	order.resize(objects.size());
+	for (int i = 0; i < static_cast<int>(order.size()); i++) {
+		order[i] = i;
+	}
+
+	// Raw storage: nodes are constructed when created, so untouched parts of
+	// the tree don't even cost the memory writes
+	nodes = static_cast<lazy_node*>(::operator new(sizeof(lazy_node) * (2 * objects.size())));
+	create_node(next_node++, 0, static_cast<int>(objects.size()), 0);
+}
+
+lazy_bvh_accel::~lazy_bvh_accel() {
+	::operator delete(nodes);
+}
+
+lazy_bvh_accel::lazy_node* lazy_bvh_accel::create_node(int index, int first, int count, int depth) const {
+	lazy_node* node = new (&nodes[index]) lazy_node();
+	node->box = aabb();
+	for (int i = first; i < first + count; i++) {
+		node->box.grow(object_boxes[order[i]]);
+	}
+	node->first = first;
+	node->count = count;
+	node->left = -1;
+	node->axis = 0;
+	node->depth = depth;
+	node->state.store(unbuilt, std::memory_order_relaxed);
+	return node;
+}
+
+// Returns the built state (inner or leaf) of the node, splitting it if needed
+int lazy_bvh_accel::expand(lazy_node& node) const {
+	int state = node.state.load(std::memory_order_acquire);
+	if (state == unbuilt) {
+		if (node.state.compare_exchange_strong(state, building, std::memory_order_acq_rel)) {
+			split(node);
+			return node.state.load(std::memory_order_relaxed);
+		}
+	}
+	while (state == building) {
+		std::this_thread::yield();
+		state = node.state.load(std::memory_order_acquire);
+	}
+	return state;
+}
+
+// One level of a binned SAH build
+void lazy_bvh_accel::split(lazy_node& node) const {
+	if (node.count <= max_leaf_size || node.depth >= max_depth - 2) {
+		node.state.store(leaf, std::memory_order_release);
+		return;
+	}
+
+	aabb centroids;
+	for (int i = node.first; i < node.first + node.count; i++) {
+		centroids.grow(object_boxes[order[i]].centroid());
+	}
+
+	struct bin {
+		aabb box;
+		int count = 0;
+	};
+	std::vector<bin> bin_data(bins);
+	std::vector<aabb> right_boxes(bins);
+	double best_cost = infinity;
+	int best_axis = -1;
+	real best_pos = 0;
+
+	for (int axis = 0; axis < 3; axis++) {
+		real start = centroids.minimum[axis];
+		real extent = centroids.maximum[axis] - start;
+		if (extent <= 0) {
+			continue;
+		}
+		real scale = bins / extent;
+
+		std::fill(bin_data.begin(), bin_data.end(), bin());
+		for (int i = node.first; i < node.first + node.count; i++) {
+			const aabb& box = object_boxes[order[i]];
+			int b = std::min(bins - 1, static_cast<int>((box.centroid()[axis] - start) * scale));
+			bin_data[b].box.grow(box);
+			bin_data[b].count++;
+		}
+
+		aabb right_box;
+		for (int i = bins - 1; i > 0; i--) {
+			right_box.grow(bin_data[i].box);
+			right_boxes[i] = right_box;
+		}
+		aabb left_box;
+		int left_count = 0;
+		for (int i = 0; i < bins - 1; i++) {
+			left_box.grow(bin_data[i].box);
+			left_count += bin_data[i].count;
+			int right_count = node.count - left_count;
+			if (left_count == 0 || right_count == 0) {
+				continue;
+			}
+			double cost = left_box.surface_area() * left_count + right_boxes[i + 1].surface_area() * right_count;
+			if (cost < best_cost) {
+				best_cost = cost;
+				best_axis = axis;
+				best_pos = start + (i + 1) / scale;
+			}
+		}
+	}
+
+	int* begin = order.data() + node.first;
+	int* end = begin + node.count;
+	int* middle = begin + node.count / 2;
+	if (best_axis >= 0) {
+		middle = std::partition(begin, end, [&](int object) {
+			return object_boxes[object].centroid()[best_axis] < best_pos;
+		});
+		// Rounding may put a centroid on the other side of best_pos than its
+		// bin, leaving a side empty: split in half instead. Both children
+		// then always hold objects, so the tree stays within 2N - 1 nodes.
+		if (middle == begin || middle == end) {
+			middle = begin + node.count / 2;
+		}
+	}
+	int left_count = static_cast<int>(middle - begin);
+
+	int left = next_node.fetch_add(2, std::memory_order_relaxed);
+	create_node(left, node.first, left_count, node.depth + 1);
+	create_node(left + 1, node.first + left_count, node.count - left_count, node.depth + 1);
+	node.left = left;
+	node.axis = best_axis < 0 ? 0 : best_axis;
+	node.state.store(inner, std::memory_order_release);
+}
+
+bool lazy_bvh_accel::intersect(const ray& ray, real t_min, real t_max, hit_info& hit) const {
+	bool hit_anything = false;
+	auto closest_so_far = t_max;
+
+	for (const auto& object : unbounded) {
+		if (object->intersect(ray, t_min, closest_so_far, hit)) {
+			hit_anything = true;
+			closest_so_far = hit.t;
+		}
+	}
+	if (!nodes) {
+		return hit_anything;
+	}
+
+	vec3 inv_dir(1 / ray.dir.x(), 1 / ray.dir.y(), 1 / ray.dir.z());
+	bool dir_is_neg[3] = { inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0 };
+
+	int stack[max_depth];
+	int top = 0;
+	stack[top++] = 0;
+	while (top > 0) {
+		lazy_node& node = nodes[stack[--top]];
+
+		real t0 = t_min, t1 = closest_so_far;
+		if (!node.box.hit(ray.orig, inv_dir, t0, t1)) {
+			continue;
+		}
+
+		if (expand(node) == leaf) {
+			for (int i = node.first; i < node.first + node.count; i++) {
+				if (objects[order[i]]->intersect(ray, t_min, closest_so_far, hit)) {
+					hit_anything = true;
+					closest_so_far = hit.t;
+				}
+			}
+		}
+		else if (dir_is_neg[node.axis]) {
+			stack[top++] = node.left;
+			stack[top++] = node.left + 1;
+		}
+		else {
+			stack[top++] = node.left + 1;
+			stack[top++] = node.left;
+		}
+	}
+	return hit_anything;
+}
+
+bool lazy_bvh_accel::bounding_box(aabb& output_box) const {
+	if (!nodes || !unbounded.empty()) {
+		return false;
+	}
+	output_box = nodes[0].box;
+	return true;
+}
+
+#endif // !LAZY_BVH_ACCEL_H
@@ -0,0 +1,519 @@
+#ifndef LIGHT_LIST_H
+#define LIGHT_LIST_H
+
+#include "aabb.h"
+#include "hittable.h"
+#include "material.h"
+#include "sampler.h"
+#include "sphere.h"
+#include "triangle_mesh.h"
+
+#include <algorithm>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+using std::shared_ptr;
+
+// A light that can be sampled: a sphere, or one triangle of a mesh, with an
+// emissive material
+struct light_source {
+	bool is_sphere;
+	point3 p0, p1, p2; // center of a sphere, corners of a triangle
+	real radius;
+	real area;
+	real power; // emission at the center times the area
+	const material* emitter;
+};
+
+// A point picked on a light, as seen from the point being shaded
+struct light_sample {
+	point3 p;
+	vec3 normal; // of the light at p
+	color emission;
+	real pdf; // per solid angle, picking the light included
+};
+
+// What the light tree knows of a group of lights: where they are, how much
+// they emit and which way they face. The normals of the lights lie within
+// theta_o of axis. Lights are diffuse and emit from both sides, so each one
+// sends light up to 90 degrees off either side of its normal.
+struct light_bounds {
+	aabb box;
+	vec3 axis = vec3(0, 0, 1);
+	real cos_theta_o = 1;
+	real power = 0;
+
+	// Surface area times power times the solid angle the light goes into,
+	// the cost of a node in the tree build
+	real cost() const;
+};
+
+// Bounds of lights a and b together
+light_bounds merge(const light_bounds& a, const light_bounds& b);
+
+// Power heuristic weight of a sample taken with pdf, when other_pdf is the
+// pdf of the other strategy that could have taken it
+inline real mis_weight(real pdf, real other_pdf) {
+	real a = pdf * pdf;
+	real b = other_pdf * other_pdf;
+	return a / (a + b);
+}
+
+// The emissive spheres and mesh triangles of a scene, for sampling the light
+// that reaches a point directly. A light is picked by walking down a tree
+// over the lights, one light per leaf. At each node one child is taken at
+// random, in proportion to an estimate of the light it brings the point, so
+// lights that are bright, near and face the point are picked most often.
+// This costs one path down the tree, logarithmic in the number of lights.
+// Then a point on the light is sampled: spheres over the cone they cover
+// seen from the point, triangles uniformly over their area.
+class light_list {
+	public:
+		std::vector<light_source> lights;
+
+	public:
+		light_list() {}
+		// Takes the spheres and triangle meshes whose material emits, anything
+		// else is left out
+		light_list(const std::vector<shared_ptr<hittable>>& objects);
+
+		bool empty() const { return lights.empty(); }
+		size_t node_count() const { return nodes.size(); }
+		// Whether object is among the lights
+		bool contains(const hittable* object) const { return object && first_light.count(object) > 0; }
+
+		// Picks a light for the point `from` with surface normal n using
+		// u_pick, and a point on it with (u, v). Returns false when no light
+		// can reach `from`.
+		bool sample(const point3& from, const vec3& n, real u_pick, real u, real v, light_sample& s) const;
+		// Pdf of sample giving the point of rec for `from` and n, 0 when rec is
+		// not on one of the lights
+		real pdf(const point3& from, const vec3& n, const hit_record& rec) const;
+
+	private:
+		// light_bounds of a subtree, kept as what importance needs: the box
+		// as its bounding sphere. Inner nodes have their left child right
+		// after them.
+		struct light_node {
+			real center[3];
+			real radius, radius_squared;
+			real axis[3];
+			real cos_theta_o, sin_theta_o;
+			real power;
+			int right; // inner node: index of the right child, leaf: -1
+			int light; // leaf: index of the light
+			int parent; // -1 for the root
+
+			// Estimate of the light reaching point p, with surface normal n,
+			// from the lights within. 0 when none of it can.
+			real importance(const point3& p, const vec3& n) const;
+		};
+
+		std::vector<light_node> nodes;
+		std::vector<int> leaf_of; // node of each light
+		std::unordered_map<const hittable*, int> first_light; // of each object
+
+		void add(const hittable* object);
+		static light_bounds bounds_of(const light_source& l);
+		// Builds the subtree over the lights in ids[first, last) and returns
+		// its root
+		int build(std::vector<int>& ids, const std::vector<light_bounds>& bounds, int first, int last, int parent);
+		// Probability of taking the child `child` of the inner node `node`
+		real child_pdf(int node, int child, const point3& from, const vec3& n) const;
+		// Pdf of the point p on light l, with normal n, seen from `from`,
+		// without picking the light
+		real point_pdf(const light_source& l, const point3& from, const point3& p, const vec3& n) const;
+};
+
+inline real luminance(const color& c) {
+	return real(0.2126) * c.x() + real(0.7152) * c.y() + real(0.0722) * c.z();
+}
+
+real light_list::light_node::importance(const point3& p, const vec3& n) const {
+	if (power <= 0) {
+		return 0;
+	}
+	real dx = p.x() - center[0], dy = p.y() - center[1], dz = p.z() - center[2];
+	real distance_squared = dx * dx + dy * dy + dz * dz;
+	if (distance_squared <= radius_squared) {
+		// Inside the bounding sphere the lights can be anywhere around p,
+		// and are not taken to be nearer than its radius
+		return radius_squared > 0 ? power / radius_squared : 0;
+	}
+
+	// Seen from p, the lights are within theta_b of the direction w from
+	// the center. Every angle below is shrunk by theta_b, and by theta_o
+	// for the normals, using cos(a - b) = cos a cos b + sin a sin b.
+	real inv_distance = 1 / sqrt(distance_squared);
+	real wx = dx * inv_distance, wy = dy * inv_distance, wz = dz * inv_distance;
+	real sin_b = radius * inv_distance;
+	real cos_b = sqrt(std::max(real(0), 1 - sin_b * sin_b));
+
+	// Smallest angle between a light normal, on either side, and w
+	real cos_emit = std::min(real(1), std::abs(axis[0] * wx + axis[1] * wy + axis[2] * wz));
+	real sin_emit = 0;
+	if (cos_emit < cos_theta_o) {
+		real sin_w = sqrt(std::max(real(0), 1 - cos_emit * cos_emit));
+		sin_emit = sin_w * cos_theta_o - cos_emit * sin_theta_o;
+		cos_emit = cos_emit * cos_theta_o + sin_w * sin_theta_o;
+	}
+	else {
+		cos_emit = 1;
+	}
+	if (cos_emit < cos_b) {
+		cos_emit = cos_emit * cos_b + sin_emit * sin_b;
+		if (cos_emit <= 0) {
+			return 0;
+		}
+	}
+	else {
+		cos_emit = 1;
+	}
+
+	// Smallest angle between n and a direction towards the lights
+	real cos_receive = -(n.x() * wx + n.y() * wy + n.z() * wz);
+	if (cos_receive < cos_b) {
+		real sin_i = sqrt(std::max(real(0), 1 - cos_receive * cos_receive));
+		cos_receive = cos_receive * cos_b + sin_i * sin_b;
+		if (cos_receive <= 0) {
+			return 0;
+		}
+	}
+	else {
+		cos_receive = 1;
+	}
+
+	return power * cos_emit * cos_receive / distance_squared;
+}
+
+real light_bounds::cost() const {
+	// Solid angle of the directions within 90 degrees of the normals
+	real theta_o = acos(clamp(cos_theta_o, -1, 1));
+	real theta_w = std::min(theta_o + pi / 2, pi);
+	real sin_o = sin(theta_o);
+	real solid_angle = 2 * pi * (1 - cos_theta_o)
+		+ pi / 2 * (2 * theta_w * sin_o - cos(theta_o - 2 * theta_w) - 2 * theta_o * sin_o + cos_theta_o);
+	return power * box.surface_area() * solid_angle;
+}
+
+light_bounds merge(const light_bounds& a, const light_bounds& b) {
+	if (a.power <= 0 && a.box.empty()) {
+		return b;
+	}
+	if (b.power <= 0 && b.box.empty()) {
+		return a;
+	}
+
+	light_bounds m;
+	m.box = surrounding_box(a.box, b.box);
+	m.power = a.power + b.power;
+
+	// Smallest cone around both cones of normals
+	real theta_a = acos(clamp(a.cos_theta_o, -1, 1));
+	real theta_b = acos(clamp(b.cos_theta_o, -1, 1));
+	real theta_d = acos(clamp(dot(a.axis, b.axis), -1, 1));
+	if (std::min(theta_d + theta_b, pi) <= theta_a) {
+		m.axis = a.axis;
+		m.cos_theta_o = a.cos_theta_o;
+		return m;
+	}
+	if (std::min(theta_d + theta_a, pi) <= theta_b) {
+		m.axis = b.axis;
+		m.cos_theta_o = b.cos_theta_o;
+		return m;
+	}
+	real theta_o = (theta_a + theta_d + theta_b) / 2;
+	vec3 turn = cross(a.axis, b.axis);
+	if (theta_o >= pi || turn.length_squared() == 0) {
+		m.axis = a.axis;
+		m.cos_theta_o = -1;
+		return m;
+	}
+	// a's axis turned towards b's by theta_o - theta_a
+	real angle = theta_o - theta_a;
+	vec3 k = unit_vector(turn);
+	m.axis = unit_vector(a.axis * cos(angle) + cross(k, a.axis) * sin(angle) + k * dot(k, a.axis) * (1 - cos(angle)));
+	m.cos_theta_o = cos(theta_o);
+	return m;
+}
+
+light_list::light_list(const std::vector<shared_ptr<hittable>>& objects) {
+	for (const auto& object : objects) {
+		add(object.get());
+	}
+	if (lights.empty()) {
+		return;
+	}
+
+	std::vector<light_bounds> bounds(lights.size());
+	std::vector<int> ids(lights.size());
+	for (size_t i = 0; i < lights.size(); i++) {
+		bounds[i] = bounds_of(lights[i]);
+		ids[i] = static_cast<int>(i);
+	}
+	leaf_of.resize(lights.size());
+	nodes.reserve(2 * lights.size() - 1);
+	build(ids, bounds, 0, static_cast<int>(ids.size()), -1);
+}
+
+void light_list::add(const hittable* object) {
+	if (auto s = dynamic_cast<const sphere*>(object)) {
+		if (!s->mat_ptr || !s->mat_ptr->is_emissive()) {
+			return;
+		}
+		first_light.emplace(object, static_cast<int>(lights.size()));
+		const material* emitter = s->mat_ptr.get();
+		real area = 4 * pi * s->radius * s->radius;
+		real power = luminance(emitter->emitted(0, 0, s->center)) * area;
+		lights.push_back({ true, s->center, s->center, s->center, s->radius, area, power, emitter });
+	}
+	else if (auto m = dynamic_cast<const triangle_mesh*>(object)) {
+		if (!m->mat_ptr || !m->mat_ptr->is_emissive()) {
+			return;
+		}
+		first_light.emplace(object, static_cast<int>(lights.size()));
+		const material* emitter = m->mat_ptr.get();
+		for (const Triangle& t : m->triangles) {
+			const point3& p0 = m->vertices[t.v0];
+			const point3& p1 = m->vertices[t.v1];
+			const point3& p2 = m->vertices[t.v2];
+			real area = cross(p1 - p0, p2 - p0).length() / 2;
+			real power = luminance(emitter->emitted(0, 0, (p0 + p1 + p2) / 3)) * area;
+			lights.push_back({ false, p0, p1, p2, 0, area, power, emitter });
+		}
+	}
+}
+
+light_bounds light_list::bounds_of(const light_source& l) {
+	light_bounds b;
+	b.power = std::max(real(0), l.power);
+	if (l.is_sphere) {
+		vec3 r(l.radius, l.radius, l.radius);
+		b.box = aabb(l.p0 - r, l.p0 + r);
+		b.cos_theta_o = -1;
+	}
+	else {
+		b.box.grow(l.p0);
+		b.box.grow(l.p1);
+		b.box.grow(l.p2);
+		vec3 normal = cross(l.p1 - l.p0, l.p2 - l.p0);
+		if (normal.length_squared() > 0) {
+			b.axis = unit_vector(normal);
+		}
+	}
+	return b;
+}
+
+int light_list::build(std::vector<int>& ids, const std::vector<light_bounds>& bounds, int first, int last, int parent) {
+	int index = static_cast<int>(nodes.size());
+	nodes.push_back(light_node());
+	light_bounds node_bounds = bounds[ids[first]];
+	aabb centroids;
+	for (int i = first; i < last; i++) {
+		if (i > first) {
+			node_bounds = merge(node_bounds, bounds[ids[i]]);
+		}
+		centroids.grow(bounds[ids[i]].box.centroid());
+	}
+	light_node& node = nodes[index];
+	point3 center = node_bounds.box.centroid();
+	for (int a = 0; a < 3; a++) {
+		node.center[a] = center[a];
+		node.axis[a] = node_bounds.axis[a];
+	}
+	node.radius_squared = node_bounds.box.extent().length_squared() / 4;
+	node.radius = sqrt(node.radius_squared);
+	node.cos_theta_o = node_bounds.cos_theta_o;
+	node.sin_theta_o = sqrt(std::max(real(0), 1 - node.cos_theta_o * node.cos_theta_o));
+	node.power = node_bounds.power;
+	node.right = -1;
+	node.light = -1;
+	node.parent = parent;
+
+	if (last - first == 1) {
+		nodes[index].light = ids[first];
+		leaf_of[ids[first]] = index;
+		return index;
+	}
+
+	// Binned split on the centroids, with the lowest cost summed over the
+	// two sides. Splits across the thin sides of a node are penalized so that
+	// children don't become long slivers.
+	const int bins = 12;
+	vec3 extent = centroids.extent();
+	real max_extent = std::max(extent.x(), std::max(extent.y(), extent.z()));
+	real best_cost = infinity;
+	int best_axis = -1, best_bin = 0;
+	for (int axis = 0; axis < 3 && max_extent > 0; axis++) {
+		if (extent[axis] <= 0) {
+			continue;
+		}
+		light_bounds bin_bounds[bins];
+		real scale = bins / extent[axis];
+		auto bin_of = [&](int id) {
+			int b = static_cast<int>((bounds[id].box.centroid()[axis] - centroids.minimum[axis]) * scale);
+			return std::min(b, bins - 1);
+		};
+		for (int i = first; i < last; i++) {
+			light_bounds& b = bin_bounds[bin_of(ids[i])];
+			b = merge(b, bounds[ids[i]]);
+		}
+
+		light_bounds below[bins];
+		below[0] = bin_bounds[0];
+		for (int b = 1; b < bins; b++) {
+			below[b] = merge(below[b - 1], bin_bounds[b]);
+		}
+		light_bounds above;
+		for (int b = bins - 1; b > 0; b--) {
+			above = merge(above, bin_bounds[b]);
+			real cost = (max_extent / extent[axis]) * (below[b - 1].cost() + above.cost());
+			if (cost < best_cost) {
+				best_cost = cost;
+				best_axis = axis;
+				best_bin = b;
+			}
+		}
+	}
+
+	int mid;
+	if (best_axis >= 0) {
+		int axis = best_axis;
+		real scale = bins / extent[axis];
+		mid = static_cast<int>(std::partition(ids.begin() + first, ids.begin() + last, [&](int id) {
+			int b = static_cast<int>((bounds[id].box.centroid()[axis] - centroids.minimum[axis]) * scale);
+			return std::min(b, bins - 1) < best_bin;
+		}) - ids.begin());
+	}
+	else {
+		mid = first;
+	}
+	if (mid == first || mid == last) {
+		// Centroids all in one place or one bin: split the list in half
+		mid = (first + last) / 2;
+	}
+
+	build(ids, bounds, first, mid, index);
+	nodes[index].right = build(ids, bounds, mid, last, index);
+	return index;
+}
+
+real light_list::child_pdf(int node, int child, const point3& from, const vec3& n) const {
+	real left = nodes[node + 1].importance(from, n);
+	real right = nodes[nodes[node].right].importance(from, n);
+	if (left + right <= 0) {
+		return 0;
+	}
+	return (child == node + 1 ? left : right) / (left + right);
+}
+
+bool light_list::sample(const point3& from, const vec3& n, real u_pick, real u, real v, light_sample& s) const {
+	if (nodes.empty()) {
+		return false;
+	}
+	// Down the tree, reusing u_pick for every choice by rescaling the part
+	// of [0, 1) that the taken child had
+	int node = 0;
+	real pick_pdf = 1;
+	while (nodes[node].right >= 0) {
+		real left = nodes[node + 1].importance(from, n);
+		real right = nodes[nodes[node].right].importance(from, n);
+		if (left + right <= 0) {
+			return false;
+		}
+		// As in child_pdf, so that pdf gives back the same numbers
+		real p_left = left / (left + right);
+		real p_right = right / (left + right);
+		if (u_pick < p_left) {
+			u_pick = std::min(u_pick / p_left, real(0.99999994));
+			pick_pdf *= p_left;
+			node = node + 1;
+		}
+		else {
+			u_pick = std::min((u_pick - p_left) / p_right, real(0.99999994));
+			pick_pdf *= p_right;
+			node = nodes[node].right;
+		}
+	}
+	const light_source& l = lights[nodes[node].light];
+
+	vec3 light_normal;
+	if (l.is_sphere) {
+		vec3 to_center = l.p0 - from;
+		real distance_squared = to_center.length_squared();
+		real radius_squared = l.radius * l.radius;
+		if (distance_squared > radius_squared) {
+			// A direction in the cone the sphere covers, and the near point
+			// where it enters the sphere. 1 - cos is worked out from sin^2 so
+			// that it keeps its precision for far, small lights.
+			real distance = sqrt(distance_squared);
+			real sin_squared = radius_squared / distance_squared;
+			real one_minus_cos = sin_squared / (1 + sqrt(std::max(real(0), 1 - sin_squared)));
+			vec3 direction = sample_cone(to_center / distance, one_minus_cos, u, v);
+			real b = dot(direction, to_center);
+			real t = b - sqrt(std::max(real(0), radius_squared - (distance_squared - b * b)));
+			s.p = from + t * direction;
+			s.normal = (s.p - l.p0) / l.radius;
+			s.pdf = pick_pdf / (2 * pi * one_minus_cos);
+			s.emission = l.emitter->emitted(0, 0, s.p);
+			return s.pdf > 0 && std::isfinite(s.pdf);
+		}
+		// Inside the sphere every point of it is in view
+		light_normal = sample_unit_vector(u, v);
+		s.p = l.p0 + l.radius * light_normal;
+	}
+	else {
+		real su = sqrt(u);
+		real b0 = 1 - su;
+		real b1 = v * su;
+		s.p = b0 * l.p0 + b1 * l.p1 + (1 - b0 - b1) * l.p2;
+		light_normal = unit_vector(cross(l.p1 - l.p0, l.p2 - l.p0));
+	}
+
+	s.normal = light_normal;
+	s.pdf = pick_pdf * point_pdf(l, from, s.p, light_normal);
+	s.emission = l.emitter->emitted(0, 0, s.p);
+	return s.pdf > 0 && std::isfinite(s.pdf);
+}
+
+real light_list::pdf(const point3& from, const vec3& n, const hit_record& rec) const {
+	if (!rec.object) {
+		return 0;
+	}
+	auto found = first_light.find(rec.object);
+	if (found == first_light.end()) {
+		return 0;
+	}
+	int index = found->second + (lights[found->second].is_sphere ? 0 : rec.prim);
+
+	// The choices on the way up from the light's leaf
+	real pick_pdf = 1;
+	for (int node = leaf_of[index]; nodes[node].parent >= 0 && pick_pdf > 0; node = nodes[node].parent) {
+		pick_pdf *= child_pdf(nodes[node].parent, node, from, n);
+	}
+	return pick_pdf > 0 ? pick_pdf * point_pdf(lights[index], from, rec.p, rec.normal) : 0;
+}
+
+real light_list::point_pdf(const light_source& l, const point3& from, const point3& p, const vec3& n) const {
+	if (l.is_sphere) {
+		real distance_squared = (l.p0 - from).length_squared();
+		real radius_squared = l.radius * l.radius;
+		if (distance_squared > radius_squared) {
+			real sin_squared = radius_squared / distance_squared;
+			real one_minus_cos = sin_squared / (1 + sqrt(std::max(real(0), 1 - sin_squared)));
+			return 1 / (2 * pi * one_minus_cos);
+		}
+	}
+
+	// Uniform over the area, turned into solid angle at `from`
+	vec3 to_point = p - from;
+	real distance_squared = to_point.length_squared();
+	real cos_light = std::abs(dot(n, to_point)) / sqrt(distance_squared);
+	if (cos_light <= 0) {
+		return 0;
+	}
+	return distance_squared / (cos_light * l.area);
+}
+
+#endif // !LIGHT_LIST_H
@@ -3,13 +3,26 @@
 #include "color.h"
 #include "hittable_list.h"
 #include "sphere.h"
+#include "sphere_set.h"
 #include "camera.h"
 #include "material.h"
+#include "path_guide.h"
+#include "photon_map.h"
+#include "radiance_cache.h"
 #include "cube.h"
+#include "box_set.h"
+#include "triangle_mesh.h"
+#include "accelerator.h"
+#include "batch_integrator.h"
+#include "light_list.h"
+#include "restir.h"
+#include "sampler.h"
+#include "scene_arena.h"
 
 //Embree
 #include "rtcore.h"
 
+#include <cstdlib>
 #include <iostream>
 #include <fstream>
 
@@ -18,16 +31,48 @@
 
 auto material_bunny = make_shared<lambertian>(color(0.5, 0.3, 0.0));
 
-
-// Returns the color of the background
-color ray_color(ray &R, hittable& world, int depth, RTCScene &scene, Mesh &mesh) {
-    hit_record rec;
-
-    // If we go over the ray bounce limit (depth), no more light is gathered
-    if (depth <= 0) {
-        return color(0, 0, 0);
-    }
-
+// Trace the bunny with Embree, or with the native triangle backend
+const bool use_embree = true;
+// Build the native bvh with spatial splits (SBVH)
+const bool use_spatial_splits = true;
+// Cache file of the native bvh, rebuilt when the mesh or build options change
+const std::string bvh_cache_path = "bunny.bvh";
+// Acceleration structure for the objects of the world
+const accel_type world_accel = accel_type::bvh;
+// Random numbers of the paths: camera jitter and material sampling
+const sampler_type path_sampler = sampler_type::sobol;
+// Shade a scanline of paths at a time, batched by material type, instead of
+// following each path to the end with ray_color
+const bool batch_shading = true;
+// Instruction set of the simd kernels ("scalar", "sse4.2", "avx2" or "avx512"),
+// empty for the newest one the cpu supports. RAY_TRACER_ISA overrides it.
+const std::string force_isa = "";
+// Preview of the direct light only: render this many frames with restir_di,
+// one sample per pixel with reservoirs reused between frames, and write the
+// last one instead of the path traced image. 0 for the path tracer.
+const int restir_preview_frames = 0;
+// Guide the bounces off diffuse surfaces with a path_guide (batch shading
+// only): passes of 1, 2, 4... samples per pixel teach it, then one pass takes
+// the samples left. Every pass goes into the image.
+const bool path_guiding = false;
+const int guide_training_passes = 4;
+// Cache the bounced light of diffuse surfaces in a radiance_cache (batch
+// shading only): paths that reach one after their first bounce end in the
+// cache. It is loaded from radiance_cache_path when that was baked for this
+// scene, from any view; else radiance_cache_spp samples per pixel train it,
+// go into the image too, and it is saved there.
+const bool radiance_caching = false;
+const int radiance_cache_spp = 8;
+const std::string radiance_cache_path = "scene.rcache";
+// Caustics through glass and metal by progressive photon mapping (batch
+// shading only): the samples of each pixel are split over photon_passes
+// passes, each with new photons gathered over a smaller radius.
+const bool caustic_photons = false;
+const int photon_passes = 16;
+
+
+// Hit of the ray with the Embree bunny
+bool hit_embree(ray& R, RTCScene& scene, Mesh& mesh, hit_record& rec) {
     RTCIntersectContext context;
     rtcInitIntersectContext(&context);
 
@@ -49,47 +94,84 @@ color ray_color(ray &R, hittable& world, int depth, RTCScene &scene, Mesh &mesh)
 
     // Perform ray intersection
     rtcIntersect1(scene, &context, &rh);
-    if (rh.hit.geomID != RTC_INVALID_GEOMETRY_ID) {
-        Triangle* triangles = (Triangle*)mesh.getVertexIndices();
-        Triangle t = triangles[rh.hit.primID];
-        Vertex* vertices = (Vertex*)mesh.getVertexData();
-        point3 v0 = make_point(vertices[t.v0]);
-        point3 v1 = make_point(vertices[t.v1]);
-        point3 v2 = make_point(vertices[t.v2]);
-        vec3 ab = v1 - v0;
-        vec3 ac = v2 - v0;
-        rec.p = v0 + (ab * rh.hit.u) + (ac * rh.hit.v);
-        rec.normal = vec3(rh.hit.Ng_x, rh.hit.Ng_y, rh.hit.Ng_z);
-        rec.mat_ptr = material_bunny;
-        rec.t = (rec.p - R.origin()).length();
+    if (rh.hit.geomID == RTC_INVALID_GEOMETRY_ID) {
+        return false;
+    }
+
+    Triangle* triangles = (Triangle*)mesh.getVertexIndices();
+    Triangle t = triangles[rh.hit.primID];
+    Vertex* vertices = (Vertex*)mesh.getVertexData();
+    point3 v0 = make_point(vertices[t.v0]);
+    point3 v1 = make_point(vertices[t.v1]);
+    point3 v2 = make_point(vertices[t.v2]);
+    vec3 ab = v1 - v0;
+    vec3 ac = v2 - v0;
+    rec.p = v0 + (ab * rh.hit.u) + (ac * rh.hit.v);
+    // Embree's geometric normal is neither unit length nor facing the ray
+    rec.set_face_normal(R, unit_vector(vec3(rh.hit.Ng_x, rh.hit.Ng_y, rh.hit.Ng_z)));
+    rec.mat_ptr = material_bunny;
+    rec.object = nullptr;
+    rec.t = (rec.p - R.origin()).length();
+    return true;
+}
 
+// Returns the color of the background
+color background(ray& R) {
+    vec3 unit_direction = unit_vector(R.direction());
+    auto t = 0.5 * (unit_direction.y() + 1.0);
+    return (1.0 - t) * color(1.0, 1.0, 1.0) + t * color(0.5, 0.7, 1.0);
+}
+
+// Color brought back along a ray, following it recursively. Lights are only
+// found when a bounce hits them; the batch integrator also samples them.
+color ray_color(ray &R, hittable& world, int depth, sample_stream& samples, RTCScene &scene, Mesh &mesh) {
+    hit_record rec;
+
+    // If we go over the ray bounce limit (depth), no more light is gathered
+    if (depth <= 0) {
+        return color(0, 0, 0);
+    }
+
+    if (use_embree && hit_embree(R, scene, mesh, rec)) {
         ray scattered;
         color attenuation;
-        if (rec.mat_ptr->scatter(R, rec, attenuation, scattered)) {
-            return attenuation * ray_color(scattered, world, depth - 1, scene, mesh);
+        samples.start_bounce();
+        if (rec.mat_ptr->scatter(R, rec, samples, attenuation, scattered)) {
+            return attenuation * ray_color(scattered, world, depth - 1, samples, scene, mesh);
         }
         return color(0, 1, 0);
     }
-    
 
     //Ignoring hits very near 0
     if (world.hit(R, 0.001, infinity, rec)) {
         ray scattered;
         color attenuation;
-        if (rec.mat_ptr->scatter(R, rec, attenuation, scattered)) {
-            return attenuation * ray_color(scattered, world, depth - 1, scene, mesh);
+        color emitted = rec.mat_ptr->emitted(0, 0, rec.p);
+        samples.start_bounce();
+        if (rec.mat_ptr->scatter(R, rec, samples, attenuation, scattered)) {
+            return emitted + attenuation * ray_color(scattered, world, depth - 1, samples, scene, mesh);
         }
-        return color(0, 0, 0);
+        return emitted;
     }
 
-    vec3 unit_direction = unit_vector(R.direction());
-    auto t = 0.5 * (unit_direction.y() + 1.0);
-    return (1.0 - t) * color(1.0, 1.0, 1.0) + t * color(0.5, 0.7, 1.0);
+    return background(R);
 }
 
 
 
 int main() {
+    // Pick the kernels before any object is built with them
+    const char* isa_variable = std::getenv("RAY_TRACER_ISA");
+    std::string isa_name = isa_variable ? isa_variable : force_isa;
+    cpu_isa detected = detect_cpu_isa();
+    cpu_isa requested = detected;
+    if (!isa_name.empty() && !parse_cpu_isa(isa_name, requested)) {
+        std::cerr << "Unknown instruction set " << isa_name << '\n';
+    }
+    cpu_isa isa = select_kernel_isa(requested);
+    std::cerr << "Kernels: " << cpu_isa_name(isa) << " (cpu supports " << cpu_isa_name(detected)
+        << (isa != requested ? ", " + isa_name + " is not supported)\n" : ")\n");
+
     // Open obj file (3D model)
     Mesh bunny_mesh;
     loadMesh("./3D objects/bunny.obj", bunny_mesh);
@@ -130,38 +212,257 @@ int main() {
     //World
     
     auto R = cos(pi / 4);
+    // Owns the objects and materials of the scene, released together when
+    // main returns, after everything that points into it
+    scene_arena arena;
     hittable_list world;
 
-    auto material_ground = make_shared<lambertian>(color(0.8, 0.8, 0.0));
-    auto material_center = make_shared<lambertian>(color(0.5, 0.1, 1));
-    auto material_left = make_shared<metal>(color(0.5, 0.6, 0.6), 0.2);
-    auto material_right = make_shared<dielectric>(1.5);
+    auto material_ground = arena.make<lambertian>(color(0.8, 0.8, 0.0));
+    auto material_center = arena.make<lambertian>(color(0.5, 0.1, 1));
+    auto material_left = arena.make<metal>(color(0.5, 0.6, 0.6), 0.2);
+    auto material_right = arena.make<dielectric>(1.5);
+
+    world.add(arena.make<sphere>(point3(0.0, -100.5, -1.0), 100.0, material_ground));
+    world.add(arena.make<sphere>(point3(-2.0, 0.0, -1.0), 0.5, material_right));
+    world.add(arena.make<sphere>(point3(-1.0, 0.0, -1.0), 0.5, material_left));
+    //world.add(arena.make<sphere>(point3(1.0, 0.0, -1.0), 0.5, material_left));
+
+    shared_ptr<triangle_mesh> native_bunny;
+    if (!use_embree) {
+        bvh_build_options options;
+        options.spatial_splits = use_spatial_splits;
+        native_bunny = arena.make<triangle_mesh>(bunny_mesh, material_bunny, options, bvh_cache_path);
+        world.add(native_bunny);
+        std::cerr << "Native bvh: " << native_bunny->accel.node_count() << " nodes, "
+            << native_bunny->accel.prim_count() << " references for "
+            << native_bunny->triangles.size() << " triangles"
+            << (native_bunny->loaded_from_cache ? " (from cache)\n" : "\n");
+    }
 
-    world.add(make_shared<sphere>(point3(0.0, -100.5, -1.0), 100.0, material_ground));
-    world.add(make_shared<sphere>(point3(-2.0, 0.0, -1.0), 0.5, material_right));
-    world.add(make_shared<sphere>(point3(-1.0, 0.0, -1.0), 0.5, material_left));
-    //world.add(make_shared<sphere>(point3(1.0, 0.0, -1.0), 0.5, material_left));
+    shared_ptr<hittable> scene_root = make_accelerator(world, world_accel);
+    std::cerr << "World: " << world.objects.size() << " objects in a " << accel_name(world_accel) << '\n';
 
     //Camera
-    camera camera(point3(-1, 0.5, 5), point3(-1, 0, 0), vec3(0, -1, 0), 20, aspect_ratio); // front camera
+    camera camera(point3(-1, 0.5, 5), point3(-1, 0, 0), vec3(0, 1, 0), 20, aspect_ratio); // front camera
 
     // Render
     std::ofstream file("image.ppm", std::ios::out);
     file << "P3\n" << image_width << ' ' << image_height << "\n255\n";
 
-    for (int j = image_height - 1; j >= 0; --j) {
-        std::cerr << "\rScanlines remaining: " << j << ' ' << std::flush;
+    shared_ptr<sampler> path_samples = make_sampler(path_sampler, samples_per_pixel);
+    std::cerr << "Sampler: " << sampler_name(path_sampler) << '\n';
+
+    batch_integrator integrator(max_depth);
+    integrator.lights = light_list(world.objects);
+    std::cerr << "Lights: " << integrator.lights.lights.size() << " in a tree of "
+        << integrator.lights.node_count() << " nodes\n";
+    std::vector<ray> rays;
+    std::vector<sample_stream> paths;
+    std::vector<color> radiance;
+    auto intersect = [&](ray& R, hit_record& rec) {
+        return (use_embree && hit_embree(R, scene, bunny_mesh, rec)) || scene_root->hit(R, 0.001, infinity, rec);
+    };
+    auto intersect_packet = [&](ray8& packet, int active, hit_record* recs) {
+        int embree_hits = 0;
+        if (use_embree) {
+            for (int i = 0; i < ray8::size; i++) {
+                ray R = packet.get(i);
+                if ((active & (1 << i)) && hit_embree(R, scene, bunny_mesh, recs[i])) {
+                    embree_hits |= 1 << i;
+                }
+            }
+        }
+        packet.set_range(0.001, infinity);
+        return embree_hits | scene_root->hit_packet(packet, active & ~embree_hits, recs);
+    };
+
+    // Sums of the samples [first, first + count) of each pixel of row j
+    std::vector<color> row;
+    auto trace_row = [&](int j, int first, int count, std::vector<color>& sums) {
+        rays.clear();
+        paths.clear();
+        for (int i = 0; i < image_width; ++i) {
+            // The samples of a pixel, eight at a time
+            for (int s0 = 0; s0 < count; s0 += ray8::size) {
+                int n = std::min(ray8::size, count - s0);
+                real u[ray8::size], v[ray8::size];
+                for (int s = 0; s < n; ++s) {
+                    paths.push_back(sample_stream(path_samples.get(), i, j, first + s0 + s));
+                    u[s] = (i + paths.back().next()) / (image_width - 1);
+                    v[s] = (j + paths.back().next()) / (image_height - 1);
+                }
+                for (int s = n; s < ray8::size; ++s) {
+                    u[s] = u[0];
+                    v[s] = v[0];
+                }
+                ray8 packet;
+                camera.get_ray_packet(u, v, packet);
+                for (int s = 0; s < n; ++s) {
+                    rays.push_back(packet.get(s));
+                    rays.back().dir = unit_vector(rays.back().dir);
+                }
+            }
+        }
+        integrator.trace(rays, paths, radiance, intersect, intersect_packet, background);
+        sums.assign(image_width, color(0, 0, 0));
         for (int i = 0; i < image_width; ++i) {
-            color pixel_color(0, 0, 0);
-            for (int s = 0; s < samples_per_pixel; ++s) {
-                auto u = (i + random_double()) / (image_width - 1);
-                auto v = (j + random_double()) / (image_height - 1);
-                ray R = camera.get_ray(u, v);
-                R.dir = unit_vector(R.dir);
-                pixel_color += ray_color(R, world, max_depth, scene, bunny_mesh);
+            for (int s = 0; s < count; ++s) {
+                sums[i] += radiance[i * count + s];
+            }
+        }
+    };
+
+    if (restir_preview_frames > 0) {
+        restir_di preview(image_width, image_height);
+        std::vector<color> image;
+        for (int frame = 0; frame < restir_preview_frames; ++frame) {
+            std::cerr << "\rFrames remaining: " << restir_preview_frames - frame << ' ' << std::flush;
+            preview.render(camera, integrator.lights, path_samples.get(), frame, intersect, background, image);
+        }
+        for (int j = image_height - 1; j >= 0; --j) {
+            for (int i = 0; i < image_width; ++i) {
+                write_color(file, image[j * image_width + i], 1);
+            }
+        }
+    } else if (path_guiding && batch_shading) {
+        aabb bounds;
+        scene_root->bounding_box(bounds);
+        path_guide guide(bounds);
+        integrator.guide = &guide;
+        std::vector<color> image(image_width * image_height, color(0, 0, 0));
+        auto add_pass = [&](int first, int count) {
+            for (int j = image_height - 1; j >= 0; --j) {
+                trace_row(j, first, count, row);
+                for (int i = 0; i < image_width; ++i) {
+                    image[j * image_width + i] += row[i];
+                }
+            }
+        };
+        int first = 0;
+        for (int pass = 0; pass < guide_training_passes && first + (1 << pass) < samples_per_pixel; ++pass) {
+            std::cerr << "\rTraining pass " << pass + 1 << ' ' << std::flush;
+            add_pass(first, 1 << pass);
+            first += 1 << pass;
+            guide.refine();
+        }
+        std::cerr << "\nGuide: " << guide.leaf_count() << " regions, "
+            << guide.direction_node_count() << " direction nodes\n";
+        guide.training = false;
+        add_pass(first, samples_per_pixel - first);
+        for (int j = image_height - 1; j >= 0; --j) {
+            for (int i = 0; i < image_width; ++i) {
+                write_color(file, image[j * image_width + i], samples_per_pixel);
+            }
+        }
+    } else if (caustic_photons && batch_shading) {
+        photon_map caustics(world.objects);
+        integrator.caustics = &caustics;
+        std::vector<color> image(image_width * image_height, color(0, 0, 0));
+        int passes = std::min(photon_passes, samples_per_pixel);
+        for (int pass = 0; pass < passes; ++pass) {
+            std::cerr << "\rPhoton passes remaining: " << passes - pass << ' ' << std::flush;
+            caustics.trace_pass(integrator.lights, path_samples.get(), intersect, background);
+            int first = samples_per_pixel * pass / passes;
+            int count = samples_per_pixel * (pass + 1) / passes - first;
+            for (int j = image_height - 1; j >= 0; --j) {
+                trace_row(j, first, count, row);
+                for (int i = 0; i < image_width; ++i) {
+                    image[j * image_width + i] += row[i];
+                }
+            }
+        }
+        std::cerr << "\nPhotons: " << caustics.photon_count() << " in the last pass, radius " << caustics.radius << '\n';
+        for (int j = image_height - 1; j >= 0; --j) {
+            for (int i = 0; i < image_width; ++i) {
+                write_color(file, image[j * image_width + i], samples_per_pixel);
             }
-            write_color(file, pixel_color, samples_per_pixel);
         }
+    } else if (radiance_caching && batch_shading) {
+        aabb bounds;
+        scene_root->bounding_box(bounds);
+        radiance_cache cache(bounds.extent().length() / 64);
+        integrator.cache = &cache;
+        // A baked cache is only good for the same objects, materials and sky;
+        // the Embree bunny is not in the world, so it is added by hand
+        uint64_t key = hash_value(use_embree, hash_bytes(&bounds, sizeof(bounds)));
+        bool keyed = scene_key(world.objects, key);
+        if (use_embree) {
+            key = hash_bytes(bunny_mesh.positions, sizeof(float) * 3 * bunny_mesh.num_vertices, key);
+            key = hash_bytes(bunny_mesh.tri_indices, sizeof(int) * 3 * bunny_mesh.num_triangles, key);
+            keyed = keyed && material_key(material_bunny.get(), key);
+        }
+        // The sky toward the faces, edges and corners of a cube
+        for (int k = 0; k < 27; k++) {
+            if (k != 13) {
+                ray sky(point3(0, 0, 0), vec3(k % 3 - 1, k / 3 % 3 - 1, k / 9 - 1));
+                key = hash_vec3(background(sky), key);
+            }
+        }
+        std::vector<color> image(image_width * image_height, color(0, 0, 0));
+        auto add_pass = [&](int first, int count) {
+            for (int j = image_height - 1; j >= 0; --j) {
+                std::cerr << "\rScanlines remaining: " << j << ' ' << std::flush;
+                trace_row(j, first, count, row);
+                for (int i = 0; i < image_width; ++i) {
+                    image[j * image_width + i] += row[i];
+                }
+            }
+        };
+        int first = 0;
+        if (!keyed) {
+            std::cerr << "Radiance cache: the scene holds objects it can't key, not saved\n";
+        }
+        if (keyed && cache.load(radiance_cache_path, key)) {
+            std::cerr << "Radiance cache: " << cache.cell_count() << " cells from " << radiance_cache_path << '\n';
+        } else {
+            first = std::min(radiance_cache_spp, samples_per_pixel);
+            add_pass(0, first);
+            std::cerr << "\nRadiance cache: " << cache.cell_count() << " cells, " << cache.dropped() << " records dropped\n";
+            if (keyed) {
+                cache.save(radiance_cache_path, key);
+            }
+        }
+        cache.training = false;
+        if (first < samples_per_pixel) {
+            add_pass(first, samples_per_pixel - first);
+        }
+        for (int j = image_height - 1; j >= 0; --j) {
+            for (int i = 0; i < image_width; ++i) {
+                write_color(file, image[j * image_width + i], samples_per_pixel);
+            }
+        }
+    } else {
+        for (int j = image_height - 1; j >= 0; --j) {
+            std::cerr << "\rScanlines remaining: " << j << ' ' << std::flush;
+            if (batch_shading) {
+                trace_row(j, 0, samples_per_pixel, row);
+                for (int i = 0; i < image_width; ++i) {
+                    write_color(file, row[i], samples_per_pixel);
+                }
+                continue;
+            }
+            for (int i = 0; i < image_width; ++i) {
+                color pixel_color(0, 0, 0);
+                for (int s = 0; s < samples_per_pixel; ++s) {
+                    sample_stream samples(path_samples.get(), i, j, s);
+                    auto u = (i + samples.next()) / (image_width - 1);
+                    auto v = (j + samples.next()) / (image_height - 1);
+                    ray R = camera.get_ray(u, v);
+                    R.dir = unit_vector(R.dir);
+                    pixel_color += ray_color(R, *scene_root, max_depth, samples, scene, bunny_mesh);
+                }
+                write_color(file, pixel_color, samples_per_pixel);
+            }
+        }
+    }
+
+    if (batch_shading && restir_preview_frames == 0) {
+        std::cerr << "\nAverage path length: " << double(integrator.path_segments) / integrator.paths_traced << " rays";
+    }
+    if (native_bunny) {
+        const bvh_stats& stats = native_bunny->accel.stats;
+        std::cerr << "\nNative bvh: " << double(stats.nodes_visited) / stats.rays << " nodes and "
+            << double(stats.primitives_tested) / stats.rays << " triangles tested per ray\n";
     }
 
     rtcReleaseScene(scene);
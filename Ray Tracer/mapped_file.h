@@ -0,0 +1,118 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read-only memory mapping of a whole file, unmapped on destruction
+class mapped_file {
+	public:
+		// Returns nullptr if the file can't be opened or is empty
+		static std::shared_ptr<mapped_file> open(const std::string& path);
+
+		~mapped_file();
+
+		mapped_file(const mapped_file&) = delete;
+		mapped_file& operator=(const mapped_file&) = delete;
+
+		const char* data() const { return bytes; }
+		size_t size() const { return length; }
+
+	private:
+		const char* bytes = nullptr;
+		size_t length = 0;
+#if defined(_WIN32)
+		HANDLE file = INVALID_HANDLE_VALUE;
+		HANDLE mapping = nullptr;
+#endif
+
+		mapped_file() {}
+};
+
+#if defined(_WIN32)
+
+std::shared_ptr<mapped_file> mapped_file::open(const std::string& path) {
+	std::shared_ptr<mapped_file> mf(new mapped_file());
+	mf->file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (mf->file == INVALID_HANDLE_VALUE) {
+		return nullptr;
+	}
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(mf->file, &size) || size.QuadPart == 0) {
+		return nullptr;
+	}
+	mf->mapping = CreateFileMappingA(mf->file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mf->mapping == nullptr) {
+		return nullptr;
+	}
+	mf->bytes = static_cast<const char*>(MapViewOfFile(mf->mapping, FILE_MAP_READ, 0, 0, 0));
+	if (mf->bytes == nullptr) {
+		return nullptr;
+	}
+	mf->length = static_cast<size_t>(size.QuadPart);
+	return mf;
+}
+
+mapped_file::~mapped_file() {
+	if (bytes) {
+		UnmapViewOfFile(bytes);
+	}
+	if (mapping) {
+		CloseHandle(mapping);
+	}
+	if (file != INVALID_HANDLE_VALUE) {
+		CloseHandle(file);
+	}
+}
+
+#else
+
+std::shared_ptr<mapped_file> mapped_file::open(const std::string& path) {
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return nullptr;
+	}
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size == 0) {
+		close(fd);
+		return nullptr;
+	}
+	void* address = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+	// The mapping stays valid after closing the descriptor
+	close(fd);
+	if (address == MAP_FAILED) {
+		return nullptr;
+	}
+
+	std::shared_ptr<mapped_file> mf(new mapped_file());
+	mf->bytes = static_cast<const char*>(address);
+	mf->length = static_cast<size_t>(info.st_size);
+	return mf;
+}
+
+mapped_file::~mapped_file() {
+	if (bytes) {
+		munmap(const_cast<char*>(bytes), length);
+	}
+}
+
+#endif
+
+#endif // !MAPPED_FILE_H
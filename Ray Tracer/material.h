@@ -2,19 +2,77 @@
 #define MATERIAL_H
 
 #include "utility_functions.h"
+#include "hittable.h"
+#include "sampler.h"
 #include "texture.h"
 
-struct hit_record;
+// Scattering of the built-in materials. The material classes call these,
+// and material_table runs them in batches over its flat entries. The random
+// numbers come from the sample stream of the path, in the block of the
+// current bounce.
+
+inline void lambertian_scatter(const color& albedo, const hit_record& rec, sample_stream& samples,
+	color& attenuation, ray& scattered) {
+	real u = samples.next();
+	real v = samples.next();
+	scattered = ray(rec.p, sample_cosine_hemisphere(rec.normal, u, v));
+	attenuation = albedo;
+}
+
+inline bool metal_scatter(const color& albedo, real fuzzines, const ray& r_in, const hit_record& rec,
+	sample_stream& samples, color& attenuation, ray& scattered) {
+	real u = samples.next();
+	real v = samples.next();
+	real w = samples.next();
+	vec3 reflected = reflect(unit_vector(r_in.dir), rec.normal);
+	scattered = ray(rec.p, reflected + fuzzines*sample_in_unit_sphere(u, v, w));
+	attenuation = albedo;
+	return (dot(scattered.dir, rec.normal) > 0);
+}
+
+// Schlick's approximation of the reflectance of a dielectric
+inline real dielectric_reflectance(real cos, real ref_idx) {
+	auto r0 = (1 - ref_idx) / (1 + ref_idx);
+	r0 *= r0;
+	return r0 + (1 - r0) * pow((1 - cos), 5);
+}
+
+inline void dielectric_scatter(real index_of_refraction, const ray& r_in, const hit_record& rec,
+	sample_stream& samples, color& attenuation, ray& scattered) {
+	attenuation = color(1, 1, 1);
+	real refraction_ratio = rec.front_face ? (1.0 / index_of_refraction) : index_of_refraction;
+	
+	vec3 unit_direction = unit_vector(r_in.dir);
+	real cos_theta = fmin(dot(-unit_direction, rec.normal), 1.0);
+	real sin_theta = sqrt(1 - (cos_theta * cos_theta));
+
+	bool cannot_refract = refraction_ratio * sin_theta > 1.0;
+	vec3 direction;
+
+	if (cannot_refract || dielectric_reflectance(cos_theta, refraction_ratio) > samples.next()) {
+		direction = reflect(unit_direction, rec.normal);
+	}
+	else {
+		direction = refract(unit_direction, rec.normal, refraction_ratio);
+	}
+
+	scattered = ray(rec.p, direction);
+}
 
 class material {
 	public:
 		virtual bool scatter(
-			ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+			ray& r_in, const hit_record& rec, sample_stream& samples, color& attenuation, ray& scattered
 		)const = 0;
 
-		virtual color emitted(double u, double v, const point3& p) const {
+		virtual color emitted(real u, real v, const point3& p) const {
 			return color(0, 0, 0);
 		}
+
+		// Whether emitted can be other than black
+		virtual bool is_emissive() const {
+			return false;
+		}
 };
 
 class lambertian : public material {
@@ -24,16 +82,9 @@ class lambertian : public material {
 		lambertian(const color& a) : albedo(a) {}
 
 		virtual bool scatter(
-			ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+			ray& r_in, const hit_record& rec, sample_stream& samples, color& attenuation, ray& scattered
 		)const override {
-			auto scatter_direction = rec.normal + random_unit_vector();
-
-			if (scatter_direction.near_zero()) {
-				scatter_direction = rec.normal;
-			}
-
-			scattered = ray(rec.p, scatter_direction);
-			attenuation = albedo;
+			lambertian_scatter(albedo, rec, samples, attenuation, scattered);
 			return true;
 		}
 };
@@ -41,56 +92,29 @@ class lambertian : public material {
 class metal : public material {
 	public:
 		color albedo;
-		double fuzzines;
+		real fuzzines;
 
 	public:
-		metal(const color& a, double f) : albedo(a), fuzzines(f < 1 ? f : 1) {}
+		metal(const color& a, real f) : albedo(a), fuzzines(f < 1 ? f : 1) {}
 
 		virtual bool scatter(
-			ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+			ray& r_in, const hit_record& rec, sample_stream& samples, color& attenuation, ray& scattered
 		)const override {
-			vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
-			scattered = ray(rec.p, reflected + fuzzines*random_in_unit_sphere());
-			attenuation = albedo;
-			return (dot(scattered.direction(), rec.normal) > 0);
+			return metal_scatter(albedo, fuzzines, r_in, rec, samples, attenuation, scattered);
 		}
 };
 
 class dielectric : public material {
 	public:
-		double index_of_refraction;
-
-	private:
-		static double reflectance(double cos, double ref_idx) {
-			auto r0 = (1 - ref_idx) / (1 + ref_idx);
-			r0 *= r0;
-			return r0 + (1 - r0) * pow((1 - cos), 5);
-		}
+		real index_of_refraction;
 
 	public:
-		dielectric(double ir) : index_of_refraction(ir) {}
+		dielectric(real ir) : index_of_refraction(ir) {}
 
 		virtual bool scatter(
-			ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+			ray& r_in, const hit_record& rec, sample_stream& samples, color& attenuation, ray& scattered
 		)const override {
-			attenuation = color(1, 1, 1);
-			double refraction_ratio = rec.front_face ? (1.0 / index_of_refraction) : index_of_refraction;
-			
-			vec3 unit_direction = unit_vector(r_in.direction());
-			double cos_theta = fmin(dot(-unit_direction, rec.normal), 1.0);
-			double sin_theta = sqrt(1 - (cos_theta * cos_theta));
-
-			bool cannot_refract = refraction_ratio * sin_theta > 1.0;
-			vec3 direction;
-
-			if (cannot_refract || reflectance(cos_theta, refraction_ratio) > random_double()) {
-				direction = reflect(unit_direction, rec.normal);
-			}
-			else {
-				direction = refract(unit_direction, rec.normal, refraction_ratio);
-			}
-
-			scattered = ray(rec.p, direction);
+			dielectric_scatter(index_of_refraction, r_in, rec, samples, attenuation, scattered);
 			return true;
 		}
 };
@@ -104,14 +128,18 @@ class diffuse_light : public material {
 		diffuse_light(shared_ptr<texture> a) :emit(a) {}
 		
 		virtual bool scatter(
-			ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+			ray& r_in, const hit_record& rec, sample_stream& samples, color& attenuation, ray& scattered
 		)const override {
 			return false;
 		}
 
-		virtual color emitted(double u, double v, const point3& p) const override {
+		virtual color emitted(real u, real v, const point3& p) const override {
 			return emit->value(u, v, p);
 		}
+
+		virtual bool is_emissive() const override {
+			return true;
+		}
 };
 
 #endif // !MATERIAL_H
@@ -0,0 +1,70 @@
+#ifndef MATERIAL_TABLE_H
+#define MATERIAL_TABLE_H
+
+#include "material.h"
+
+#include <unordered_map>
+#include <vector>
+
+enum class material_type : int { lambertian, metal, dielectric, other };
+const int material_type_count = 4;
+
+// Parameters of one material; which ones are used depends on the type
+struct material_entry {
+	material_type type;
+	color albedo; // lambertian and metal
+	real fuzzines; // metal
+	real index_of_refraction; // dielectric
+	const material* source; // scattered through its virtual call for other
+	bool emissive; // emitted is looked up on the source
+};
+
+// The materials of a scene in one flat array, each tagged with its type.
+// Known material classes have their parameters copied in, any other class
+// is kept as type other.
+class material_table {
+	public:
+		std::vector<material_entry> entries;
+
+	public:
+		// Index of the entry of a material, added the first time it is seen
+		int slot(const material* m);
+
+	private:
+		std::unordered_map<const material*, int> slot_of;
+		// Hits come in runs on the same material
+		const material* last = nullptr;
+		int last_slot = -1;
+};
+
+int material_table::slot(const material* m) {
+	if (m == last) {
+		return last_slot;
+	}
+
+	auto found = slot_of.find(m);
+	if (found == slot_of.end()) {
+		material_entry entry = { material_type::other, color(0, 0, 0), 0, 1, m, m->is_emissive() };
+		if (auto l = dynamic_cast<const lambertian*>(m)) {
+			entry.type = material_type::lambertian;
+			entry.albedo = l->albedo;
+		}
+		else if (auto mt = dynamic_cast<const metal*>(m)) {
+			entry.type = material_type::metal;
+			entry.albedo = mt->albedo;
+			entry.fuzzines = mt->fuzzines;
+		}
+		else if (auto d = dynamic_cast<const dielectric*>(m)) {
+			entry.type = material_type::dielectric;
+			entry.index_of_refraction = d->index_of_refraction;
+		}
+		found = slot_of.emplace(m, static_cast<int>(entries.size())).first;
+		entries.push_back(entry);
+	}
+
+	last = m;
+	last_slot = found->second;
+	return last_slot;
+}
+
+#endif // !MATERIAL_TABLE_H
@@ -0,0 +1,371 @@
+#ifndef PATH_GUIDE_H
+#define PATH_GUIDE_H
+
+#include "aabb.h"
+
+#include <atomic>
+#include <cmath>
+#include <utility>
+#include <vector>
+
+// Adds to an atomic real without a lock
+inline void atomic_add(std::atomic<real>& a, real value) {
+	real current = a.load(std::memory_order_relaxed);
+	while (!a.compare_exchange_weak(current, current + value, std::memory_order_relaxed)) {
+	}
+}
+
+// Light arriving at a point from each direction, as a quadtree over the
+// square that the equal-area cylindrical map makes of the sphere
+// (cos theta along x, phi along y). Each node holds the energy recorded in
+// its four quadrants. Quadrant q is (q & 1, q >> 1) in halves of the node,
+// with child[q] the node splitting it or 0.
+class direction_tree {
+	public:
+		direction_tree() : nodes(1) {}
+
+		// Direction for numbers u, v, in proportion to the recorded energy,
+		// and its pdf per unit solid angle; uniform over the sphere until
+		// something is recorded
+		vec3 sample(real u, real v, real& pdf) const;
+		real pdf(const vec3& direction) const;
+
+		// Adds light arriving from direction. Lock free, so any number of
+		// threads can record into the same tree, as long as none is building.
+		void record(const vec3& direction, real value);
+
+		real total() const;
+		int node_count() const { return static_cast<int>(nodes.size()); }
+
+		// Remakes the tree, empty, from the energy recorded in `energy`:
+		// quadrants holding more than `threshold` of the total are split, down
+		// to max_depth levels. energy may be this tree's copy.
+		void build(const direction_tree& energy, real threshold, int max_depth);
+
+	private:
+		struct node {
+			std::atomic<real> sum[4];
+			int child[4];
+
+			node() {
+				for (int q = 0; q < 4; q++) {
+					sum[q].store(0, std::memory_order_relaxed);
+					child[q] = 0;
+				}
+			}
+			node(const node& other) { *this = other; }
+			node& operator=(const node& other) {
+				for (int q = 0; q < 4; q++) {
+					sum[q].store(other.sum[q].load(std::memory_order_relaxed), std::memory_order_relaxed);
+					child[q] = other.child[q];
+				}
+				return *this;
+			}
+		};
+
+		std::vector<node> nodes; // the root first
+
+		static void to_square(const vec3& direction, real& x, real& y);
+		static vec3 from_square(real x, real y);
+};
+
+void direction_tree::to_square(const vec3& direction, real& x, real& y) {
+	x = std::min(std::max((direction.z() + 1) / 2, real(0)), real(1));
+	real phi = atan2(direction.y(), direction.x());
+	y = (phi < 0 ? phi + 2 * pi : phi) / (2 * pi);
+}
+
+vec3 direction_tree::from_square(real x, real y) {
+	real z = 2 * x - 1;
+	real r = sqrt(std::max(real(0), 1 - z * z));
+	real phi = 2 * pi * y;
+	return vec3(r * cos(phi), r * sin(phi), z);
+}
+
+real direction_tree::total() const {
+	const node& root = nodes[0];
+	real sum = 0;
+	for (int q = 0; q < 4; q++) {
+		sum += root.sum[q].load(std::memory_order_relaxed);
+	}
+	return sum;
+}
+
+// A node's quadrants add up to the quadrant of its parent, so the pdf of a
+// leaf quadrant at depth d is 4^d times its share of the total, with no
+// division on the way down
+vec3 direction_tree::sample(real u, real v, real& pdf) const {
+	real sum = total();
+	if (sum <= 0) {
+		pdf = 1 / (4 * pi);
+		return from_square(u, v);
+	}
+
+	// u picks the quadrant on each level and what is left of it carries on
+	// down, in double so that 20 levels keep enough bits
+	double left = double(u) * sum;
+	real x = 0, y = 0, size = 1;
+	real share = 0;
+	int depth = 0;
+	for (int n = 0;;) {
+		const node& nd = nodes[n];
+		int q = 0;
+		share = nd.sum[0].load(std::memory_order_relaxed);
+		while (q < 3 && left >= share) {
+			left -= share;
+			share = nd.sum[++q].load(std::memory_order_relaxed);
+		}
+		size /= 2;
+		x += (q & 1) * size;
+		y += (q >> 1) * size;
+		depth++;
+		if (!nd.child[q]) {
+			break;
+		}
+		n = nd.child[q];
+	}
+	pdf = std::ldexp(share / sum, 2 * depth) / (4 * pi);
+	real along = share > 0 ? real(std::min(left / share, 1.0)) : 0;
+	return from_square(x + along * size, y + v * size);
+}
+
+real direction_tree::pdf(const vec3& direction) const {
+	real sum = total();
+	if (sum <= 0) {
+		return 1 / (4 * pi);
+	}
+	real x, y;
+	to_square(direction, x, y);
+	real share = 0;
+	int depth = 0;
+	for (int n = 0;;) {
+		int qx = x >= real(0.5) ? 1 : 0;
+		int qy = y >= real(0.5) ? 1 : 0;
+		int q = qx + 2 * qy;
+		share = nodes[n].sum[q].load(std::memory_order_relaxed);
+		depth++;
+		if (!nodes[n].child[q]) {
+			break;
+		}
+		n = nodes[n].child[q];
+		x = 2 * x - qx;
+		y = 2 * y - qy;
+	}
+	return std::ldexp(share / sum, 2 * depth) / (4 * pi);
+}
+
+void direction_tree::record(const vec3& direction, real value) {
+	if (!(value > 0)) {
+		return;
+	}
+	real x, y;
+	to_square(direction, x, y);
+	for (int n = 0;;) {
+		int qx = x >= real(0.5) ? 1 : 0;
+		int qy = y >= real(0.5) ? 1 : 0;
+		int q = qx + 2 * qy;
+		atomic_add(nodes[n].sum[q], value);
+		x = 2 * x - qx;
+		y = 2 * y - qy;
+		if (!nodes[n].child[q]) {
+			break;
+		}
+		n = nodes[n].child[q];
+	}
+}
+
+void direction_tree::build(const direction_tree& energy, real threshold, int max_depth) {
+	// A quadrant of the new tree, with the energy the old one saw in it: the
+	// old sums where the old tree went that deep, else a quarter of the parent
+	struct cell {
+		int node;
+		int source; // node of `energy`, or -1
+		int depth;
+		real sum[4];
+	};
+
+	std::vector<node> old;
+	old.swap(nodes);
+	const std::vector<node>& source = &energy == this ? old : energy.nodes;
+	nodes.assign(1, node());
+
+	cell root = { 0, 0, 1, {} };
+	real total = 0;
+	for (int q = 0; q < 4; q++) {
+		root.sum[q] = source[0].sum[q].load(std::memory_order_relaxed);
+		total += root.sum[q];
+	}
+	if (total <= 0) {
+		return;
+	}
+
+	std::vector<cell> stack(1, root);
+	while (!stack.empty()) {
+		cell c = stack.back();
+		stack.pop_back();
+		for (int q = 0; q < 4; q++) {
+			if (c.depth >= max_depth || c.sum[q] <= threshold * total) {
+				continue;
+			}
+			cell child = { static_cast<int>(nodes.size()), -1, c.depth + 1, {} };
+			nodes.push_back(node());
+			nodes[c.node].child[q] = child.node;
+			if (c.source >= 0 && source[c.source].child[q]) {
+				child.source = source[c.source].child[q];
+				for (int k = 0; k < 4; k++) {
+					child.sum[k] = source[child.source].sum[k].load(std::memory_order_relaxed);
+				}
+			}
+			else {
+				for (int k = 0; k < 4; k++) {
+					child.sum[k] = c.sum[q] / 4;
+				}
+			}
+			stack.push_back(child);
+		}
+	}
+}
+
+// Online path guiding with a spatial-directional tree (SD-tree, Mueller et
+// al. 2017). Space is split by a binary tree over the scene; each leaf holds
+// two direction_trees, one to sample from, learned in the last pass, and one
+// that records the light paths find in this one.
+//
+// Render in passes of doubling sample counts, with refine() between them:
+// it splits the leaves that took many records, makes what they recorded the
+// distribution to sample, and refines the recording trees where the light
+// was. record() is lock free and may be called from many threads at once;
+// refine() must have the guide to itself.
+class path_guide {
+	public:
+		// Share of the directions still drawn from the material, which keeps
+		// the estimate unbiased where the guide is wrong
+		real bsdf_fraction = real(0.5);
+		// Records a leaf takes before it is split, times sqrt(2^pass), so
+		// leaves hold more records as the passes grow
+		real spatial_threshold = 12000;
+		// Share of a leaf's energy above which a direction quadrant is split
+		real directional_threshold = real(0.01);
+		int max_directional_depth = 20;
+		// Whether paths record into the guide; off for the final pass
+		bool training = true;
+
+	public:
+		explicit path_guide(const aabb& bounds);
+
+		// The directions to sample at p
+		const direction_tree& distribution(const point3& p) const { return leaves[leaf_of(p)].sampling; }
+		// Share of the directions to draw from the material with distribution
+		// d: all of them where nothing was recorded, as uniform directions
+		// would only waste the half below the surface
+		real bsdf_share(const direction_tree& d) const { return d.total() > 0 ? bsdf_fraction : 1; }
+
+		// Light `value` arriving at p from direction, already divided by the
+		// pdf of direction
+		void record(const point3& p, const vec3& direction, real value);
+
+		void refine();
+
+		int leaf_count() const { return static_cast<int>(leaves.size()); }
+		int passes() const { return pass; }
+		// Nodes of all the sampling trees
+		long long direction_node_count() const;
+
+	private:
+		struct space_node {
+			int axis;
+			real split;
+			int child[2];
+			int leaf; // index into leaves, or -1 for an inner node
+		};
+		struct leaf {
+			direction_tree sampling, recording;
+			std::atomic<long long> records;
+
+			leaf() : records(0) {}
+			leaf(const leaf& other)
+				: sampling(other.sampling), recording(other.recording), records(other.records.load()) {}
+		};
+
+		aabb bounds;
+		std::vector<space_node> nodes; // the root first
+		std::vector<leaf> leaves;
+		int pass = 0;
+
+		int leaf_of(const point3& p) const;
+};
+
+path_guide::path_guide(const aabb& bounds) : bounds(bounds) {
+	nodes.push_back({ 0, 0, { 0, 0 }, 0 });
+	leaves.resize(1);
+}
+
+int path_guide::leaf_of(const point3& p) const {
+	int n = 0;
+	while (nodes[n].leaf < 0) {
+		n = nodes[n].child[p[nodes[n].axis] >= nodes[n].split ? 1 : 0];
+	}
+	return nodes[n].leaf;
+}
+
+void path_guide::record(const point3& p, const vec3& direction, real value) {
+	leaf& l = leaves[leaf_of(p)];
+	l.records.fetch_add(1, std::memory_order_relaxed);
+	l.recording.record(direction, value);
+}
+
+void path_guide::refine() {
+	real threshold = spatial_threshold * std::sqrt(std::ldexp(real(1), pass));
+	pass++;
+
+	std::vector<std::pair<int, aabb>> stack(1, { 0, bounds });
+	while (!stack.empty()) {
+		int n = stack.back().first;
+		aabb box = stack.back().second;
+		stack.pop_back();
+
+		if (nodes[n].leaf < 0) {
+			space_node inner = nodes[n];
+			aabb low = box, high = box;
+			low.maximum[inner.axis] = inner.split;
+			high.minimum[inner.axis] = inner.split;
+			stack.push_back({ inner.child[0], low });
+			stack.push_back({ inner.child[1], high });
+			continue;
+		}
+
+		// Halves at the middle of the longest side, each starting out with
+		// what the whole leaf learned and half its records
+		int l = nodes[n].leaf;
+		if (leaves[l].records.load() > threshold) {
+			int axis = box.longest_axis();
+			real split = (box.minimum[axis] + box.maximum[axis]) / 2;
+			leaves[l].records.store(leaves[l].records.load() / 2);
+			leaf copy = leaves[l];
+			int high_leaf = static_cast<int>(leaves.size());
+			leaves.push_back(copy);
+
+			int low_node = static_cast<int>(nodes.size());
+			nodes.push_back({ 0, 0, { 0, 0 }, l });
+			nodes.push_back({ 0, 0, { 0, 0 }, high_leaf });
+			nodes[n] = { axis, split, { low_node, low_node + 1 }, -1 };
+			stack.push_back({ n, box });
+			continue;
+		}
+
+		leaf& done = leaves[l];
+		done.sampling = done.recording;
+		done.recording.build(done.sampling, directional_threshold, max_directional_depth);
+		done.records.store(0);
+	}
+}
+
+long long path_guide::direction_node_count() const {
+	long long count = 0;
+	for (const leaf& l : leaves) {
+		count += l.sampling.node_count();
+	}
+	return count;
+}
+
+#endif // !PATH_GUIDE_H
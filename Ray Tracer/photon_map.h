@@ -0,0 +1,357 @@
+#ifndef PHOTON_MAP_H
+#define PHOTON_MAP_H
+
+#include "box.h"
+#include "box_set.h"
+#include "hittable_list.h"
+#include "light_list.h"
+#include "material_table.h"
+#include "sampler.h"
+#include "sphere.h"
+#include "sphere_set.h"
+#include "triangle_mesh.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+using std::shared_ptr;
+
+// Light that reached a diffuse surface through glass or metal: where it
+// landed, the normal there on the side it came from and the power it brings
+struct photon {
+	point3 p;
+	vec3 normal;
+	color power;
+};
+
+// Caustics by progressive photon mapping (Hachisuka et al. 2008, in the
+// probabilistic form of Knaus and Zwicker 2011). Each pass sends photons
+// from the lights and the background, keeps those that reach a diffuse
+// surface through dielectric or metal objects, and finds the light at a
+// point from the photons within `radius` of it. The radius shrinks after
+// every pass, by (i + alpha) / (i + 1) in area at pass i, so that the average
+// of the passes converges where one fixed radius would stay blurred.
+//
+// Only those photons count, so they are all aimed at a sphere around the
+// glass and metal objects of the scene, like a projection map; photons that
+// hit something diffuse on the way are dropped. A renderer that gathers
+// photons must not also count light that reaches a diffuse surface through
+// glass or metal from the emitters the map traces, which batch_integrator
+// leaves out when given a map. Emitters that are not in the light_list, such
+// as boxes, send no photons and keep their light to the paths.
+//
+// The photons of a pass are kept in a hashed grid of cells 2 * radius wide,
+// sorted into place with a counting sort: counting, a prefix sum and one
+// scatter, with no pointers, so a pass is built in three flat loops. They
+// run on one thread, like the rest of the renderer: the build is under 1% of
+// a pass, the rest being the photons' paths. With threads, each would count
+// its share of the photons, the prefix sum would run over all their counts
+// and each would scatter its share from its own offsets.
+class photon_map {
+	public:
+		int photons_per_pass = 200000;
+		real radius; // of the gathering disk, at first a 100th of the width of the glass and metal
+		real alpha = real(2.0 / 3);
+		int max_bounces = 16;
+
+	public:
+		// Finds the glass and metal among objects, and the extent of the scene
+		photon_map(const std::vector<shared_ptr<hittable>>& objects);
+
+		// Whether there are glass or metal objects to send photons at
+		bool empty() const { return target_radius <= 0; }
+		// Whether the background sends photons, in which case light through
+		// glass from the background is the map's as well
+		bool lit_by_background() const { return environment_flux > 0; }
+		// Whether the light of emitter `object` through glass is the map's
+		bool traces(const hittable* object) const { return sources && sources->contains(object); }
+
+		// Traces a pass of photons from lights and from background(ray&), the
+		// color seen by a ray that hits nothing, and replaces the map with
+		// them. intersect is as in batch_integrator::trace. The map keeps
+		// lights to tell which emitters it traces, so they must outlive it.
+		template <typename Intersect, typename Background>
+		void trace_pass(const light_list& lights, const sampler* samples, Intersect&& intersect,
+			Background&& background);
+
+		// Light arriving at p, on a surface with normal n, through glass or metal
+		color irradiance(const point3& p, const vec3& n) const;
+
+		int passes() const { return pass; }
+		size_t photon_count() const { return photons.size(); }
+
+	private:
+		aabb target, scene;
+		point3 target_center;
+		real target_radius = 0;
+		real scene_radius = 0;
+		real environment_flux = 0;
+		material_table materials;
+		const light_list* sources = nullptr;
+		int pass = 0;
+
+		std::vector<photon> photons; // sorted by cell
+		std::vector<int> cell_start; // of each slot of the grid, and one past the last
+		std::vector<int> photon_slot;
+		std::vector<photon> unsorted;
+		uint32_t slot_mask = 0;
+		real cell_size = 1;
+
+		void add_object(const hittable* object);
+		static bool specular(const material* m);
+		uint32_t slot_of(const point3& p, int dx, int dy, int dz) const;
+		void build();
+};
+
+bool photon_map::specular(const material* m) {
+	return dynamic_cast<const dielectric*>(m) || dynamic_cast<const metal*>(m);
+}
+
+void photon_map::add_object(const hittable* object) {
+	aabb bounds;
+	if (!object->bounding_box(bounds)) {
+		return;
+	}
+	scene.grow(bounds);
+
+	bool glass = true; // kept for kinds of object whose materials are unknown
+	if (auto s = dynamic_cast<const sphere*>(object)) {
+		glass = specular(s->mat_ptr.get());
+	}
+	else if (auto b = dynamic_cast<const box*>(object)) {
+		glass = specular(b->mat_ptr.get());
+	}
+	else if (auto m = dynamic_cast<const triangle_mesh*>(object)) {
+		glass = specular(m->mat_ptr.get());
+	}
+	else if (auto set = dynamic_cast<const sphere_set*>(object)) {
+		glass = std::any_of(set->materials.begin(), set->materials.end(),
+			[](const shared_ptr<material>& m) { return specular(m.get()); });
+	}
+	else if (auto set = dynamic_cast<const box_set*>(object)) {
+		glass = std::any_of(set->materials.begin(), set->materials.end(),
+			[](const shared_ptr<material>& m) { return specular(m.get()); });
+	}
+	else if (auto list = dynamic_cast<const hittable_list*>(object)) {
+		for (const auto& o : list->objects) {
+			add_object(o.get());
+		}
+		return;
+	}
+	if (glass) {
+		target.grow(bounds);
+	}
+}
+
+photon_map::photon_map(const std::vector<shared_ptr<hittable>>& objects) {
+	for (const auto& object : objects) {
+		add_object(object.get());
+	}
+	if (target.empty()) {
+		radius = 0;
+		return;
+	}
+	target_center = target.centroid();
+	target_radius = target.extent().length() / 2;
+	radius = target_radius / 50;
+	scene_radius = (scene.centroid() - target_center).length() + scene.extent().length() / 2;
+}
+
+// Cells of a grid hashed into slots (Teschner et al. 2003)
+uint32_t photon_map::slot_of(const point3& p, int dx, int dy, int dz) const {
+	uint32_t x = static_cast<uint32_t>(static_cast<int64_t>(std::floor(p.x() / cell_size)) + dx);
+	uint32_t y = static_cast<uint32_t>(static_cast<int64_t>(std::floor(p.y() / cell_size)) + dy);
+	uint32_t z = static_cast<uint32_t>(static_cast<int64_t>(std::floor(p.z() / cell_size)) + dz);
+	return ((x * 73856093u) ^ (y * 19349663u) ^ (z * 83492791u)) & slot_mask;
+}
+
+template <typename Intersect, typename Background>
+void photon_map::trace_pass(const light_list& lights, const sampler* samples, Intersect&& intersect,
+	Background&& background) {
+	if (pass > 0) {
+		radius *= sqrt((pass + alpha) / (pass + 1));
+	}
+	pass++;
+	unsorted.clear();
+	sources = &lights;
+	if (empty()) {
+		build();
+		return;
+	}
+
+	// Photons are shared among the sources by about the light each sends
+	// at the target: the background through a disk across the target, the
+	// lights through the cone it covers seen from their center
+	std::vector<real> source_cdf;
+	real total = 0;
+	for (const light_source& l : lights.lights) {
+		real distance = (l.p0 - target_center).length();
+		real solid_angle = distance > target_radius ? 1 - sqrt(1 - target_radius * target_radius / (distance * distance)) : 2;
+		total += std::max(real(0), l.power) * pi * solid_angle;
+		source_cdf.push_back(total);
+	}
+	environment_flux = 0;
+	for (int i = 0; i < 8; i++) {
+		for (int j = 0; j < 8; j++) {
+			ray r(target_center, sample_unit_vector((i + real(0.5)) / 8, (j + real(0.5)) / 8));
+			environment_flux += luminance(background(r)) / 64;
+		}
+	}
+	environment_flux *= 4 * pi * pi * target_radius * target_radius;
+	total += environment_flux;
+	source_cdf.push_back(total);
+	if (total <= 0) {
+		build();
+		return;
+	}
+
+	hit_record rec;
+	for (int i = 0; i < photons_per_pass; i++) {
+		sample_stream stream(samples, pass, 0, i);
+		stream.start_bounce();
+		real u_pick = stream.next() * total;
+		int source = static_cast<int>(std::upper_bound(source_cdf.begin(), source_cdf.end(), u_pick) - source_cdf.begin());
+		source = std::min(source, static_cast<int>(source_cdf.size()) - 1);
+		real pick = (source_cdf[source] - (source > 0 ? source_cdf[source - 1] : 0)) / total;
+		real u = stream.next(), v = stream.next();
+		real u_direction = stream.next(), v_direction = stream.next();
+
+		ray r;
+		color power;
+		if (source == static_cast<int>(lights.lights.size())) {
+			// From the background: a direction, uniform over the sphere, and
+			// a point on the disk across the target square to it, far outside
+			vec3 direction = sample_unit_vector(u_direction, v_direction);
+			ray back(target_center, -direction);
+			real x, y;
+			sample_concentric_disk(u, v, x, y);
+			vec3 tangent, bitangent;
+			tangent_frame(direction, tangent, bitangent);
+			point3 origin = target_center - scene_radius * direction
+				+ target_radius * (x * tangent + y * bitangent);
+			r = ray(origin, direction);
+			power = background(back) * (4 * pi * pi * target_radius * target_radius / (pick * photons_per_pass));
+		}
+		else {
+			// From a light: a point uniform over its area, and a direction
+			// uniform over the cone of the target seen from there
+			const light_source& l = lights.lights[source];
+			point3 p;
+			vec3 normal;
+			if (l.is_sphere) {
+				normal = sample_unit_vector(u, v);
+				p = l.p0 + l.radius * normal;
+			}
+			else {
+				real su = sqrt(u);
+				p = (1 - su) * l.p0 + (v * su) * l.p1 + ((1 - v) * su) * l.p2;
+				normal = unit_vector(cross(l.p1 - l.p0, l.p2 - l.p0));
+			}
+			vec3 to_target = target_center - p;
+			real distance = to_target.length();
+			vec3 direction;
+			real direction_pdf;
+			if (distance > target_radius) {
+				real cos_max = sqrt(1 - target_radius * target_radius / (distance * distance));
+				direction = sample_cone(to_target / distance, 1 - cos_max, u_direction, v_direction);
+				direction_pdf = 1 / (2 * pi * (1 - cos_max));
+			}
+			else {
+				direction = sample_unit_vector(u_direction, v_direction);
+				direction_pdf = 1 / (4 * pi);
+			}
+			// Spheres emit outwards, triangles from both sides
+			real cos_light = l.is_sphere ? dot(normal, direction) : std::abs(dot(normal, direction));
+			if (cos_light <= 0) {
+				continue;
+			}
+			r = ray(p, direction);
+			power = l.emitter->emitted(0, 0, p) * (cos_light * l.area / (pick * direction_pdf * photons_per_pass));
+		}
+
+		// Kept where it first lands on a diffuse surface after glass or metal
+		bool through_glass = false;
+		for (int bounce = 0; bounce < max_bounces && intersect(r, rec); bounce++) {
+			stream.start_bounce();
+			const material_entry& m = materials.entries[materials.slot(rec.mat_ptr.get())];
+			color attenuation;
+			ray scattered;
+			if (m.type == material_type::lambertian) {
+				if (through_glass) {
+					unsorted.push_back({ rec.p, rec.normal, power });
+				}
+				break;
+			}
+			if (m.type == material_type::metal) {
+				if (!metal_scatter(m.albedo, m.fuzzines, r, rec, stream, attenuation, scattered)) {
+					break;
+				}
+			}
+			else if (m.type == material_type::dielectric) {
+				dielectric_scatter(m.index_of_refraction, r, rec, stream, attenuation, scattered);
+			}
+			else {
+				break;
+			}
+			power = power * attenuation;
+			r = scattered;
+			through_glass = true;
+		}
+	}
+	build();
+}
+
+void photon_map::build() {
+	cell_size = 2 * radius;
+	uint32_t slots = 1;
+	while (slots < unsorted.size()) {
+		slots *= 2;
+	}
+	slot_mask = slots - 1;
+
+	cell_start.assign(slots + 1, 0);
+	photon_slot.resize(unsorted.size());
+	for (size_t i = 0; i < unsorted.size(); i++) {
+		photon_slot[i] = slot_of(unsorted[i].p, 0, 0, 0);
+		cell_start[photon_slot[i] + 1]++;
+	}
+	for (uint32_t s = 0; s < slots; s++) {
+		cell_start[s + 1] += cell_start[s];
+	}
+	photons.resize(unsorted.size());
+	std::vector<int> next(cell_start.begin(), cell_start.end() - 1);
+	for (size_t i = 0; i < unsorted.size(); i++) {
+		photons[next[photon_slot[i]]++] = unsorted[i];
+	}
+}
+
+color photon_map::irradiance(const point3& p, const vec3& n) const {
+	color sum(0, 0, 0);
+	if (photons.empty()) {
+		return sum;
+	}
+	// The disk fits in the 2 x 2 x 2 cells from the one of its lowest corner;
+	// cells that hash to the same slot are visited once
+	point3 corner = p - vec3(radius, radius, radius);
+	uint32_t seen[8];
+	int seen_count = 0;
+	real radius_squared = radius * radius;
+	for (int c = 0; c < 8; c++) {
+		uint32_t s = slot_of(corner, c & 1, (c >> 1) & 1, c >> 2);
+		if (std::find(seen, seen + seen_count, s) != seen + seen_count) {
+			continue;
+		}
+		seen[seen_count++] = s;
+		for (int i = cell_start[s]; i < cell_start[s + 1]; i++) {
+			const photon& ph = photons[i];
+			if ((ph.p - p).length_squared() < radius_squared && dot(ph.normal, n) > real(0.5)) {
+				sum += ph.power;
+			}
+		}
+	}
+	return sum / (pi * radius_squared);
+}
+
+#endif // !PHOTON_MAP_H
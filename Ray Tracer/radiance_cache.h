@@ -0,0 +1,443 @@
+#ifndef RADIANCE_CACHE_H
+#define RADIANCE_CACHE_H
+
+#include "box.h"
+#include "box_set.h"
+#include "bvh_cache.h"
+#include "hittable_list.h"
+#include "light_list.h"
+#include "material.h"
+#include "path_guide.h"
+#include "sampler.h"
+#include "sphere.h"
+#include "sphere_set.h"
+#include "triangle_mesh.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Bump when the file layout changes
+const uint32_t radiance_cache_version = 1;
+
+struct radiance_cache_header {
+	char magic[8];      // "RTRCACHE"
+	uint32_t version;
+	uint32_t real_size; // sizeof(real), as the sums are stored in it
+	uint64_t key;
+	uint64_t cell_count;
+	double cell_size;
+	int32_t max_level;
+	int32_t reserved[5]; // pads the header to 64 bytes
+};
+
+// Indirect irradiance at diffuse surfaces, cached in a world-space grid so
+// that paths reaching a diffuse surface after a bounce can take its bounced
+// light from the cache instead of tracing on. Cells are hashed into a fixed table by position,
+// level and the side the surface faces, with no tree to keep up to date
+// (in the spirit of Binder et al. 2019).
+//
+// Placement is driven by the error of a cell, as in an irradiance cache
+// (Ward et al. 1988): level l cells are cell_size / 2^l wide, and a cell
+// splits into the next level once its records show it is wider than
+// `accuracy` times the harmonic mean distance to the surfaces around it, so
+// corners and contact shadows get fine cells and open floors coarse ones. A
+// cell is used once it has min_records records and, since a bounce blurs
+// what it sees, when it is no wider than `footprint` times the length of the
+// ray that reached it. Gating cells on the spread of their records as well
+// would darken them: the cells that pass are the ones short of bright
+// records. Direct light changes too fast for cells of this kind and is left
+// to the light samples.
+//
+// record() and lookup() are lock free: a cell is claimed by compare and swap
+// of its key and its sums are atomic, so any number of threads may record
+// while others read. The cache holds world-space light only, so once trained
+// it can be saved and loaded to render other views of the same scene.
+class radiance_cache {
+	public:
+		real cell_size;     // of the coarsest level, in world units
+		int max_level = 10; // at most 14
+		real accuracy = real(0.5);
+		int split_records = 64; // seen by a cell before it may split
+		int min_records = 32;   // seen by a cell before it is used
+		real footprint = real(0.5);
+		// Whether paths record into the cache; while it trains they do not
+		// end in it either, so that the records stay unbiased
+		bool training = true;
+
+	public:
+		// A table of 2^capacity_log2 cells
+		explicit radiance_cache(real cell_size, int capacity_log2 = 20);
+
+		// Adds an estimate of the indirect irradiance at p, on a surface with normal n,
+		// seen by a path whose bounce from p went `distance` before it hit
+		// something (infinity if nothing)
+		void record(const point3& p, const vec3& n, const color& irradiance, real distance);
+
+		// The indirect irradiance at p from the cell there, if that cell is good enough
+		// for a hit at the end of a ray `distance` long. u and v jitter the
+		// point by up to half a cell along the surface, which turns the cell
+		// edges into noise that further samples average away.
+		bool lookup(const point3& p, const vec3& n, real distance, real u, real v, color& irradiance) const;
+
+		int cell_count() const { return used.load(std::memory_order_relaxed); }
+		// Records dropped because the part of the table they hash to was full
+		long long dropped() const { return lost.load(std::memory_order_relaxed); }
+
+		// The cells and what they recorded; load() returns false, leaving the
+		// cache alone, if the file is missing or was saved for another key
+		bool save(const std::string& path, uint64_t key) const;
+		bool load(const std::string& path, uint64_t key);
+
+	private:
+		struct cell {
+			std::atomic<uint64_t> key;
+			std::atomic<real> sum[3];
+			std::atomic<real> inverse_distance;
+			std::atomic<int> records;
+			std::atomic<int> split;
+		};
+		// A cell as it is written to a file
+		struct stored_cell {
+			uint64_t key;
+			real sum[3];
+			real inverse_distance;
+			int32_t records;
+			int32_t split;
+		};
+
+		std::vector<cell> cells;
+		uint64_t mask;
+		std::atomic<int> used;
+		std::atomic<long long> lost;
+
+		// Cells past the hashed one that are tried before giving up
+		static const int probes = 16;
+
+		static int face(const vec3& n);
+		uint64_t key_of(const point3& p, int level, int side) const;
+		static uint64_t slot_of(uint64_t key);
+		// The cell of key, claiming a free one if asked to; null if there is
+		// none and none could be claimed
+		cell* find(uint64_t key, bool claim);
+		const cell* find(uint64_t key) const;
+		void clear();
+		void add(cell& c, const color& irradiance, real inverse_distance, int level);
+};
+
+radiance_cache::radiance_cache(real cell_size, int capacity_log2)
+	: cell_size(cell_size), cells(size_t(1) << capacity_log2), mask((uint64_t(1) << capacity_log2) - 1),
+	used(0), lost(0) {
+	clear();
+}
+
+void radiance_cache::clear() {
+	for (cell& c : cells) {
+		c.key.store(0, std::memory_order_relaxed);
+		for (int k = 0; k < 3; k++) {
+			c.sum[k].store(0, std::memory_order_relaxed);
+		}
+		c.inverse_distance.store(0, std::memory_order_relaxed);
+		c.records.store(0, std::memory_order_relaxed);
+		c.split.store(0, std::memory_order_relaxed);
+	}
+	used.store(0);
+	lost.store(0);
+}
+
+// The axis the normal is closest to, with its sign: 0 to 5
+int radiance_cache::face(const vec3& n) {
+	int axis = 0;
+	for (int k = 1; k < 3; k++) {
+		if (std::abs(n[k]) > std::abs(n[axis])) {
+			axis = k;
+		}
+	}
+	return 2 * axis + (n[axis] < 0 ? 1 : 0);
+}
+
+// Level + 1 in the top 4 bits, so that no key is 0, the face in the next 3
+// and 19 bits of each coordinate, which wrap around in scenes over half a
+// million cells wide
+uint64_t radiance_cache::key_of(const point3& p, int level, int side) const {
+	real scale = std::ldexp(real(1), level) / cell_size;
+	uint64_t key = (uint64_t(level + 1) << 60) | (uint64_t(side) << 57);
+	for (int k = 0; k < 3; k++) {
+		int64_t i = static_cast<int64_t>(std::floor(p[k] * scale));
+		key |= (uint64_t(i) & 0x7ffff) << (19 * (2 - k));
+	}
+	return key;
+}
+
+// Finalizer of splitmix64
+uint64_t radiance_cache::slot_of(uint64_t key) {
+	key ^= key >> 30;
+	key *= 0xbf58476d1ce4e5b9ull;
+	key ^= key >> 27;
+	key *= 0x94d049bb133111ebull;
+	return key ^ (key >> 31);
+}
+
+radiance_cache::cell* radiance_cache::find(uint64_t key, bool claim) {
+	uint64_t slot = slot_of(key);
+	for (int i = 0; i < probes; i++) {
+		cell& c = cells[(slot + i) & mask];
+		uint64_t found = c.key.load(std::memory_order_acquire);
+		if (found == key) {
+			return &c;
+		}
+		if (found == 0) {
+			if (!claim) {
+				return nullptr;
+			}
+			// Another thread may claim it first, for this key or another
+			if (c.key.compare_exchange_strong(found, key, std::memory_order_acq_rel)) {
+				used.fetch_add(1, std::memory_order_relaxed);
+				return &c;
+			}
+			if (found == key) {
+				return &c;
+			}
+		}
+	}
+	return nullptr;
+}
+
+const radiance_cache::cell* radiance_cache::find(uint64_t key) const {
+	return const_cast<radiance_cache*>(this)->find(key, false);
+}
+
+void radiance_cache::add(cell& c, const color& irradiance, real inverse_distance, int level) {
+	for (int k = 0; k < 3; k++) {
+		atomic_add(c.sum[k], irradiance[k]);
+	}
+	atomic_add(c.inverse_distance, inverse_distance);
+	int records = c.records.fetch_add(1, std::memory_order_relaxed) + 1;
+
+	// Wider than accuracy times the harmonic mean distance: split
+	if (level < max_level && records >= split_records && !c.split.load(std::memory_order_relaxed)) {
+		real size = std::ldexp(cell_size, -level);
+		if (size * c.inverse_distance.load(std::memory_order_relaxed) > accuracy * records) {
+			c.split.store(1, std::memory_order_relaxed);
+		}
+	}
+}
+
+void radiance_cache::record(const point3& p, const vec3& n, const color& irradiance, real distance) {
+	real y = luminance(irradiance);
+	if (!(y >= 0) || !std::isfinite(y)) {
+		return;
+	}
+	int side = face(n);
+	real inverse_distance = distance > 0 ? 1 / distance : 0;
+	for (int level = 0; level <= max_level; level++) {
+		cell* c = find(key_of(p, level, side), true);
+		if (!c) {
+			lost.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		// Records that race with a split still land in the old cell, which
+		// does no harm: only the cells below are used from then on
+		if (level < max_level && c->split.load(std::memory_order_relaxed)) {
+			continue;
+		}
+		add(*c, irradiance, inverse_distance, level);
+		return;
+	}
+}
+
+bool radiance_cache::lookup(const point3& p, const vec3& n, real distance, real u, real v, color& irradiance) const {
+	int side = face(n);
+	vec3 tangent, bitangent;
+	tangent_frame(n, tangent, bitangent);
+	vec3 jitter = (u - real(0.5)) * tangent + (v - real(0.5)) * bitangent;
+	for (int level = 0; level <= max_level; level++) {
+		real size = std::ldexp(cell_size, -level);
+		const cell* c = find(key_of(p + size * jitter, level, side));
+		if (!c) {
+			return false;
+		}
+		if (level < max_level && c->split.load(std::memory_order_relaxed)) {
+			continue;
+		}
+		if (size > footprint * distance) {
+			return false;
+		}
+		int records = c->records.load(std::memory_order_relaxed);
+		if (records < min_records) {
+			return false;
+		}
+		irradiance = color(c->sum[0].load(std::memory_order_relaxed), c->sum[1].load(std::memory_order_relaxed),
+			c->sum[2].load(std::memory_order_relaxed)) / records;
+		return true;
+	}
+	return false;
+}
+
+bool radiance_cache::save(const std::string& path, uint64_t key) const {
+	std::vector<stored_cell> stored;
+	for (const cell& c : cells) {
+		uint64_t k = c.key.load(std::memory_order_relaxed);
+		if (k) {
+			stored.push_back({ k, { c.sum[0].load(), c.sum[1].load(), c.sum[2].load() },
+				c.inverse_distance.load(), c.records.load(), c.split.load() });
+		}
+	}
+
+	radiance_cache_header header = {};
+	memcpy(header.magic, "RTRCACHE", 8);
+	header.version = radiance_cache_version;
+	header.real_size = sizeof(real);
+	header.key = key;
+	header.cell_count = stored.size();
+	header.cell_size = cell_size;
+	header.max_level = max_level;
+
+	std::ofstream out(path, std::ios::out | std::ios::binary | std::ios::trunc);
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	out.write(reinterpret_cast<const char*>(stored.data()), stored.size() * sizeof(stored_cell));
+	out.close();
+	if (!out) {
+		std::remove(path.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool radiance_cache::load(const std::string& path, uint64_t key) {
+	std::ifstream in(path, std::ios::in | std::ios::binary);
+	radiance_cache_header header;
+	if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) || memcmp(header.magic, "RTRCACHE", 8) != 0
+		|| header.version != radiance_cache_version || header.real_size != sizeof(real) || header.key != key
+		|| header.cell_count > cells.size()) {
+		return false;
+	}
+	std::vector<stored_cell> stored(header.cell_count);
+	if (!in.read(reinterpret_cast<char*>(stored.data()), stored.size() * sizeof(stored_cell))) {
+		return false;
+	}
+
+	// The keys depend on the cell size, so the file's replaces this one's
+	clear();
+	cell_size = real(header.cell_size);
+	max_level = header.max_level;
+	for (const stored_cell& s : stored) {
+		cell* c = find(s.key, true);
+		if (!c) {
+			lost.fetch_add(s.records, std::memory_order_relaxed);
+			continue;
+		}
+		for (int k = 0; k < 3; k++) {
+			c->sum[k].store(s.sum[k], std::memory_order_relaxed);
+		}
+		c->inverse_distance.store(s.inverse_distance, std::memory_order_relaxed);
+		c->records.store(s.records, std::memory_order_relaxed);
+		c->split.store(s.split, std::memory_order_relaxed);
+	}
+	return true;
+}
+
+// Keys for saved caches: hashes of everything the light in a scene depends
+// on, chained onto `key`. They return false for an object or material of a
+// kind they can't describe; a cache of such a scene can't be told from one
+// of another and must not be loaded.
+bool material_key(const material* m, uint64_t& key);
+bool scene_key(const std::vector<shared_ptr<hittable>>& objects, uint64_t& key);
+
+inline uint64_t hash_vec3(const vec3& v, uint64_t hash) {
+	for (int k = 0; k < 3; k++) {
+		hash = hash_value(v[k], hash);
+	}
+	return hash;
+}
+
+bool material_key(const material* m, uint64_t& key) {
+	if (!m) {
+		key = hash_value(0, key);
+		return true;
+	}
+	if (auto l = dynamic_cast<const lambertian*>(m)) {
+		key = hash_vec3(l->albedo, hash_value(1, key));
+	}
+	else if (auto mt = dynamic_cast<const metal*>(m)) {
+		key = hash_value(mt->fuzzines, hash_vec3(mt->albedo, hash_value(2, key)));
+	}
+	else if (auto d = dynamic_cast<const dielectric*>(m)) {
+		key = hash_value(d->index_of_refraction, hash_value(3, key));
+	}
+	else if (auto e = dynamic_cast<const diffuse_light*>(m)) {
+		// Textures other than a solid color vary over the surface
+		if (!dynamic_cast<const solid_color*>(e->emit.get())) {
+			return false;
+		}
+		key = hash_vec3(e->emitted(0, 0, point3()), hash_value(4, key));
+	}
+	else {
+		return false;
+	}
+	return true;
+}
+
+bool scene_key(const std::vector<shared_ptr<hittable>>& objects, uint64_t& key) {
+	key = hash_value(objects.size(), key);
+	for (const auto& object : objects) {
+		const hittable* o = object.get();
+		if (auto s = dynamic_cast<const sphere*>(o)) {
+			key = hash_value(s->radius, hash_vec3(s->center, hash_value(1, key)));
+			if (!material_key(s->mat_ptr.get(), key)) {
+				return false;
+			}
+		}
+		else if (auto b = dynamic_cast<const box*>(o)) {
+			key = hash_vec3(b->bounds.maximum, hash_vec3(b->bounds.minimum, hash_value(2, key)));
+			if (!material_key(b->mat_ptr.get(), key)) {
+				return false;
+			}
+		}
+		else if (auto m = dynamic_cast<const triangle_mesh*>(o)) {
+			key = hash_value(m->vertices.size(), hash_value(3, key));
+			for (const point3& v : m->vertices) {
+				key = hash_vec3(v, key);
+			}
+			key = hash_bytes(m->triangles.data(), m->triangles.size() * sizeof(Triangle), key);
+			if (!material_key(m->mat_ptr.get(), key)) {
+				return false;
+			}
+		}
+		else if (auto set = dynamic_cast<const sphere_set*>(o)) {
+			key = hash_value(set->size(), hash_value(4, key));
+			for (int i = 0; i < set->size(); i++) {
+				key = hash_value(set->radius[i], hash_vec3(point3(set->center_x[i], set->center_y[i], set->center_z[i]), key));
+				if (!material_key(set->materials[set->material_index[i]].get(), key)) {
+					return false;
+				}
+			}
+		}
+		else if (auto set = dynamic_cast<const box_set*>(o)) {
+			key = hash_value(set->size(), hash_value(5, key));
+			for (int i = 0; i < set->size(); i++) {
+				key = hash_vec3(point3(set->min_x[i], set->min_y[i], set->min_z[i]), key);
+				key = hash_vec3(point3(set->max_x[i], set->max_y[i], set->max_z[i]), key);
+				if (!material_key(set->materials[set->material_index[i]].get(), key)) {
+					return false;
+				}
+			}
+		}
+		else if (auto list = dynamic_cast<const hittable_list*>(o)) {
+			key = hash_value(6, key);
+			if (!scene_key(list->objects, key)) {
+				return false;
+			}
+		}
+		else {
+			return false;
+		}
+	}
+	return true;
+}
+
+#endif // !RADIANCE_CACHE_H
@@ -3,29 +3,31 @@
 
 #include "vec3.h"
 
-class ray {
+template <typename T>
+class ray_t {
 	public:
-		point3 orig;
-		vec3 dir;
+		vec3_t<T> orig;
+		vec3_t<T> dir;
 
 	public:
-		ray() {};
-		ray(const point3& origin, const vec3& direction)
+		ray_t() {};
+		ray_t(const vec3_t<T>& origin, const vec3_t<T>& direction)
 			: orig(origin), dir(direction) {}
 
-		point3 origin() {
+		vec3_t<T> origin() {
 			return orig;
 		}
 
-		vec3 direction() {
+		vec3_t<T> direction() {
 			return dir;
 		}
 
-		point3 at(double t) const{
+		vec3_t<T> at(T t) const{
 			return orig + t * dir;
 		}
-		
+
 };
 
-#endif
+using ray = ray_t<real>;
 
+#endif
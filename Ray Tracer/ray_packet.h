@@ -0,0 +1,43 @@
+#ifndef RAY_PACKET_H
+#define RAY_PACKET_H
+
+#include "ray.h"
+
+// N rays in structure of arrays, traced together through the same nodes.
+// Rays are switched on and off with a bit mask, bit i for ray i. Each ray
+// has its own [t_min, t_max], and t_max shrinks to the closest hit found.
+template <int N>
+struct ray_packet {
+	static constexpr int size = N;
+
+	real ox[N], oy[N], oz[N];
+	real dx[N], dy[N], dz[N];
+	real t_min[N], t_max[N];
+
+	static int all() { return (1 << N) - 1; }
+
+	void set(int i, const ray& r) {
+		ox[i] = r.orig.x();
+		oy[i] = r.orig.y();
+		oz[i] = r.orig.z();
+		dx[i] = r.dir.x();
+		dy[i] = r.dir.y();
+		dz[i] = r.dir.z();
+	}
+
+	ray get(int i) const {
+		return ray(point3(ox[i], oy[i], oz[i]), vec3(dx[i], dy[i], dz[i]));
+	}
+
+	void set_range(real min, real max) {
+		for (int i = 0; i < N; i++) {
+			t_min[i] = min;
+			t_max[i] = max;
+		}
+	}
+};
+
+using ray4 = ray_packet<4>;
+using ray8 = ray_packet<8>;
+
+#endif // !RAY_PACKET_H
@@ -0,0 +1,293 @@
+#ifndef RESTIR_H
+#define RESTIR_H
+
+#include "camera.h"
+#include "hittable.h"
+#include "light_list.h"
+#include "material_table.h"
+#include "sampler.h"
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+using std::shared_ptr;
+
+// A point on a light, as held by a reservoir
+struct light_point {
+	point3 p;
+	vec3 normal;
+	color emission;
+};
+
+// Weighted reservoir sampling: candidates stream through and one is kept,
+// each with probability proportional to its weight
+struct reservoir {
+	light_point y;
+	real weight_sum = 0;
+	real count = 0; // candidates seen
+	real contribution_weight = 0; // W, used in place of 1 / pdf of y
+
+	// Keeps x instead of y with probability weight / weight_sum
+	void add(const light_point& x, real weight, real u) {
+		weight_sum += weight;
+		count += 1;
+		if (u * weight_sum < weight) {
+			y = x;
+		}
+	}
+};
+
+// The surface seen through a pixel, where its reservoir is resampled
+struct restir_surface {
+	point3 p;
+	vec3 normal;
+	color albedo;
+	real distance; // from the camera
+	bool diffuse; // false for the background and other materials, which get no light
+};
+
+// Direct light for previews and animations at one sample per pixel, by
+// reservoir-based resampling (ReSTIR, Bitterli et al. 2020). Each pixel
+// draws `candidates` samples from the light_list and keeps one in proportion
+// to the unshadowed light it brings. Then a pixel merges its reservoir with
+// the one of the previous frame at the same point (temporal reuse) and with
+// a few neighbours' (spatial reuse), so that its sample is chosen from
+// hundreds at the cost of one shadow ray.
+//
+// Reuse is limited to neighbours on a similar surface, and a merged sample
+// is normalized by all the candidates that went in, as in the biased variant
+// of the paper. That darkens where lights seen by neighbours are hidden from
+// the pixel, most in scenes with many small occluders. Only diffuse surfaces
+// seen from the camera are lit; glass, metal and bounced light are left to
+// the path tracer.
+class restir_di {
+	public:
+		int candidates = 8;
+		bool temporal_reuse = true;
+		// Weight of the previous frame, in frames: its candidate count is capped
+		// at this many times the count of the current one
+		int temporal_history = 20;
+		int spatial_passes = 1;
+		int spatial_neighbours = 5;
+		real spatial_radius = 20; // pixels
+
+	public:
+		restir_di(int width, int height) : width(width), height(height) {}
+
+		// Renders frame `frame` into image, pixel (i, j) at j * width + i with
+		// rows from the bottom, as camera (i / (width - 1), j / (height - 1)).
+		// intersect and background are as in batch_integrator::trace.
+		template <typename Intersect, typename Background>
+		void render(const camera& cam, const light_list& lights, const sampler* samples, int frame,
+			Intersect&& intersect, Background&& background, std::vector<color>& image);
+
+	private:
+		int width, height;
+		material_table materials;
+		std::vector<restir_surface> surfaces, last_surfaces;
+		std::vector<reservoir> reservoirs, last_reservoirs, spatial;
+		std::vector<sample_stream> streams;
+		shared_ptr<camera> last_camera;
+
+		// Unshadowed light of y at s, per unit area of the light
+		real target(const restir_surface& s, const light_point& y) const;
+		// Adds the sample of r, resampled for s or another pixel, as one
+		// candidate for s that stands for all of r's
+		void merge(reservoir& into, const reservoir& r, const restir_surface& s, real u) const;
+		// Sets W of r once all candidates are in
+		void finish(reservoir& r, const restir_surface& s) const;
+		// Whether two pixels see about the same surface
+		static bool similar(const restir_surface& a, const restir_surface& b, real distance_b);
+
+		template <typename Intersect>
+		bool visible(const restir_surface& s, const light_point& y, Intersect&& intersect) const;
+};
+
+real restir_di::target(const restir_surface& s, const light_point& y) const {
+	vec3 to_light = y.p - s.p;
+	real distance_squared = to_light.length_squared();
+	if (distance_squared <= 0) {
+		return 0;
+	}
+	vec3 direction = to_light / sqrt(distance_squared);
+	real cos_surface = dot(s.normal, direction);
+	if (cos_surface <= 0) {
+		return 0;
+	}
+	real cos_light = std::abs(dot(y.normal, direction));
+	return luminance(s.albedo * y.emission) / pi * cos_surface * cos_light / distance_squared;
+}
+
+void restir_di::merge(reservoir& into, const reservoir& r, const restir_surface& s, real u) const {
+	real count = into.count + r.count;
+	into.add(r.y, target(s, r.y) * r.contribution_weight * r.count, u);
+	into.count = count;
+}
+
+void restir_di::finish(reservoir& r, const restir_surface& s) const {
+	real p = target(s, r.y);
+	r.contribution_weight = p > 0 && r.count > 0 ? r.weight_sum / (r.count * p) : 0;
+}
+
+bool restir_di::similar(const restir_surface& a, const restir_surface& b, real distance_b) {
+	return a.diffuse && dot(a.normal, b.normal) > real(0.9)
+		&& std::abs(a.distance - distance_b) < real(0.1) * distance_b;
+}
+
+template <typename Intersect>
+bool restir_di::visible(const restir_surface& s, const light_point& y, Intersect&& intersect) const {
+	vec3 to_light = y.p - s.p;
+	real distance = to_light.length();
+	ray shadow(s.p, to_light / distance);
+	hit_record blocker;
+	return !(intersect(shadow, blocker) && blocker.t < distance * (1 - real(1e-3)));
+}
+
+template <typename Intersect, typename Background>
+void restir_di::render(const camera& cam, const light_list& lights, const sampler* samples, int frame,
+	Intersect&& intersect, Background&& background, std::vector<color>& image) {
+	int n = width * height;
+	image.assign(n, color(0, 0, 0));
+	surfaces.resize(n);
+	reservoirs.assign(n, reservoir());
+	streams.clear();
+
+	// What each pixel sees, and its own candidates
+	hit_record rec;
+	for (int j = 0; j < height; j++) {
+		for (int i = 0; i < width; i++) {
+			int pixel = j * width + i;
+			streams.push_back(sample_stream(samples, i, j, frame));
+			sample_stream& stream = streams.back();
+			restir_surface& s = surfaces[pixel];
+			s.diffuse = false;
+
+			ray r = cam.get_ray((i + stream.next()) / (width - 1), (j + stream.next()) / (height - 1));
+			r.dir = unit_vector(r.dir);
+			if (!intersect(r, rec)) {
+				image[pixel] = background(r);
+				continue;
+			}
+			const material_entry& m = materials.entries[materials.slot(rec.mat_ptr.get())];
+			if (m.emissive) {
+				image[pixel] = m.source->emitted(0, 0, rec.p);
+			}
+			if (m.type != material_type::lambertian) {
+				continue;
+			}
+			s.p = rec.p;
+			s.normal = rec.normal;
+			s.albedo = m.albedo;
+			s.distance = rec.t;
+			s.diffuse = true;
+
+			reservoir& res = reservoirs[pixel];
+			for (int c = 0; c < candidates; c++) {
+				real u_pick = stream.next(), u = stream.next(), v = stream.next();
+				real u_keep = stream.next();
+				light_sample ls;
+				if (!lights.sample(s.p, s.normal, u_pick, u, v, ls)) {
+					res.count += 1;
+					continue;
+				}
+				light_point x = { ls.p, ls.normal, ls.emission };
+				// pdf of the point per unit area of the light, as target
+				vec3 to_light = ls.p - s.p;
+				real distance_squared = to_light.length_squared();
+				real cos_light = std::abs(dot(ls.normal, to_light)) / sqrt(distance_squared);
+				real area_pdf = ls.pdf * cos_light / distance_squared;
+				res.add(x, area_pdf > 0 ? target(s, x) / area_pdf : 0, u_keep);
+			}
+			finish(res, s);
+			// A sample that is shadowed is dropped before it spreads to others
+			if (res.contribution_weight > 0 && !visible(s, res.y, intersect)) {
+				res.contribution_weight = 0;
+			}
+		}
+	}
+
+	// Temporal reuse: the reservoir of the last frame at the same point
+	if (temporal_reuse && last_camera) {
+		for (int pixel = 0; pixel < n; pixel++) {
+			const restir_surface& s = surfaces[pixel];
+			real ls, lt;
+			if (!s.diffuse || !last_camera->project(s.p, ls, lt)) {
+				continue;
+			}
+			int li = static_cast<int>(ls * (width - 1) + real(0.5));
+			int lj = static_cast<int>(lt * (height - 1) + real(0.5));
+			if (ls < 0 || lt < 0 || li >= width || lj >= height) {
+				continue;
+			}
+			int last = lj * width + li;
+			real distance = (s.p - last_camera->position()).length();
+			if (!similar(last_surfaces[last], s, distance)) {
+				continue;
+			}
+			reservoir previous = last_reservoirs[last];
+			previous.count = std::min(previous.count, temporal_history * reservoirs[pixel].count);
+			reservoir combined;
+			merge(combined, reservoirs[pixel], s, 0);
+			merge(combined, previous, s, streams[pixel].next());
+			finish(combined, s);
+			reservoirs[pixel] = combined;
+		}
+	}
+
+	// Spatial reuse: a few random neighbours within spatial_radius pixels
+	spatial.resize(n);
+	for (int pass = 0; pass < spatial_passes; pass++) {
+		for (int j = 0; j < height; j++) {
+			for (int i = 0; i < width; i++) {
+				int pixel = j * width + i;
+				const restir_surface& s = surfaces[pixel];
+				spatial[pixel] = reservoirs[pixel];
+				if (!s.diffuse) {
+					continue;
+				}
+				reservoir combined;
+				merge(combined, reservoirs[pixel], s, 0);
+				sample_stream& stream = streams[pixel];
+				for (int k = 0; k < spatial_neighbours; k++) {
+					real radius = spatial_radius * sqrt(stream.next());
+					real angle = 2 * pi * stream.next();
+					real u_keep = stream.next();
+					int ni = i + static_cast<int>(std::round(radius * cos(angle)));
+					int nj = j + static_cast<int>(std::round(radius * sin(angle)));
+					if (ni < 0 || nj < 0 || ni >= width || nj >= height || (ni == i && nj == j)) {
+						continue;
+					}
+					int neighbour = nj * width + ni;
+					if (!similar(surfaces[neighbour], s, s.distance)) {
+						continue;
+					}
+					merge(combined, reservoirs[neighbour], s, u_keep);
+				}
+				finish(combined, s);
+				spatial[pixel] = combined;
+			}
+		}
+		reservoirs.swap(spatial);
+	}
+
+	// One shadow ray per pixel, for the sample it ended up with
+	for (int pixel = 0; pixel < n; pixel++) {
+		const restir_surface& s = surfaces[pixel];
+		const reservoir& r = reservoirs[pixel];
+		if (!s.diffuse || r.contribution_weight <= 0 || !visible(s, r.y, intersect)) {
+			continue;
+		}
+		vec3 to_light = r.y.p - s.p;
+		real distance_squared = to_light.length_squared();
+		vec3 direction = to_light / sqrt(distance_squared);
+		real geometry = dot(s.normal, direction) * std::abs(dot(r.y.normal, direction)) / distance_squared;
+		image[pixel] += s.albedo / pi * r.y.emission * (geometry * r.contribution_weight);
+	}
+
+	last_surfaces.swap(surfaces);
+	last_reservoirs.swap(reservoirs);
+	last_camera = make_shared<camera>(cam);
+}
+
+#endif // !RESTIR_H
@@ -0,0 +1,527 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "utility_functions.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// Samplers for the random numbers of a path. A sampler gives dimension d of
+// sample i of pixel (x, y), so every path can draw its numbers independently
+// of the others, in any order. The dimensions of a path are laid out in
+// blocks: the position in the pixel first, then a fixed block per bounce, so
+// a dimension always means the same thing whatever happened before.
+const int camera_dimensions = 2;
+const int bounce_dimensions = 10; // even, so that pairs stay in one block
+// Fixed places within the block of a bounce; the material takes its
+// numbers from the start of the block
+const int light_pick_dimension = 3;
+const int light_point_dimension = 4; // and the one after
+const int cache_jitter_dimension = 6; // and the one after
+const int roulette_dimension = bounce_dimensions - 1;
+
+// Samplers to render with.
+//  random     - independent uniform numbers, converges slowest
+//  stratified - correlated multi-jittered pairs of dimensions, best at a
+//               samples_per_pixel fixed in advance
+//  halton     - randomly shifted Halton sequence
+//  sobol      - Owen-scrambled Sobol sequence, any sample count
+//  blue_noise - one Sobol sequence for all pixels, shifted by a blue-noise
+//               mask so that the error left at low counts looks like fine grain
+enum class sampler_type { random, stratified, halton, sobol, blue_noise };
+
+inline const char* sampler_name(sampler_type type) {
+	switch (type) {
+		case sampler_type::stratified: return "stratified";
+		case sampler_type::halton: return "halton";
+		case sampler_type::sobol: return "sobol";
+		case sampler_type::blue_noise: return "blue noise";
+		default: return "random";
+	}
+}
+
+// Integer hashes and the numbers in [0, 1) made from them
+inline uint32_t hash_uint(uint32_t x) {
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
+}
+
+inline uint32_t hash_combine(uint32_t seed, uint32_t v) {
+	return hash_uint(seed ^ (v + 0x9e3779b9u + (seed << 6) + (seed >> 2)));
+}
+
+inline real uint_to_unit(uint32_t x) {
+	// The top bits only, so that floats can't round up to 1
+	const int bits = std::numeric_limits<real>::digits < 32 ? std::numeric_limits<real>::digits : 32;
+	return real(x >> (32 - bits)) * real(1.0 / double(1ull << bits));
+}
+
+class sampler {
+	public:
+		virtual ~sampler() {}
+
+		// Dimension `dimension` of sample `index` of pixel (x, y), in [0, 1)
+		virtual real sample(int x, int y, int index, int dimension) const = 0;
+};
+
+// Hands out the dimensions of one sample in order
+class sample_stream {
+	public:
+		sample_stream() {}
+		sample_stream(const sampler* source, int x, int y, int index)
+			: source(source), x(x), y(y), index(index) {}
+
+		// Moves to the block of dimensions of the next bounce, the first call
+		// to that of the camera ray's hit
+		void start_bounce() {
+			block = camera_dimensions + bounce++ * bounce_dimensions;
+			dimension = block;
+		}
+
+		// Without a sampler the numbers come from random_double
+		real next() {
+			return source ? source->sample(x, y, index, dimension++) : real(random_double());
+		}
+
+		// Dimension `offset` of the block of the current bounce
+		real bounce_sample(int offset) const {
+			return source ? source->sample(x, y, index, block + offset) : real(random_double());
+		}
+
+	private:
+		const sampler* source = nullptr;
+		int x = 0, y = 0;
+		int index = 0;
+		int dimension = 0;
+		int bounce = 0;
+		int block = 0; // first dimension of the current bounce
+};
+
+class random_sampler : public sampler {
+	public:
+		virtual real sample(int x, int y, int index, int dimension) const override {
+			return real(random_double());
+		}
+};
+
+// Correlated multi-jittered sampling (Kensler 2013). Dimensions 2k and
+// 2k + 1 form a jittered pattern of samples_per_pixel points that is also
+// stratified along each axis; every pixel and pair gets its own shuffle.
+// Samples past samples_per_pixel start another pattern.
+class stratified_sampler : public sampler {
+	public:
+		stratified_sampler(int samples_per_pixel);
+
+		virtual real sample(int x, int y, int index, int dimension) const override;
+
+	private:
+		int count, columns, rows;
+
+		// Element i of a random permutation of [0, l), picked by p
+		static uint32_t permute(uint32_t i, uint32_t l, uint32_t p);
+		static real randfloat(uint32_t i, uint32_t p);
+};
+
+stratified_sampler::stratified_sampler(int samples_per_pixel) {
+	count = std::max(samples_per_pixel, 1);
+	columns = std::max(static_cast<int>(sqrt(double(count))), 1);
+	rows = (count + columns - 1) / columns;
+}
+
+uint32_t stratified_sampler::permute(uint32_t i, uint32_t l, uint32_t p) {
+	uint32_t w = l - 1;
+	w |= w >> 1;
+	w |= w >> 2;
+	w |= w >> 4;
+	w |= w >> 8;
+	w |= w >> 16;
+	do {
+		i ^= p;
+		i *= 0xe170893du;
+		i ^= p >> 16;
+		i ^= (i & w) >> 4;
+		i ^= p >> 8;
+		i *= 0x0929eb3fu;
+		i ^= p >> 23;
+		i ^= (i & w) >> 1;
+		i *= 1 | p >> 27;
+		i *= 0x6935fa69u;
+		i ^= (i & w) >> 11;
+		i *= 0x74dcb303u;
+		i ^= (i & w) >> 2;
+		i *= 0x9e501cc3u;
+		i ^= (i & w) >> 2;
+		i *= 0xc860a3dfu;
+		i &= w;
+		i ^= i >> 5;
+	} while (i >= l);
+	return (i + p) % l;
+}
+
+real stratified_sampler::randfloat(uint32_t i, uint32_t p) {
+	return uint_to_unit(hash_combine(p, i));
+}
+
+real stratified_sampler::sample(int x, int y, int index, int dimension) const {
+	uint32_t pattern = hash_combine(hash_combine(hash_combine(uint32_t(x), uint32_t(y)),
+		uint32_t(dimension / 2)), uint32_t(index / count));
+	uint32_t s = permute(uint32_t(index % count), uint32_t(count), pattern * 0x51633e2du);
+	uint32_t column = s % columns, row = s / columns;
+
+	if (dimension % 2 == 0) {
+		uint32_t sub_row = permute(row, rows, pattern * 0x68bc21ebu);
+		real jitter = randfloat(s, pattern * 0x967a889bu);
+		return std::min((column + (sub_row + jitter) / rows) / columns, real(1) - std::numeric_limits<real>::epsilon());
+	}
+	uint32_t sub_column = permute(column, columns, pattern * 0x02e5be93u);
+	real jitter = randfloat(s, pattern * 0x368cc8b7u);
+	return std::min((row + (sub_column + jitter) / columns) / rows, real(1) - std::numeric_limits<real>::epsilon());
+}
+
+// Halton sequence, dimension d in base of the d-th prime, with a random
+// shift per pixel and dimension (Cranley-Patterson rotation). Dimensions
+// past the table of primes fall back to hashed random numbers.
+class halton_sampler : public sampler {
+	public:
+		virtual real sample(int x, int y, int index, int dimension) const override;
+
+	private:
+		static const int prime_count = 32;
+		static const int primes[prime_count];
+
+		static double radical_inverse(uint32_t base, uint64_t index);
+};
+
+const int halton_sampler::primes[halton_sampler::prime_count] = {
+	2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+	59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131
+};
+
+double halton_sampler::radical_inverse(uint32_t base, uint64_t index) {
+	double inv_base = 1.0 / base, scale = inv_base, result = 0;
+	while (index > 0) {
+		result += (index % base) * scale;
+		index /= base;
+		scale *= inv_base;
+	}
+	return result;
+}
+
+real halton_sampler::sample(int x, int y, int index, int dimension) const {
+	uint32_t seed = hash_combine(hash_combine(uint32_t(x), uint32_t(y)), uint32_t(dimension));
+	if (dimension >= prime_count) {
+		return uint_to_unit(hash_combine(seed, uint32_t(index)));
+	}
+	double v = radical_inverse(primes[dimension], uint64_t(index)) + double(uint_to_unit(seed));
+	v -= v >= 1 ? 1 : 0;
+	return std::min(real(v), real(1) - std::numeric_limits<real>::epsilon());
+}
+
+// Sobol sequence with hashed Owen scrambling (Burley 2020, "Practical
+// hash-based Owen scrambling"). Dimensions come in groups of four Sobol
+// dimensions, each group with its own scrambled order of the samples, so
+// that groups are independent of each other while the four dimensions of a
+// group stay stratified together.
+class sobol_sampler : public sampler {
+	public:
+		sobol_sampler();
+
+		virtual real sample(int x, int y, int index, int dimension) const override;
+
+		// The sequence scrambled by seed, as 32 bit fractions
+		uint32_t sample_bits(uint32_t seed, uint32_t index, int dimension) const;
+
+	private:
+		// Sobol values of each byte of the index, for each byte position:
+		// the value of an index is the xor of those of its four bytes
+		uint32_t byte_values[4][4][256];
+
+		static uint32_t reverse_bits(uint32_t x);
+		static uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed);
+};
+
+sobol_sampler::sobol_sampler() {
+	// Dimension 0 is the van der Corput sequence; 1 to 3 use the primitive
+	// polynomials and initial direction numbers of Joe and Kuo
+	const int degree[4] = { 0, 1, 2, 3 };
+	const uint32_t coefficients[4] = { 0, 0, 1, 1 };
+	const uint32_t initial[4][3] = { { 0, 0, 0 }, { 1, 0, 0 }, { 1, 3, 0 }, { 1, 3, 1 } };
+
+	uint32_t directions[4][32];
+	for (int k = 0; k < 32; k++) {
+		directions[0][k] = 1u << (31 - k);
+	}
+	for (int d = 1; d < 4; d++) {
+		int s = degree[d];
+		uint32_t* v = directions[d];
+		for (int k = 0; k < s; k++) {
+			v[k] = initial[d][k] << (31 - k);
+		}
+		for (int k = s; k < 32; k++) {
+			v[k] = v[k - s] ^ (v[k - s] >> s);
+			for (int l = 1; l < s; l++) {
+				if ((coefficients[d] >> (s - 1 - l)) & 1) {
+					v[k] ^= v[k - l];
+				}
+			}
+		}
+	}
+
+	for (int d = 0; d < 4; d++) {
+		for (int position = 0; position < 4; position++) {
+			for (int byte = 0; byte < 256; byte++) {
+				uint32_t v = 0;
+				for (int bit = 0; bit < 8; bit++) {
+					if (byte & (1 << bit)) {
+						v ^= directions[d][position * 8 + bit];
+					}
+				}
+				byte_values[d][position][byte] = v;
+			}
+		}
+	}
+}
+
+uint32_t sobol_sampler::reverse_bits(uint32_t x) {
+	x = (x << 16) | (x >> 16);
+	x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+	x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+	x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+	x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+	return x;
+}
+
+// Owen scrambling of the bits of x, each bit flipped by a hash of the bits
+// above it (Laine-Karras permutation on the reversed bits)
+uint32_t sobol_sampler::nested_uniform_scramble(uint32_t x, uint32_t seed) {
+	x = reverse_bits(x);
+	x ^= x * 0x3d20adeau;
+	x += seed;
+	x *= (seed >> 16) | 1;
+	x ^= x * 0x05526c56u;
+	x ^= x * 0x53a22864u;
+	return reverse_bits(x);
+}
+
+uint32_t sobol_sampler::sample_bits(uint32_t seed, uint32_t index, int dimension) const {
+	uint32_t group = uint32_t(dimension / 4);
+	uint32_t i = nested_uniform_scramble(index, hash_combine(seed, group));
+
+	const uint32_t (*values)[256] = byte_values[dimension % 4];
+	uint32_t v = values[0][i & 0xff] ^ values[1][(i >> 8) & 0xff]
+		^ values[2][(i >> 16) & 0xff] ^ values[3][i >> 24];
+	return nested_uniform_scramble(v, hash_combine(seed, uint32_t(dimension) + 0x6a09e667u));
+}
+
+real sobol_sampler::sample(int x, int y, int index, int dimension) const {
+	return uint_to_unit(sample_bits(hash_combine(uint32_t(x), uint32_t(y)), uint32_t(index), dimension));
+}
+
+// Blue-noise dithered sampling (Georgiev and Fajardo 2016): all pixels
+// trace the same scrambled Sobol sequence, shifted (modulo 1) by a tiled
+// blue-noise mask. Neighbouring pixels then get shifts far apart, which
+// leaves the error at low sample counts without low frequencies. Each
+// dimension reads the mask at its own offset.
+class blue_noise_sampler : public sampler {
+	public:
+		static const int mask_size = 64;
+
+		blue_noise_sampler();
+
+		virtual real sample(int x, int y, int index, int dimension) const override;
+
+		real mask_value(int x, int y) const {
+			return mask[(y & (mask_size - 1)) * mask_size + (x & (mask_size - 1))];
+		}
+
+	private:
+		sobol_sampler sequence;
+		std::vector<real> mask;
+
+		// Ranks the pixels of the mask by void and cluster (Ulichney 1993)
+		void build_mask();
+};
+
+blue_noise_sampler::blue_noise_sampler() {
+	build_mask();
+}
+
+void blue_noise_sampler::build_mask() {
+	const int n = mask_size * mask_size;
+	const double sigma = 1.5;
+
+	// Gaussian energy of a point, by toroidal offset
+	std::vector<double> kernel(n);
+	for (int dy = 0; dy < mask_size; dy++) {
+		for (int dx = 0; dx < mask_size; dx++) {
+			int wx = std::min(dx, mask_size - dx), wy = std::min(dy, mask_size - dy);
+			kernel[dy * mask_size + dx] = exp(-(wx * wx + wy * wy) / (2 * sigma * sigma));
+		}
+	}
+
+	std::vector<char> on(n, 0);
+	std::vector<double> energy(n, 0);
+	auto splat = [&](int p, double sign) {
+		int px = p % mask_size, py = p / mask_size;
+		for (int y = 0; y < mask_size; y++) {
+			const double* row = &kernel[((y - py + mask_size) & (mask_size - 1)) * mask_size];
+			for (int x = 0; x < mask_size; x++) {
+				energy[y * mask_size + x] += sign * row[(x - px + mask_size) & (mask_size - 1)];
+			}
+		}
+	};
+	// Tightest cluster among the points that are on, largest void among the off ones
+	auto extreme = [&](bool want_on) {
+		int best = -1;
+		for (int p = 0; p < n; p++) {
+			if (on[p] == want_on && (best < 0 || (want_on ? energy[p] > energy[best] : energy[p] < energy[best]))) {
+				best = p;
+			}
+		}
+		return best;
+	};
+
+	// Initial pattern: a tenth of the pixels at random, then moved from
+	// clusters into voids until that changes nothing
+	int initial = n / 10;
+	uint32_t state = 0x1b873593u;
+	for (int placed = 0; placed < initial;) {
+		state = hash_uint(state);
+		int p = int(state % n);
+		if (!on[p]) {
+			on[p] = 1;
+			splat(p, 1);
+			placed++;
+		}
+	}
+	while (true) {
+		int cluster = extreme(true);
+		on[cluster] = 0;
+		splat(cluster, -1);
+		int gap = extreme(false);
+		on[gap] = 1;
+		splat(gap, 1);
+		if (gap == cluster) {
+			break;
+		}
+	}
+
+	std::vector<int> rank(n, 0);
+	std::vector<char> prototype = on;
+	std::vector<double> prototype_energy = energy;
+
+	// The initial points are ranked by taking away the tightest cluster first
+	for (int r = initial - 1; r >= 0; r--) {
+		int cluster = extreme(true);
+		on[cluster] = 0;
+		splat(cluster, -1);
+		rank[cluster] = r;
+	}
+
+	// The rest by filling the largest void first
+	on = prototype;
+	energy = prototype_energy;
+	for (int r = initial; r < n; r++) {
+		int gap = extreme(false);
+		on[gap] = 1;
+		splat(gap, 1);
+		rank[gap] = r;
+	}
+
+	mask.resize(n);
+	for (int p = 0; p < n; p++) {
+		mask[p] = (rank[p] + real(0.5)) / n;
+	}
+}
+
+real blue_noise_sampler::sample(int x, int y, int index, int dimension) const {
+	uint32_t offset = hash_uint(uint32_t(dimension) + 0x85ebca6bu);
+	real shift = mask_value(x + int(offset & 0xffff), y + int(offset >> 16));
+	real v = uint_to_unit(sequence.sample_bits(0x2545f491u, uint32_t(index), dimension)) + shift;
+	v -= v >= 1 ? 1 : 0;
+	return std::min(v, real(1) - std::numeric_limits<real>::epsilon());
+}
+
+inline shared_ptr<sampler> make_sampler(sampler_type type, int samples_per_pixel) {
+	switch (type) {
+		case sampler_type::stratified: return make_shared<stratified_sampler>(samples_per_pixel);
+		case sampler_type::halton: return make_shared<halton_sampler>();
+		case sampler_type::sobol: return make_shared<sobol_sampler>();
+		case sampler_type::blue_noise: return make_shared<blue_noise_sampler>();
+		default: return make_shared<random_sampler>();
+	}
+}
+
+// Directions from the numbers of a sampler, in closed form so that every
+// direction takes a fixed number of dimensions.
+
+// Uniform on the unit disk, by Shirley and Chiu's concentric map: squares
+// around the center go to rings, so numbers that are well spread over the
+// square stay well spread over the disk, and the angle is never more than a
+// quarter of pi
+inline void sample_concentric_disk(real u, real v, real& x, real& y) {
+	real a = 2 * u - 1;
+	real b = 2 * v - 1;
+	// Radius from the larger coordinate, angle from the ratio of the two
+	bool a_larger = std::abs(a) > std::abs(b);
+	real r = a_larger ? a : b;
+	real phi = r != 0 ? pi / 4 * (a_larger ? b : a) / r : 0;
+	real c = cos(phi);
+	real s = sin(phi);
+	x = r * (a_larger ? c : s);
+	y = r * (a_larger ? s : c);
+}
+
+// Two tangents of the unit vector axis (Duff et al., with no special case
+// near the poles)
+inline void tangent_frame(const vec3& axis, vec3& tangent, vec3& bitangent) {
+	real sign = axis.z() >= 0 ? real(1) : real(-1);
+	real a = -1 / (sign + axis.z());
+	real b = axis.x() * axis.y() * a;
+	tangent = vec3(1 + sign * axis.x() * axis.x() * a, sign * b, -sign * axis.x());
+	bitangent = vec3(b, sign + axis.y() * axis.y() * a, -axis.y());
+}
+
+// Uniform on the unit sphere: the concentric disk lifted by Lambert's
+// equal-area projection
+inline vec3 sample_unit_vector(real u, real v) {
+	real x, y;
+	sample_concentric_disk(u, v, x, y);
+	real r_squared = x * x + y * y;
+	real scale = 2 * sqrt(std::max(real(0), 1 - r_squared));
+	return vec3(x * scale, y * scale, 1 - 2 * r_squared);
+}
+
+// Cosine weighted over the hemisphere around the unit vector normal, with
+// pdf cos / pi: the concentric disk lifted straight up (Malley's method)
+inline vec3 sample_cosine_hemisphere(const vec3& normal, real u, real v) {
+	real x, y;
+	sample_concentric_disk(u, v, x, y);
+	real z = sqrt(std::max(real(0), 1 - x * x - y * y));
+	vec3 tangent, bitangent;
+	tangent_frame(normal, tangent, bitangent);
+	return x * tangent + y * bitangent + z * normal;
+}
+
+// Uniform in the unit ball
+inline vec3 sample_in_unit_sphere(real u, real v, real w) {
+	return real(cbrt(w)) * sample_unit_vector(u, v);
+}
+
+// Uniform over the directions within an angle of the unit vector axis, where
+// one_minus_cos_max is 1 - cos of that angle
+inline vec3 sample_cone(const vec3& axis, real one_minus_cos_max, real u, real v) {
+	real cos_theta = 1 - u * one_minus_cos_max;
+	real sin_theta = sqrt(std::max(real(0), 1 - cos_theta * cos_theta));
+	real phi = 2 * pi * v;
+	vec3 tangent, bitangent;
+	tangent_frame(axis, tangent, bitangent);
+	return sin_theta * cos(phi) * tangent + sin_theta * sin(phi) * bitangent + cos_theta * axis;
+}
+
+#endif // !SAMPLER_H
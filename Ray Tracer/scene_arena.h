@@ -0,0 +1,114 @@
+#ifndef SCENE_ARENA_H
+#define SCENE_ARENA_H
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+using std::shared_ptr;
+
+// Owns the objects of a scene (primitives, materials, textures) in a few
+// large chunks instead of one heap allocation each. Objects are packed in the
+// order they are made and never move.
+//
+// make() hands out shared_ptrs without a control block: they don't own the
+// object and copying them costs no reference counting, but the rest of the
+// code can keep passing shared_ptrs around. Everything made in the arena is
+// released in one go, by release() or the destructor, so the arena must
+// outlive every object that points into it, e.g. the accelerators built over
+// the scene.
+//
+// Not thread safe; build the scene from one thread.
+class scene_arena {
+	public:
+		explicit scene_arena(size_t chunk_size = 1 << 20) : chunk_size(chunk_size) {}
+		scene_arena(const scene_arena&) = delete;
+		scene_arena& operator=(const scene_arena&) = delete;
+		~scene_arena() { release(); }
+
+		template <typename T, typename... Args>
+		shared_ptr<T> make(Args&&... args);
+
+		// Destroys every object, newest first, and frees the chunks
+		void release();
+
+		// Bytes taken by objects, and reserved in chunks
+		size_t bytes_used() const { return used; }
+		size_t bytes_reserved() const { return reserved; }
+		size_t object_count() const { return objects; }
+
+	private:
+		struct chunk {
+			char* data;
+			size_t size;
+		};
+		struct destructor {
+			void* object;
+			void (*destroy)(void*);
+		};
+
+		static const size_t chunk_alignment = 64;
+
+		size_t chunk_size;
+		std::vector<chunk> chunks;
+		std::vector<destructor> destructors;
+		size_t offset = 0; // into the last chunk
+		size_t used = 0;
+		size_t reserved = 0;
+		size_t objects = 0;
+
+		void* allocate(size_t size, size_t alignment);
+};
+
+void scene_arena::release() {
+	for (size_t i = destructors.size(); i > 0; i--) {
+		destructors[i - 1].destroy(destructors[i - 1].object);
+	}
+	for (const chunk& c : chunks) {
+		::operator delete(c.data, std::align_val_t(chunk_alignment));
+	}
+	destructors.clear();
+	chunks.clear();
+	offset = used = reserved = objects = 0;
+}
+
+void* scene_arena::allocate(size_t size, size_t alignment) {
+	if (!chunks.empty()) {
+		size_t start = (offset + alignment - 1) & ~(alignment - 1);
+		if (start + size <= chunks.back().size) {
+			offset = start + size;
+			used += size;
+			return chunks.back().data + start;
+		}
+	}
+
+	// Chunks start on a cache line, enough for any object here; an object
+	// larger than a chunk gets one of its own
+	size_t size_needed = size > chunk_size ? size : chunk_size;
+	char* data = static_cast<char*>(::operator new(size_needed, std::align_val_t(chunk_alignment)));
+	chunks.push_back({ data, size_needed });
+	reserved += size_needed;
+	offset = size;
+	used += size;
+	return data;
+}
+
+template <typename T, typename... Args>
+shared_ptr<T> scene_arena::make(Args&&... args) {
+	static_assert(alignof(T) <= chunk_alignment, "object alignment exceeds the arena's");
+
+	void* memory = allocate(sizeof(T), alignof(T));
+	T* object = new (memory) T(std::forward<Args>(args)...);
+	if (!std::is_trivially_destructible<T>::value) {
+		destructors.push_back({ object, [](void* p) { static_cast<T*>(p)->~T(); } });
+	}
+	objects++;
+
+	// Aliasing an empty shared_ptr: points at the object, owns nothing
+	return shared_ptr<T>(shared_ptr<T>(), object);
+}
+
+#endif // !SCENE_ARENA_H
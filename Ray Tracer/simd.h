@@ -0,0 +1,282 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include "vec3.h"
+#include "cpu_dispatch.h"
+
+// Registers full of `real`s for testing several primitives at once. There is
+// one type per instruction set, and all of them are compiled into the same
+// binary: each function carries the target it needs, so the kernels for every
+// instruction set can sit side by side and be chosen at run time.
+//
+//   simd_real_scalar  1 lane
+//   simd_real_sse4    4 floats or 2 doubles
+//   simd_real_avx2    8 floats or 4 doubles
+//   simd_real_avx512  16 floats or 8 doubles
+//
+// A kernel is a template on the register type, instantiated inside a
+// SIMD_FLATTEN function with the target of that type (see sphere_set). The
+// type gives its width, mask type, load and set1. Comparisons give a mask with
+// a lane set where they hold. Loads and stores don't need aligned addresses.
+
+#if defined(__GNUC__)
+#define SIMD_TARGET(isa) __attribute__((target(isa)))
+#define SIMD_FLATTEN __attribute__((flatten))
+#else
+// MSVC lets any function use any intrinsic
+#define SIMD_TARGET(isa)
+#define SIMD_FLATTEN
+#endif
+
+#define SIMD_SSE4 SIMD_TARGET("sse4.2")
+#define SIMD_AVX2 SIMD_TARGET("avx2,fma")
+#define SIMD_AVX512 SIMD_TARGET("avx512f")
+
+// Widest register of any instruction set, for padding arrays
+#ifdef RAY_TRACER_FLOAT
+const int simd_max_width = 16;
+#else
+const int simd_max_width = 8;
+#endif
+
+struct simd_mask_scalar { bool v; };
+struct simd_real_scalar {
+	real v;
+
+	static const int width = 1;
+	typedef simd_mask_scalar mask;
+	static simd_real_scalar load(const real* p) { return { *p }; }
+	static simd_real_scalar set1(real t) { return { t }; }
+};
+
+inline void simd_store(real* p, simd_real_scalar a) { *p = a.v; }
+inline simd_real_scalar operator+(simd_real_scalar a, simd_real_scalar b) { return { a.v + b.v }; }
+inline simd_real_scalar operator-(simd_real_scalar a, simd_real_scalar b) { return { a.v - b.v }; }
+inline simd_real_scalar operator*(simd_real_scalar a, simd_real_scalar b) { return { a.v * b.v }; }
+inline simd_real_scalar operator/(simd_real_scalar a, simd_real_scalar b) { return { a.v / b.v }; }
+inline simd_real_scalar simd_sqrt(simd_real_scalar a) { return { sqrt(a.v) }; }
+inline simd_real_scalar simd_min(simd_real_scalar a, simd_real_scalar b) { return { a.v < b.v ? a.v : b.v }; }
+inline simd_real_scalar simd_max(simd_real_scalar a, simd_real_scalar b) { return { a.v > b.v ? a.v : b.v }; }
+inline simd_mask_scalar operator<(simd_real_scalar a, simd_real_scalar b) { return { a.v < b.v }; }
+inline simd_mask_scalar operator<=(simd_real_scalar a, simd_real_scalar b) { return { a.v <= b.v }; }
+inline simd_mask_scalar operator>(simd_real_scalar a, simd_real_scalar b) { return { a.v > b.v }; }
+inline simd_mask_scalar operator>=(simd_real_scalar a, simd_real_scalar b) { return { a.v >= b.v }; }
+inline simd_mask_scalar operator&(simd_mask_scalar a, simd_mask_scalar b) { return { a.v && b.v }; }
+inline simd_mask_scalar operator|(simd_mask_scalar a, simd_mask_scalar b) { return { a.v || b.v }; }
+inline simd_real_scalar simd_select(simd_mask_scalar m, simd_real_scalar a, simd_real_scalar b) { return m.v ? a : b; }
+inline int simd_bits(simd_mask_scalar m) { return m.v ? 1 : 0; }
+
+#ifdef CPU_X86
+#include <immintrin.h>
+
+// GCC 12 warns about the undefined registers inside its own AVX-512 intrinsics
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+#ifdef RAY_TRACER_FLOAT
+
+struct simd_mask_sse4 { __m128 v; };
+struct simd_real_sse4 {
+	__m128 v;
+
+	static const int width = 4;
+	typedef simd_mask_sse4 mask;
+	SIMD_SSE4 static simd_real_sse4 load(const real* p) { return { _mm_loadu_ps(p) }; }
+	SIMD_SSE4 static simd_real_sse4 set1(real t) { return { _mm_set1_ps(t) }; }
+};
+
+SIMD_SSE4 inline void simd_store(real* p, simd_real_sse4 a) { _mm_storeu_ps(p, a.v); }
+SIMD_SSE4 inline simd_real_sse4 operator+(simd_real_sse4 a, simd_real_sse4 b) { return { _mm_add_ps(a.v, b.v) }; }
+SIMD_SSE4 inline simd_real_sse4 operator-(simd_real_sse4 a, simd_real_sse4 b) { return { _mm_sub_ps(a.v, b.v) }; }
+SIMD_SSE4 inline simd_real_sse4 operator*(simd_real_sse4 a, simd_real_sse4 b) { return { _mm_mul_ps(a.v, b.v) }; }
+SIMD_SSE4 inline simd_real_sse4 operator/(simd_real_sse4 a, simd_real_sse4 b) { return { _mm_div_ps(a.v, b.v) }; }
+SIMD_SSE4 inline simd_real_sse4 simd_sqrt(simd_real_sse4 a) { return { _mm_sqrt_ps(a.v) }; }
+SIMD_SSE4 inline simd_real_sse4 simd_min(simd_real_sse4 a, simd_real_sse4 b) { return { _mm_min_ps(a.v, b.v) }; }
+SIMD_SSE4 inline simd_real_sse4 simd_max(simd_real_sse4 a, simd_real_sse4 b) { return { _mm_max_ps(a.v, b.v) }; }
+SIMD_SSE4 inline simd_mask_sse4 operator<(simd_real_sse4 a, simd_real_sse4 b) { return { _mm_cmplt_ps(a.v, b.v) }; }
+SIMD_SSE4 inline simd_mask_sse4 operator<=(simd_real_sse4 a, simd_real_sse4 b) { return { _mm_cmple_ps(a.v, b.v) }; }
+SIMD_SSE4 inline simd_mask_sse4 operator>(simd_real_sse4 a, simd_real_sse4 b) { return { _mm_cmpgt_ps(a.v, b.v) }; }
+SIMD_SSE4 inline simd_mask_sse4 operator>=(simd_real_sse4 a, simd_real_sse4 b) { return { _mm_cmpge_ps(a.v, b.v) }; }
+SIMD_SSE4 inline simd_mask_sse4 operator&(simd_mask_sse4 a, simd_mask_sse4 b) { return { _mm_and_ps(a.v, b.v) }; }
+SIMD_SSE4 inline simd_mask_sse4 operator|(simd_mask_sse4 a, simd_mask_sse4 b) { return { _mm_or_ps(a.v, b.v) }; }
+SIMD_SSE4 inline simd_real_sse4 simd_select(simd_mask_sse4 m, simd_real_sse4 a, simd_real_sse4 b) {
+	return { _mm_blendv_ps(b.v, a.v, m.v) };
+}
+SIMD_SSE4 inline int simd_bits(simd_mask_sse4 m) { return _mm_movemask_ps(m.v); }
+
+struct simd_mask_avx2 { __m256 v; };
+struct simd_real_avx2 {
+	__m256 v;
+
+	static const int width = 8;
+	typedef simd_mask_avx2 mask;
+	SIMD_AVX2 static simd_real_avx2 load(const real* p) { return { _mm256_loadu_ps(p) }; }
+	SIMD_AVX2 static simd_real_avx2 set1(real t) { return { _mm256_set1_ps(t) }; }
+};
+
+SIMD_AVX2 inline void simd_store(real* p, simd_real_avx2 a) { _mm256_storeu_ps(p, a.v); }
+SIMD_AVX2 inline simd_real_avx2 operator+(simd_real_avx2 a, simd_real_avx2 b) { return { _mm256_add_ps(a.v, b.v) }; }
+SIMD_AVX2 inline simd_real_avx2 operator-(simd_real_avx2 a, simd_real_avx2 b) { return { _mm256_sub_ps(a.v, b.v) }; }
+SIMD_AVX2 inline simd_real_avx2 operator*(simd_real_avx2 a, simd_real_avx2 b) { return { _mm256_mul_ps(a.v, b.v) }; }
+SIMD_AVX2 inline simd_real_avx2 operator/(simd_real_avx2 a, simd_real_avx2 b) { return { _mm256_div_ps(a.v, b.v) }; }
+SIMD_AVX2 inline simd_real_avx2 simd_sqrt(simd_real_avx2 a) { return { _mm256_sqrt_ps(a.v) }; }
+SIMD_AVX2 inline simd_real_avx2 simd_min(simd_real_avx2 a, simd_real_avx2 b) { return { _mm256_min_ps(a.v, b.v) }; }
+SIMD_AVX2 inline simd_real_avx2 simd_max(simd_real_avx2 a, simd_real_avx2 b) { return { _mm256_max_ps(a.v, b.v) }; }
+SIMD_AVX2 inline simd_mask_avx2 operator<(simd_real_avx2 a, simd_real_avx2 b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ) }; }
+SIMD_AVX2 inline simd_mask_avx2 operator<=(simd_real_avx2 a, simd_real_avx2 b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ) }; }
+SIMD_AVX2 inline simd_mask_avx2 operator>(simd_real_avx2 a, simd_real_avx2 b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ) }; }
+SIMD_AVX2 inline simd_mask_avx2 operator>=(simd_real_avx2 a, simd_real_avx2 b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ) }; }
+SIMD_AVX2 inline simd_mask_avx2 operator&(simd_mask_avx2 a, simd_mask_avx2 b) { return { _mm256_and_ps(a.v, b.v) }; }
+SIMD_AVX2 inline simd_mask_avx2 operator|(simd_mask_avx2 a, simd_mask_avx2 b) { return { _mm256_or_ps(a.v, b.v) }; }
+SIMD_AVX2 inline simd_real_avx2 simd_select(simd_mask_avx2 m, simd_real_avx2 a, simd_real_avx2 b) {
+	return { _mm256_blendv_ps(b.v, a.v, m.v) };
+}
+SIMD_AVX2 inline int simd_bits(simd_mask_avx2 m) { return _mm256_movemask_ps(m.v); }
+
+struct simd_mask_avx512 { __mmask16 v; };
+struct simd_real_avx512 {
+	__m512 v;
+
+	static const int width = 16;
+	typedef simd_mask_avx512 mask;
+	SIMD_AVX512 static simd_real_avx512 load(const real* p) { return { _mm512_loadu_ps(p) }; }
+	SIMD_AVX512 static simd_real_avx512 set1(real t) { return { _mm512_set1_ps(t) }; }
+};
+
+SIMD_AVX512 inline void simd_store(real* p, simd_real_avx512 a) { _mm512_storeu_ps(p, a.v); }
+SIMD_AVX512 inline simd_real_avx512 operator+(simd_real_avx512 a, simd_real_avx512 b) { return { _mm512_add_ps(a.v, b.v) }; }
+SIMD_AVX512 inline simd_real_avx512 operator-(simd_real_avx512 a, simd_real_avx512 b) { return { _mm512_sub_ps(a.v, b.v) }; }
+SIMD_AVX512 inline simd_real_avx512 operator*(simd_real_avx512 a, simd_real_avx512 b) { return { _mm512_mul_ps(a.v, b.v) }; }
+SIMD_AVX512 inline simd_real_avx512 operator/(simd_real_avx512 a, simd_real_avx512 b) { return { _mm512_div_ps(a.v, b.v) }; }
+SIMD_AVX512 inline simd_real_avx512 simd_sqrt(simd_real_avx512 a) { return { _mm512_sqrt_ps(a.v) }; }
+SIMD_AVX512 inline simd_real_avx512 simd_min(simd_real_avx512 a, simd_real_avx512 b) { return { _mm512_min_ps(a.v, b.v) }; }
+SIMD_AVX512 inline simd_real_avx512 simd_max(simd_real_avx512 a, simd_real_avx512 b) { return { _mm512_max_ps(a.v, b.v) }; }
+SIMD_AVX512 inline simd_mask_avx512 operator<(simd_real_avx512 a, simd_real_avx512 b) { return { _mm512_cmp_ps_mask(a.v, b.v, _CMP_LT_OQ) }; }
+SIMD_AVX512 inline simd_mask_avx512 operator<=(simd_real_avx512 a, simd_real_avx512 b) { return { _mm512_cmp_ps_mask(a.v, b.v, _CMP_LE_OQ) }; }
+SIMD_AVX512 inline simd_mask_avx512 operator>(simd_real_avx512 a, simd_real_avx512 b) { return { _mm512_cmp_ps_mask(a.v, b.v, _CMP_GT_OQ) }; }
+SIMD_AVX512 inline simd_mask_avx512 operator>=(simd_real_avx512 a, simd_real_avx512 b) { return { _mm512_cmp_ps_mask(a.v, b.v, _CMP_GE_OQ) }; }
+SIMD_AVX512 inline simd_real_avx512 simd_select(simd_mask_avx512 m, simd_real_avx512 a, simd_real_avx512 b) {
+	return { _mm512_mask_blend_ps(m.v, b.v, a.v) };
+}
+
+#else
+
+struct simd_mask_sse4 { __m128d v; };
+struct simd_real_sse4 {
+	__m128d v;
+
+	static const int width = 2;
+	typedef simd_mask_sse4 mask;
+	SIMD_SSE4 static simd_real_sse4 load(const real* p) { return { _mm_loadu_pd(p) }; }
+	SIMD_SSE4 static simd_real_sse4 set1(real t) { return { _mm_set1_pd(t) }; }
+};
+
+SIMD_SSE4 inline void simd_store(real* p, simd_real_sse4 a) { _mm_storeu_pd(p, a.v); }
+SIMD_SSE4 inline simd_real_sse4 operator+(simd_real_sse4 a, simd_real_sse4 b) { return { _mm_add_pd(a.v, b.v) }; }
+SIMD_SSE4 inline simd_real_sse4 operator-(simd_real_sse4 a, simd_real_sse4 b) { return { _mm_sub_pd(a.v, b.v) }; }
+SIMD_SSE4 inline simd_real_sse4 operator*(simd_real_sse4 a, simd_real_sse4 b) { return { _mm_mul_pd(a.v, b.v) }; }
+SIMD_SSE4 inline simd_real_sse4 operator/(simd_real_sse4 a, simd_real_sse4 b) { return { _mm_div_pd(a.v, b.v) }; }
+SIMD_SSE4 inline simd_real_sse4 simd_sqrt(simd_real_sse4 a) { return { _mm_sqrt_pd(a.v) }; }
+SIMD_SSE4 inline simd_real_sse4 simd_min(simd_real_sse4 a, simd_real_sse4 b) { return { _mm_min_pd(a.v, b.v) }; }
+SIMD_SSE4 inline simd_real_sse4 simd_max(simd_real_sse4 a, simd_real_sse4 b) { return { _mm_max_pd(a.v, b.v) }; }
+SIMD_SSE4 inline simd_mask_sse4 operator<(simd_real_sse4 a, simd_real_sse4 b) { return { _mm_cmplt_pd(a.v, b.v) }; }
+SIMD_SSE4 inline simd_mask_sse4 operator<=(simd_real_sse4 a, simd_real_sse4 b) { return { _mm_cmple_pd(a.v, b.v) }; }
+SIMD_SSE4 inline simd_mask_sse4 operator>(simd_real_sse4 a, simd_real_sse4 b) { return { _mm_cmpgt_pd(a.v, b.v) }; }
+SIMD_SSE4 inline simd_mask_sse4 operator>=(simd_real_sse4 a, simd_real_sse4 b) { return { _mm_cmpge_pd(a.v, b.v) }; }
+SIMD_SSE4 inline simd_mask_sse4 operator&(simd_mask_sse4 a, simd_mask_sse4 b) { return { _mm_and_pd(a.v, b.v) }; }
+SIMD_SSE4 inline simd_mask_sse4 operator|(simd_mask_sse4 a, simd_mask_sse4 b) { return { _mm_or_pd(a.v, b.v) }; }
+SIMD_SSE4 inline simd_real_sse4 simd_select(simd_mask_sse4 m, simd_real_sse4 a, simd_real_sse4 b) {
+	return { _mm_blendv_pd(b.v, a.v, m.v) };
+}
+SIMD_SSE4 inline int simd_bits(simd_mask_sse4 m) { return _mm_movemask_pd(m.v); }
+
+struct simd_mask_avx2 { __m256d v; };
+struct simd_real_avx2 {
+	__m256d v;
+
+	static const int width = 4;
+	typedef simd_mask_avx2 mask;
+	SIMD_AVX2 static simd_real_avx2 load(const real* p) { return { _mm256_loadu_pd(p) }; }
+	SIMD_AVX2 static simd_real_avx2 set1(real t) { return { _mm256_set1_pd(t) }; }
+};
+
+SIMD_AVX2 inline void simd_store(real* p, simd_real_avx2 a) { _mm256_storeu_pd(p, a.v); }
+SIMD_AVX2 inline simd_real_avx2 operator+(simd_real_avx2 a, simd_real_avx2 b) { return { _mm256_add_pd(a.v, b.v) }; }
+SIMD_AVX2 inline simd_real_avx2 operator-(simd_real_avx2 a, simd_real_avx2 b) { return { _mm256_sub_pd(a.v, b.v) }; }
+SIMD_AVX2 inline simd_real_avx2 operator*(simd_real_avx2 a, simd_real_avx2 b) { return { _mm256_mul_pd(a.v, b.v) }; }
+SIMD_AVX2 inline simd_real_avx2 operator/(simd_real_avx2 a, simd_real_avx2 b) { return { _mm256_div_pd(a.v, b.v) }; }
+SIMD_AVX2 inline simd_real_avx2 simd_sqrt(simd_real_avx2 a) { return { _mm256_sqrt_pd(a.v) }; }
+SIMD_AVX2 inline simd_real_avx2 simd_min(simd_real_avx2 a, simd_real_avx2 b) { return { _mm256_min_pd(a.v, b.v) }; }
+SIMD_AVX2 inline simd_real_avx2 simd_max(simd_real_avx2 a, simd_real_avx2 b) { return { _mm256_max_pd(a.v, b.v) }; }
+SIMD_AVX2 inline simd_mask_avx2 operator<(simd_real_avx2 a, simd_real_avx2 b) { return { _mm256_cmp_pd(a.v, b.v, _CMP_LT_OQ) }; }
+SIMD_AVX2 inline simd_mask_avx2 operator<=(simd_real_avx2 a, simd_real_avx2 b) { return { _mm256_cmp_pd(a.v, b.v, _CMP_LE_OQ) }; }
+SIMD_AVX2 inline simd_mask_avx2 operator>(simd_real_avx2 a, simd_real_avx2 b) { return { _mm256_cmp_pd(a.v, b.v, _CMP_GT_OQ) }; }
+SIMD_AVX2 inline simd_mask_avx2 operator>=(simd_real_avx2 a, simd_real_avx2 b) { return { _mm256_cmp_pd(a.v, b.v, _CMP_GE_OQ) }; }
+SIMD_AVX2 inline simd_mask_avx2 operator&(simd_mask_avx2 a, simd_mask_avx2 b) { return { _mm256_and_pd(a.v, b.v) }; }
+SIMD_AVX2 inline simd_mask_avx2 operator|(simd_mask_avx2 a, simd_mask_avx2 b) { return { _mm256_or_pd(a.v, b.v) }; }
+SIMD_AVX2 inline simd_real_avx2 simd_select(simd_mask_avx2 m, simd_real_avx2 a, simd_real_avx2 b) {
+	return { _mm256_blendv_pd(b.v, a.v, m.v) };
+}
+SIMD_AVX2 inline int simd_bits(simd_mask_avx2 m) { return _mm256_movemask_pd(m.v); }
+
+struct simd_mask_avx512 { __mmask8 v; };
+struct simd_real_avx512 {
+	__m512d v;
+
+	static const int width = 8;
+	typedef simd_mask_avx512 mask;
+	SIMD_AVX512 static simd_real_avx512 load(const real* p) { return { _mm512_loadu_pd(p) }; }
+	SIMD_AVX512 static simd_real_avx512 set1(real t) { return { _mm512_set1_pd(t) }; }
+};
+
+SIMD_AVX512 inline void simd_store(real* p, simd_real_avx512 a) { _mm512_storeu_pd(p, a.v); }
+SIMD_AVX512 inline simd_real_avx512 operator+(simd_real_avx512 a, simd_real_avx512 b) { return { _mm512_add_pd(a.v, b.v) }; }
+SIMD_AVX512 inline simd_real_avx512 operator-(simd_real_avx512 a, simd_real_avx512 b) { return { _mm512_sub_pd(a.v, b.v) }; }
+SIMD_AVX512 inline simd_real_avx512 operator*(simd_real_avx512 a, simd_real_avx512 b) { return { _mm512_mul_pd(a.v, b.v) }; }
+SIMD_AVX512 inline simd_real_avx512 operator/(simd_real_avx512 a, simd_real_avx512 b) { return { _mm512_div_pd(a.v, b.v) }; }
+SIMD_AVX512 inline simd_real_avx512 simd_sqrt(simd_real_avx512 a) { return { _mm512_sqrt_pd(a.v) }; }
+SIMD_AVX512 inline simd_real_avx512 simd_min(simd_real_avx512 a, simd_real_avx512 b) { return { _mm512_min_pd(a.v, b.v) }; }
+SIMD_AVX512 inline simd_real_avx512 simd_max(simd_real_avx512 a, simd_real_avx512 b) { return { _mm512_max_pd(a.v, b.v) }; }
+SIMD_AVX512 inline simd_mask_avx512 operator<(simd_real_avx512 a, simd_real_avx512 b) { return { _mm512_cmp_pd_mask(a.v, b.v, _CMP_LT_OQ) }; }
+SIMD_AVX512 inline simd_mask_avx512 operator<=(simd_real_avx512 a, simd_real_avx512 b) { return { _mm512_cmp_pd_mask(a.v, b.v, _CMP_LE_OQ) }; }
+SIMD_AVX512 inline simd_mask_avx512 operator>(simd_real_avx512 a, simd_real_avx512 b) { return { _mm512_cmp_pd_mask(a.v, b.v, _CMP_GT_OQ) }; }
+SIMD_AVX512 inline simd_mask_avx512 operator>=(simd_real_avx512 a, simd_real_avx512 b) { return { _mm512_cmp_pd_mask(a.v, b.v, _CMP_GE_OQ) }; }
+SIMD_AVX512 inline simd_real_avx512 simd_select(simd_mask_avx512 m, simd_real_avx512 a, simd_real_avx512 b) {
+	return { _mm512_mask_blend_pd(m.v, b.v, a.v) };
+}
+
+#endif // RAY_TRACER_FLOAT
+
+// AVX-512 masks are plain bit masks
+inline simd_mask_avx512 operator&(simd_mask_avx512 a, simd_mask_avx512 b) { return { decltype(a.v)(a.v & b.v) }; }
+inline simd_mask_avx512 operator|(simd_mask_avx512 a, simd_mask_avx512 b) { return { decltype(a.v)(a.v | b.v) }; }
+inline int simd_bits(simd_mask_avx512 m) { return m.v; }
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+#endif // CPU_X86
+
+inline bool simd_any(simd_mask_scalar m) { return m.v; }
+#ifdef CPU_X86
+SIMD_SSE4 inline bool simd_any(simd_mask_sse4 m) { return simd_bits(m) != 0; }
+SIMD_AVX2 inline bool simd_any(simd_mask_avx2 m) { return simd_bits(m) != 0; }
+inline bool simd_any(simd_mask_avx512 m) { return m.v != 0; }
+#endif
+
+// Lanes of the register a kernel uses on an instruction set
+inline int simd_width(cpu_isa isa) {
+	switch (isa) {
+#ifdef CPU_X86
+		case cpu_isa::avx512: return simd_real_avx512::width;
+		case cpu_isa::avx2: return simd_real_avx2::width;
+		case cpu_isa::sse4_2: return simd_real_sse4::width;
+#endif
+		default: return simd_real_scalar::width;
+	}
+}
+
+#endif // !SIMD_H
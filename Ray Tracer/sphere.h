@@ -8,24 +8,44 @@
 class sphere : public hittable {
 	public:
 		point3 center;
-		double radius;
+		real radius;
 		shared_ptr<material> mat_ptr;
 
 	public:
 		sphere(){}
-		sphere(point3 center, double radius, shared_ptr<material> m) : 
+		sphere(point3 center, real radius, shared_ptr<material> m) : 
 			center(center), radius(radius), mat_ptr(m) {};
 
-		virtual bool hit(ray& ray, double t_min, double t_max, hit_record& rec) const override;
+		virtual bool intersect(const ray& ray, real t_min, real t_max, hit_info& hit) const override;
+		virtual void resolve_hit(const ray& ray, const hit_info& hit, hit_record& rec) const override;
+		virtual int intersect_packet(ray4& rays, int active, hit_info* hits) const override {
+			return intersect_rays(rays, active, hits);
+		}
+		virtual int intersect_packet(ray8& rays, int active, hit_info* hits) const override {
+			return intersect_rays(rays, active, hits);
+		}
+
+		virtual bool bounding_box(aabb& output_box) const override {
+			// A negative radius (a hollow shell, normals flipped inward)
+			// still covers the same space
+			real extent = fabs(radius);
+			vec3 r(extent, extent, extent);
+			output_box = aabb(center - r, center + r);
+			return true;
+		}
+
+	private:
+		template <int N>
+		int intersect_rays(ray_packet<N>& rays, int active, hit_info* hits) const;
 };
 
-bool sphere::hit(ray& ray, double t_min, double t_max, hit_record& rec) const {
-	vec3 ac = ray.origin() - center; //A-C
+bool sphere::intersect(const ray& ray, real t_min, real t_max, hit_info& hit) const {
+	vec3 ac = ray.orig - center; //A-C
 
 	//dot product(A, A) = (vector length)^2
 
-	auto a = ray.direction().length_squared(); // b^2 //dot(ray.direction(), ray.direction())
-	auto half_b = dot(ray.direction(), ac); //b(A-C)
+	auto a = ray.dir.length_squared(); // b^2 //dot(ray.direction(), ray.direction())
+	auto half_b = dot(ray.dir, ac); //b(A-C)
 	auto c = ac.length_squared() - radius * radius; //(A-C)^2-r^2 //dot(ac, ac)
 	
 	auto discriminant = half_b * half_b - a * c;
@@ -44,13 +64,56 @@ bool sphere::hit(ray& ray, double t_min, double t_max, hit_record& rec) const {
 		}
 	}
 
-	rec.t = root;
+	hit.t = root;
+	hit.object = this;
+	return true;
+}
+
+// Same test as intersect for all rays of the packet at once, without
+// branches so the loop over the rays vectorizes. A miss leaves the root at
+// infinity.
+template <int N>
+int sphere::intersect_rays(ray_packet<N>& rays, int active, hit_info* hits) const {
+	real cx = center.x(), cy = center.y(), cz = center.z();
+	real radius_squared = radius * radius;
+
+	real root[N];
+	for (int i = 0; i < N; i++) {
+		real acx = rays.ox[i] - cx, acy = rays.oy[i] - cy, acz = rays.oz[i] - cz;
+		real a = rays.dx[i] * rays.dx[i] + rays.dy[i] * rays.dy[i] + rays.dz[i] * rays.dz[i];
+		real half_b = rays.dx[i] * acx + rays.dy[i] * acy + rays.dz[i] * acz;
+		real c = acx * acx + acy * acy + acz * acz - radius_squared;
+
+		real discriminant = half_b * half_b - a * c;
+		real sqrt_D = sqrt(discriminant < 0 ? 0 : discriminant);
+		real near = (-half_b - sqrt_D) / a;
+		real far = (-half_b + sqrt_D) / a;
+		bool near_in = near >= rays.t_min[i] && near <= rays.t_max[i];
+		bool far_in = far >= rays.t_min[i] && far <= rays.t_max[i];
+		root[i] = discriminant < 0 ? infinity : near_in ? near : far_in ? far : infinity;
+	}
+
+	int hit_mask = 0;
+	for (int i = 0; i < N; i++) {
+		hit_mask |= (root[i] < infinity) << i;
+	}
+	hit_mask &= active;
+	for (int i = 0; i < N; i++) {
+		if (hit_mask & (1 << i)) {
+			rays.t_max[i] = root[i];
+			hits[i].t = root[i];
+			hits[i].object = this;
+		}
+	}
+	return hit_mask;
+}
+
+void sphere::resolve_hit(const ray& ray, const hit_info& hit, hit_record& rec) const {
+	rec.t = hit.t;
 	rec.p = ray.at(rec.t);
 	vec3 outward_normal = (rec.p - center) / radius;
 	rec.set_face_normal(ray, outward_normal);
 	rec.mat_ptr = mat_ptr;
-
-	return true;
 }
 
 #endif // !SPHERE_H
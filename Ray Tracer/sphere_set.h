@@ -0,0 +1,268 @@
+#ifndef SPHERE_SET_H
+#define SPHERE_SET_H
+
+#include "hittable.h"
+#include "bvh.h"
+#include "simd.h"
+
+#include <limits>
+#include <unordered_map>
+#include <vector>
+
+// Many spheres in one object. Centers, radii and materials are kept in
+// separate arrays (structure of arrays) ordered by the leaves of a bvh built
+// over them, so a leaf is tested a full register of spheres per instruction.
+//
+// Add the spheres, then call build() before tracing. build() picks the
+// batch kernel for the current kernel_isa().
+class sphere_set : public hittable {
+	public:
+		std::vector<real> center_x;
+		std::vector<real> center_y;
+		std::vector<real> center_z;
+		std::vector<real> radius;
+		std::vector<int> material_index;
+		std::vector<shared_ptr<material>> materials;
+		bvh accel;
+		cpu_isa isa = cpu_isa::scalar; // of the batch kernel
+
+	public:
+		sphere_set() {}
+
+		void add(const point3& center, real r, shared_ptr<material> m);
+		void build(bvh_build_options options = bvh_build_options());
+
+		int size() const { return count; }
+
+		virtual bool intersect(const ray& ray, real t_min, real t_max, hit_info& hit) const override;
+		virtual void resolve_hit(const ray& ray, const hit_info& hit, hit_record& rec) const override;
+		virtual bool bounding_box(aabb& output_box) const override;
+
+	private:
+		int count = 0;
+		std::unordered_map<const material*, int> material_slot;
+
+		// A negative radius, a hollow shell, covers the same space
+		aabb sphere_box(int i) const {
+			real extent = fabs(radius[i]);
+			vec3 r(extent, extent, extent);
+			point3 c(center_x[i], center_y[i], center_z[i]);
+			return aabb(c - r, c + r);
+		}
+
+		// Nearest hit in [t_min, t_max] of spheres [first, first + n) along a
+		// unit direction, or -1
+		int hit_batch(int first, int n, const point3& origin, const vec3& unit_dir,
+			real t_min, real& t_max) const;
+		template <typename V>
+		int hit_batch(int first, int n, const point3& origin, const vec3& unit_dir,
+			real t_min, real& t_max) const;
+		// One instance of the kernel per instruction set
+		int hit_batch_scalar(int first, int n, const point3& origin, const vec3& unit_dir,
+			real t_min, real& t_max) const;
+#ifdef CPU_X86
+		SIMD_SSE4 int hit_batch_sse4(int first, int n, const point3& origin, const vec3& unit_dir,
+			real t_min, real& t_max) const;
+		SIMD_AVX2 int hit_batch_avx2(int first, int n, const point3& origin, const vec3& unit_dir,
+			real t_min, real& t_max) const;
+		SIMD_AVX512 int hit_batch_avx512(int first, int n, const point3& origin, const vec3& unit_dir,
+			real t_min, real& t_max) const;
+#endif
+};
+
+void sphere_set::add(const point3& center, real r, shared_ptr<material> m) {
+	// Drop the padding of the last build
+	center_x.resize(count);
+	center_y.resize(count);
+	center_z.resize(count);
+	radius.resize(count);
+
+	center_x.push_back(center.x());
+	center_y.push_back(center.y());
+	center_z.push_back(center.z());
+	radius.push_back(r);
+
+	auto slot = material_slot.find(m.get());
+	if (slot == material_slot.end()) {
+		slot = material_slot.emplace(m.get(), static_cast<int>(materials.size())).first;
+		materials.push_back(m);
+	}
+	material_index.push_back(slot->second);
+	count++;
+}
+
+void sphere_set::build(bvh_build_options options) {
+	// A batch tests a full register, so leaves of about that many spheres
+	// cost little more than leaves of one
+	isa = kernel_isa();
+	int width = simd_width(isa);
+	options.spatial_splits = false;
+	options.max_leaf_size = width > options.max_leaf_size ? width : options.max_leaf_size;
+	options.intersection_cost /= width;
+
+	std::vector<aabb> bounds(count);
+	for (int i = 0; i < count; i++) {
+		bounds[i] = sphere_box(i);
+	}
+	accel.build(bounds, options);
+
+	// Store the spheres in leaf order, each leaf is then a contiguous range.
+	// The tree leaves out spheres with empty bounds, which no ray could hit,
+	// so only the ones it holds are kept.
+	const int* order = accel.prim_array();
+	int kept = static_cast<int>(accel.prim_count());
+	auto reorder = [&](auto& values) {
+		auto sorted = values;
+		sorted.resize(kept);
+		for (int i = 0; i < kept; i++) {
+			sorted[i] = values[order[i]];
+		}
+		values.swap(sorted);
+	};
+	reorder(center_x);
+	reorder(center_y);
+	reorder(center_z);
+	reorder(radius);
+	reorder(material_index);
+	count = kept;
+
+	// Full registers may be loaded past the last sphere; padding spheres
+	// have a NaN radius and never hit
+	center_x.resize(count + simd_max_width - 1, 0);
+	center_y.resize(count + simd_max_width - 1, 0);
+	center_z.resize(count + simd_max_width - 1, 0);
+	radius.resize(count + simd_max_width - 1, std::numeric_limits<real>::quiet_NaN());
+}
+
+int sphere_set::hit_batch(int first, int n, const point3& origin, const vec3& unit_dir,
+	real t_min, real& t_max) const {
+	switch (isa) {
+#ifdef CPU_X86
+		case cpu_isa::avx512: return hit_batch_avx512(first, n, origin, unit_dir, t_min, t_max);
+		case cpu_isa::avx2: return hit_batch_avx2(first, n, origin, unit_dir, t_min, t_max);
+		case cpu_isa::sse4_2: return hit_batch_sse4(first, n, origin, unit_dir, t_min, t_max);
+#endif
+		default: return hit_batch_scalar(first, n, origin, unit_dir, t_min, t_max);
+	}
+}
+
+SIMD_FLATTEN int sphere_set::hit_batch_scalar(int first, int n, const point3& origin, const vec3& unit_dir,
+	real t_min, real& t_max) const {
+	return hit_batch<simd_real_scalar>(first, n, origin, unit_dir, t_min, t_max);
+}
+
+#ifdef CPU_X86
+SIMD_SSE4 SIMD_FLATTEN int sphere_set::hit_batch_sse4(int first, int n, const point3& origin, const vec3& unit_dir,
+	real t_min, real& t_max) const {
+	return hit_batch<simd_real_sse4>(first, n, origin, unit_dir, t_min, t_max);
+}
+
+SIMD_AVX2 SIMD_FLATTEN int sphere_set::hit_batch_avx2(int first, int n, const point3& origin, const vec3& unit_dir,
+	real t_min, real& t_max) const {
+	return hit_batch<simd_real_avx2>(first, n, origin, unit_dir, t_min, t_max);
+}
+
+SIMD_AVX512 SIMD_FLATTEN int sphere_set::hit_batch_avx512(int first, int n, const point3& origin, const vec3& unit_dir,
+	real t_min, real& t_max) const {
+	return hit_batch<simd_real_avx512>(first, n, origin, unit_dir, t_min, t_max);
+}
+#endif
+
+template <typename V>
+int sphere_set::hit_batch(int first, int n, const point3& origin, const vec3& unit_dir,
+	real t_min, real& t_max) const {
+	typedef typename V::mask M;
+	static const real lane_index[16] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
+
+	const V ox = V::set1(origin.x()), oy = V::set1(origin.y()), oz = V::set1(origin.z());
+	const V dx = V::set1(unit_dir.x()), dy = V::set1(unit_dir.y()), dz = V::set1(unit_dir.z());
+	const V lo = V::set1(t_min);
+	const V zero = V::set1(0);
+	int nearest = -1;
+
+	for (int i = first; i < first + n; i += V::width) {
+		V hi = V::set1(t_max);
+		V ocx = ox - V::load(&center_x[i]);
+		V ocy = oy - V::load(&center_y[i]);
+		V ocz = oz - V::load(&center_z[i]);
+		V r = V::load(&radius[i]);
+
+		// a == 1 for a unit direction: t = -half_b -+ sqrt(half_b^2 - c)
+		V half_b = ocx * dx + ocy * dy + ocz * dz;
+		V c = ocx * ocx + ocy * ocy + ocz * ocz - r * r;
+		V discriminant = half_b * half_b - c;
+		M valid = (discriminant >= zero) & (V::load(lane_index) < V::set1(real(first + n - i)));
+		if (!simd_any(valid)) {
+			continue;
+		}
+
+		V sqrt_d = simd_sqrt(simd_max(discriminant, zero));
+		V near_root = zero - half_b - sqrt_d;
+		V far_root = sqrt_d - half_b;
+		M near_ok = (near_root >= lo) & (near_root <= hi);
+		M far_ok = (far_root >= lo) & (far_root <= hi);
+		V root = simd_select(near_ok, near_root, far_root);
+		int hits = simd_bits(valid & (near_ok | far_ok));
+		if (hits == 0) {
+			continue;
+		}
+
+		real roots[16];
+		simd_store(roots, root);
+		for (int lane = 0; lane < V::width; lane++) {
+			if ((hits >> lane & 1) && roots[lane] < t_max) {
+				t_max = roots[lane];
+				nearest = i + lane;
+			}
+		}
+	}
+	return nearest;
+}
+
+bool sphere_set::intersect(const ray& ray, real t_min, real t_max, hit_info& hit) const {
+	if (count == 0) {
+		return false;
+	}
+
+	// Distances along the unit direction are `length` times those along the ray
+	real length = ray.dir.length();
+	vec3 unit_dir = ray.dir / length;
+	int nearest = -1;
+	real nearest_t = t_max;
+
+	accel.intersect_leaves(ray, t_min, t_max, [&](int first, int n, real& max_t) {
+		real unit_max = max_t * length;
+		int index = hit_batch(first, n, ray.orig, unit_dir, t_min * length, unit_max);
+		if (index < 0) {
+			return false;
+		}
+		nearest = index;
+		nearest_t = unit_max / length;
+		max_t = nearest_t;
+		return true;
+	});
+	if (nearest < 0) {
+		return false;
+	}
+
+	hit.t = nearest_t;
+	hit.object = this;
+	hit.prim = nearest;
+	return true;
+}
+
+void sphere_set::resolve_hit(const ray& ray, const hit_info& hit, hit_record& rec) const {
+	point3 center(center_x[hit.prim], center_y[hit.prim], center_z[hit.prim]);
+	rec.t = hit.t;
+	rec.p = ray.at(rec.t);
+	vec3 outward_normal = (rec.p - center) / radius[hit.prim];
+	rec.set_face_normal(ray, outward_normal);
+	rec.mat_ptr = materials[material_index[hit.prim]];
+}
+
+bool sphere_set::bounding_box(aabb& output_box) const {
+	output_box = accel.bounds();
+	return count > 0;
+}
+
+#endif // !SPHERE_SET_H
@@ -5,7 +5,7 @@
 
 class texture {
     public:
-        virtual color value(double u, double v, const point3& p) const = 0;
+        virtual color value(real u, real v, const point3& p) const = 0;
 };
 
 class solid_color : public texture {
@@ -16,10 +16,10 @@ class solid_color : public texture {
         solid_color() {}
         solid_color(color c) : color_value(c) {}
 
-        solid_color(double red, double green, double blue)
+        solid_color(real red, real green, real blue)
             : solid_color(color(red, green, blue)) {}
 
-        virtual color value(double u, double v, const vec3& p) const override {
+        virtual color value(real u, real v, const vec3& p) const override {
             return color_value;
         }
 };
@@ -0,0 +1,179 @@
+#ifndef TRIANGLE_MESH_H
+#define TRIANGLE_MESH_H
+
+#include "hittable.h"
+#include "bvh.h"
+#include "bvh_cache.h"
+
+#include "Mesh.h"
+
+#include <string>
+#include <vector>
+
+// Native triangle backend: a mesh traced through its own bvh instead of Embree
+class triangle_mesh : public hittable {
+	public:
+		std::vector<point3> vertices;
+		std::vector<Triangle> triangles;
+		shared_ptr<material> mat_ptr;
+		bvh accel;
+		bool loaded_from_cache = false;
+
+	public:
+		// With a cache_path the bvh is loaded from that file when it matches the
+		// mesh and options, otherwise it is built and the file (re)written.
+		triangle_mesh(const Mesh& mesh, shared_ptr<material> m,
+			const bvh_build_options& options = bvh_build_options(), const std::string& cache_path = "");
+
+		virtual bool intersect(const ray& ray, real t_min, real t_max, hit_info& hit) const override;
+		virtual void resolve_hit(const ray& ray, const hit_info& hit, hit_record& rec) const override;
+
+		virtual bool bounding_box(aabb& output_box) const override {
+			output_box = accel.bounds();
+			return !triangles.empty();
+		}
+
+	private:
+		const point3& vertex(int tri, int k) const {
+			const Triangle& t = triangles[tri];
+			return vertices[k == 0 ? t.v0 : (k == 1 ? t.v1 : t.v2)];
+		}
+
+		aabb triangle_box(int tri) const;
+		void split_triangle(int tri, int axis, real pos, const aabb& box, aabb& left, aabb& right) const;
+		bool hit_triangle(int tri, const ray& r, real t_min, real t_max, real& t, real& u, real& v) const;
+};
+
+triangle_mesh::triangle_mesh(
+	const Mesh& mesh, shared_ptr<material> m, const bvh_build_options& options, const std::string& cache_path)
+	: mat_ptr(m) {
+	vertices.reserve(mesh.num_vertices);
+	for (int i = 0; i < mesh.num_vertices; i++) {
+		vertices.push_back(point3(mesh.positions[3 * i], mesh.positions[3 * i + 1], mesh.positions[3 * i + 2]));
+	}
+	triangles.resize(mesh.num_triangles);
+	memcpy(triangles.data(), mesh.tri_indices, sizeof(Triangle) * mesh.num_triangles);
+
+	uint64_t cache_key = 0;
+	if (!cache_path.empty()) {
+		cache_key = bvh_cache_key(mesh.positions, sizeof(float) * 3 * mesh.num_vertices,
+			mesh.tri_indices, sizeof(int32_t) * 3 * mesh.num_triangles, options);
+		if (load_bvh_cache(cache_path, cache_key, accel)) {
+			loaded_from_cache = true;
+			return;
+		}
+	}
+
+	std::vector<aabb> bounds(triangles.size());
+	for (int i = 0; i < static_cast<int>(triangles.size()); i++) {
+		bounds[i] = triangle_box(i);
+	}
+	accel.build(bounds, options,
+		[this](int tri, int axis, real pos, const aabb& box, aabb& left, aabb& right) {
+			split_triangle(tri, axis, pos, box, left, right);
+		});
+
+	if (!cache_path.empty()) {
+		save_bvh_cache(cache_path, cache_key, accel);
+	}
+}
+
+aabb triangle_mesh::triangle_box(int tri) const {
+	aabb box;
+	for (int k = 0; k < 3; k++) {
+		box.grow(vertex(tri, k));
+	}
+	return box;
+}
+
+// Clips the triangle edges at the plane and bounds the points on each side,
+// limited to the box of the part of the triangle that is being split.
+void triangle_mesh::split_triangle(
+	int tri, int axis, real pos, const aabb& box, aabb& left, aabb& right) const {
+	aabb l, r;
+	for (int k = 0; k < 3; k++) {
+		const point3& v0 = vertex(tri, k);
+		const point3& v1 = vertex(tri, (k + 1) % 3);
+		real p0 = v0[axis];
+		real p1 = v1[axis];
+
+		if (p0 <= pos) {
+			l.grow(v0);
+		}
+		if (p0 >= pos) {
+			r.grow(v0);
+		}
+		if ((p0 < pos && p1 > pos) || (p0 > pos && p1 < pos)) {
+			point3 crossing = v0 + (v1 - v0) * ((pos - p0) / (p1 - p0));
+			crossing[axis] = pos;
+			l.grow(crossing);
+			r.grow(crossing);
+		}
+	}
+	left = intersection(l, box);
+	right = intersection(r, box);
+}
+
+// Moller-Trumbore ray/triangle intersection
+bool triangle_mesh::hit_triangle(int tri, const ray& r, real t_min, real t_max, real& t, real& u, real& v) const {
+	const point3& p0 = vertex(tri, 0);
+	vec3 e1 = vertex(tri, 1) - p0;
+	vec3 e2 = vertex(tri, 2) - p0;
+
+	vec3 pvec = cross(r.dir, e2);
+	real det = dot(e1, pvec);
+	if (fabs(det) < 1e-12) {
+		return false;
+	}
+	real inv_det = 1 / det;
+
+	vec3 tvec = r.orig - p0;
+	u = dot(tvec, pvec) * inv_det;
+	if (u < 0 || u > 1) {
+		return false;
+	}
+
+	vec3 qvec = cross(tvec, e1);
+	v = dot(r.dir, qvec) * inv_det;
+	if (v < 0 || u + v > 1) {
+		return false;
+	}
+
+	t = dot(e2, qvec) * inv_det;
+	return t >= t_min && t <= t_max;
+}
+
+bool triangle_mesh::intersect(const ray& ray, real t_min, real t_max, hit_info& hit) const {
+	hit_info closest;
+	closest.prim = -1;
+
+	accel.intersect(ray, t_min, t_max, [&](int tri, real& max_t) {
+		real t, u, v;
+		if (!hit_triangle(tri, ray, t_min, max_t, t, u, v)) {
+			return false;
+		}
+		max_t = closest.t = t;
+		closest.prim = tri;
+		closest.u = u;
+		closest.v = v;
+		return true;
+	});
+
+	if (closest.prim < 0) {
+		return false;
+	}
+	closest.object = this;
+	hit = closest;
+	return true;
+}
+
+void triangle_mesh::resolve_hit(const ray& ray, const hit_info& hit, hit_record& rec) const {
+	const point3& p0 = vertex(hit.prim, 0);
+	vec3 outward_normal = unit_vector(cross(vertex(hit.prim, 1) - p0, vertex(hit.prim, 2) - p0));
+	rec.t = hit.t;
+	rec.p = ray.at(hit.t);
+	rec.set_face_normal(ray, outward_normal);
+	rec.mat_ptr = mat_ptr;
+}
+
+#endif // !TRIANGLE_MESH_H
@@ -0,0 +1,158 @@
+#ifndef TYPED_BVH_ACCEL_H
+#define TYPED_BVH_ACCEL_H
+
+#include "hittable.h"
+#include "bvh.h"
+#include "sphere.h"
+#include "box.h"
+#include "material.h"
+
+#include <vector>
+
+// Bvh over the objects of a scene with the known primitive kinds copied into
+// one array per kind. A primitive is tested with a switch on its kind and a
+// direct call, which the compiler can inline into the traversal, instead of
+// a virtual call through a shared_ptr. Objects of any other type are kept
+// as they are and still go through hittable::intersect.
+class typed_bvh_accel : public hittable {
+	public:
+		enum class primitive_kind : int { sphere, box, other };
+
+		struct primitive_ref {
+			primitive_kind kind;
+			int index; // into the array of that kind
+		};
+
+		std::vector<sphere> spheres;
+		std::vector<box> boxes;
+		std::vector<shared_ptr<hittable>> others;
+		std::vector<shared_ptr<hittable>> unbounded; // objects without bounds, tested for every ray
+		std::vector<primitive_ref> primitives; // indexed by bvh primitive
+		bvh accel;
+
+	public:
+		typed_bvh_accel(const std::vector<shared_ptr<hittable>>& scene_objects,
+			const bvh_build_options& options = bvh_build_options());
+
+		virtual bool intersect(const ray& ray, real t_min, real t_max, hit_info& hit) const override;
+		virtual int intersect_packet(ray4& rays, int active, hit_info* hits) const override {
+			return intersect_rays(rays, active, hits);
+		}
+		virtual int intersect_packet(ray8& rays, int active, hit_info* hits) const override {
+			return intersect_rays(rays, active, hits);
+		}
+		virtual bool bounding_box(aabb& output_box) const override;
+
+	private:
+		template <int N>
+		int intersect_rays(ray_packet<N>& rays, int active, hit_info* hits) const;
+};
+
+typed_bvh_accel::typed_bvh_accel(const std::vector<shared_ptr<hittable>>& scene_objects,
+	const bvh_build_options& options) {
+	std::vector<aabb> bounds;
+	aabb box_bounds;
+	for (const auto& object : scene_objects) {
+		if (!object->bounding_box(box_bounds)) {
+			unbounded.push_back(object);
+			continue;
+		}
+
+		// Spheres are copied in, except lights, which must stay the objects
+		// the light_list knows them by
+		auto s = dynamic_cast<const sphere*>(object.get());
+		if (s && !(s->mat_ptr && s->mat_ptr->is_emissive())) {
+			primitives.push_back({ primitive_kind::sphere, static_cast<int>(spheres.size()) });
+			spheres.push_back(*s);
+		}
+		else if (auto b = dynamic_cast<const box*>(object.get())) {
+			// Sliced to a plain box, cube only adds its center and size
+			primitives.push_back({ primitive_kind::box, static_cast<int>(boxes.size()) });
+			boxes.push_back(*b);
+		}
+		else {
+			primitives.push_back({ primitive_kind::other, static_cast<int>(others.size()) });
+			others.push_back(object);
+		}
+		bounds.push_back(box_bounds);
+	}
+
+	bvh_build_options opts = options;
+	opts.spatial_splits = false;
+	accel.build(bounds, opts);
+}
+
+bool typed_bvh_accel::intersect(const ray& ray, real t_min, real t_max, hit_info& hit) const {
+	bool hit_anything = false;
+	auto closest_so_far = t_max;
+
+	for (const auto& object : unbounded) {
+		if (object->intersect(ray, t_min, closest_so_far, hit)) {
+			hit_anything = true;
+			closest_so_far = hit.t;
+		}
+	}
+
+	if (accel.intersect(ray, t_min, closest_so_far, [&](int prim, real& max_t) {
+			const primitive_ref& ref = primitives[prim];
+			bool found;
+			// Qualified calls are not virtual
+			switch (ref.kind) {
+				case primitive_kind::sphere:
+					found = spheres[ref.index].sphere::intersect(ray, t_min, max_t, hit);
+					break;
+				case primitive_kind::box:
+					found = boxes[ref.index].box::intersect(ray, t_min, max_t, hit);
+					break;
+				default:
+					found = others[ref.index]->intersect(ray, t_min, max_t, hit);
+					break;
+			}
+			if (!found) {
+				return false;
+			}
+			max_t = hit.t;
+			return true;
+		})) {
+		hit_anything = true;
+	}
+
+	return hit_anything;
+}
+
+template <int N>
+int typed_bvh_accel::intersect_rays(ray_packet<N>& rays, int active, hit_info* hits) const {
+	int hit_mask = 0;
+	for (const auto& object : unbounded) {
+		hit_mask |= object->intersect_packet(rays, active, hits);
+	}
+
+	hit_mask |= accel.intersect_packet(rays, active, [&](int first, int count, int mask) {
+		const int* prims = accel.prim_array();
+		int leaf_hits = 0;
+		for (int i = first; i < first + count; i++) {
+			const primitive_ref& ref = primitives[prims[i]];
+			switch (ref.kind) {
+				case primitive_kind::sphere:
+					leaf_hits |= spheres[ref.index].sphere::intersect_packet(rays, mask, hits);
+					break;
+				case primitive_kind::box:
+					leaf_hits |= boxes[ref.index].box::intersect_packet(rays, mask, hits);
+					break;
+				default:
+					leaf_hits |= others[ref.index]->intersect_packet(rays, mask, hits);
+					break;
+			}
+		}
+		return leaf_hits;
+	});
+
+	return hit_mask;
+}
+
+bool typed_bvh_accel::bounding_box(aabb& output_box) const {
+	output_box = accel.bounds();
+	return unbounded.empty() && !primitives.empty();
+}
+
+#endif // !TYPED_BVH_ACCEL_H
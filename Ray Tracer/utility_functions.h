@@ -16,13 +16,13 @@ using std::make_shared;
 using std::sqrt;
 
 //Constants
-const double infinity = std::numeric_limits<double>::infinity();
-const double pi = 3.14159265358979323846;
+const real infinity = std::numeric_limits<real>::infinity();
+const real pi = real(3.14159265358979323846);
 
 
 //Utility functions
 
-inline double degrees_to_radians(double degrees) {
+inline real degrees_to_radians(real degrees) {
 	return degrees * pi / 180;
 }
 
@@ -40,7 +40,7 @@ inline double random_double(double min, double max) {
 	return distribution(generator);
 }
 
-inline double clamp(double x, double min, double max) {
+inline real clamp(real x, real min, real max) {
 	if (x < min) {
 		return min;
 	}
@@ -58,13 +58,9 @@ struct Triangle {
 	int v0, v1, v2;
 };
 
-// Cast a Vertex to point3
-point3 make_point(Vertex v) {
-	point3 p;
-	p.e[0] = v.x;
-	p.e[1] = v.y;
-	p.e[2] = v.z;
-	return p;
+// Cast a Vertex to point3, a plain copy in float builds
+inline point3 make_point(Vertex v) {
+	return point3(real(v.x), real(v.y), real(v.z));
 }
 
 #endif // !UTILITY_FUNCTIONS_H
@@ -4,142 +4,290 @@
 #include<cmath>
 #include<iostream>
 
+// RAY_TRACER_SIMD_VEC3 pads vec3 to four lanes and does its math in SIMD
+// registers. It is off by default: the compiler already vectorizes the three
+// component code, and the padding costs more in copies than the lanes save.
+#if defined(RAY_TRACER_SIMD_VEC3) && defined(__AVX__)
+#include <immintrin.h>
+#define VEC3_AVX
+#elif defined(RAY_TRACER_SIMD_VEC3) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define VEC3_SSE2
+#endif
+
 using std::sqrt;
 
 inline double random_double();
 inline double random_double(double, double);
 
-class vec3 {
-	public: 
-		double e[3];
+// Lanes behind vec3: with RAY_TRACER_SIMD_VEC3, for doubles one AVX register
+// or two SSE2 registers and for floats one SSE register, holding x, y, z and
+// a zero padding lane; otherwise, and on other targets, three plain scalars.
+namespace vec3_lanes {
+#if defined(RAY_TRACER_SIMD_VEC3)
+	const int count = 4;
+#else
+	const int count = 3;
+#endif
+
+	template <typename T>
+	struct lanes { T v[3]; };
+
+	template <typename T>
+	inline lanes<T> load(const T* p) { return { { p[0], p[1], p[2] } }; }
+	template <typename T>
+	inline void store(T* p, lanes<T> a) { p[0] = a.v[0]; p[1] = a.v[1]; p[2] = a.v[2]; }
+	template <typename T>
+	inline lanes<T> broadcast(T t) { return { { t, t, t } }; }
+	template <typename T>
+	inline lanes<T> add(lanes<T> a, lanes<T> b) { return { { a.v[0] + b.v[0], a.v[1] + b.v[1], a.v[2] + b.v[2] } }; }
+	template <typename T>
+	inline lanes<T> sub(lanes<T> a, lanes<T> b) { return { { a.v[0] - b.v[0], a.v[1] - b.v[1], a.v[2] - b.v[2] } }; }
+	template <typename T>
+	inline lanes<T> mul(lanes<T> a, lanes<T> b) { return { { a.v[0] * b.v[0], a.v[1] * b.v[1], a.v[2] * b.v[2] } }; }
+	template <typename T>
+	inline lanes<T> min_lanes(lanes<T> a, lanes<T> b) {
+		return { { a.v[0] < b.v[0] ? a.v[0] : b.v[0], a.v[1] < b.v[1] ? a.v[1] : b.v[1], a.v[2] < b.v[2] ? a.v[2] : b.v[2] } };
+	}
+	template <typename T>
+	inline lanes<T> max_lanes(lanes<T> a, lanes<T> b) {
+		return { { a.v[0] > b.v[0] ? a.v[0] : b.v[0], a.v[1] > b.v[1] ? a.v[1] : b.v[1], a.v[2] > b.v[2] ? a.v[2] : b.v[2] } };
+	}
+	template <typename T>
+	inline T sum(lanes<T> a) { return a.v[0] + a.v[1] + a.v[2]; }
+	template <typename T>
+	inline lanes<T> yzx(lanes<T> a) { return { { a.v[1], a.v[2], a.v[0] } }; }
+	template <typename T>
+	inline lanes<T> zxy(lanes<T> a) { return { { a.v[2], a.v[0], a.v[1] } }; }
+
+#if defined(VEC3_AVX)
+	template <>
+	struct lanes<double> { __m256d v; };
+
+	inline lanes<double> load(const double* p) { return { _mm256_load_pd(p) }; }
+	inline void store(double* p, lanes<double> a) { _mm256_store_pd(p, a.v); }
+	inline lanes<double> broadcast(double t) { return { _mm256_set_pd(0, t, t, t) }; }
+	inline lanes<double> add(lanes<double> a, lanes<double> b) { return { _mm256_add_pd(a.v, b.v) }; }
+	inline lanes<double> sub(lanes<double> a, lanes<double> b) { return { _mm256_sub_pd(a.v, b.v) }; }
+	inline lanes<double> mul(lanes<double> a, lanes<double> b) { return { _mm256_mul_pd(a.v, b.v) }; }
+	inline lanes<double> min_lanes(lanes<double> a, lanes<double> b) { return { _mm256_min_pd(a.v, b.v) }; }
+	inline lanes<double> max_lanes(lanes<double> a, lanes<double> b) { return { _mm256_max_pd(a.v, b.v) }; }
+
+	inline double sum(lanes<double> a) {
+		__m128d s = _mm_add_pd(_mm256_castpd256_pd128(a.v), _mm256_extractf128_pd(a.v, 1));
+		return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+	}
+
+#if defined(__AVX2__)
+	inline lanes<double> yzx(lanes<double> a) { return { _mm256_permute4x64_pd(a.v, _MM_SHUFFLE(3, 0, 2, 1)) }; }
+	inline lanes<double> zxy(lanes<double> a) { return { _mm256_permute4x64_pd(a.v, _MM_SHUFFLE(3, 1, 0, 2)) }; }
+#else
+	inline lanes<double> yzx(lanes<double> a) {
+		__m128d xy = _mm256_castpd256_pd128(a.v), zw = _mm256_extractf128_pd(a.v, 1);
+		return { _mm256_set_m128d(_mm_shuffle_pd(xy, zw, 2), _mm_shuffle_pd(xy, zw, 1)) };
+	}
+	inline lanes<double> zxy(lanes<double> a) {
+		__m128d xy = _mm256_castpd256_pd128(a.v), zw = _mm256_extractf128_pd(a.v, 1);
+		return { _mm256_set_m128d(_mm_shuffle_pd(xy, zw, 3), _mm_shuffle_pd(zw, xy, 0)) };
+	}
+#endif
+
+#elif defined(VEC3_SSE2)
+	template <>
+	struct lanes<double> { __m128d xy, zw; };
+
+	inline lanes<double> load(const double* p) { return { _mm_load_pd(p), _mm_load_pd(p + 2) }; }
+	inline void store(double* p, lanes<double> a) { _mm_store_pd(p, a.xy); _mm_store_pd(p + 2, a.zw); }
+	inline lanes<double> broadcast(double t) { return { _mm_set1_pd(t), _mm_set_sd(t) }; }
+	inline lanes<double> add(lanes<double> a, lanes<double> b) { return { _mm_add_pd(a.xy, b.xy), _mm_add_pd(a.zw, b.zw) }; }
+	inline lanes<double> sub(lanes<double> a, lanes<double> b) { return { _mm_sub_pd(a.xy, b.xy), _mm_sub_pd(a.zw, b.zw) }; }
+	inline lanes<double> mul(lanes<double> a, lanes<double> b) { return { _mm_mul_pd(a.xy, b.xy), _mm_mul_pd(a.zw, b.zw) }; }
+	inline lanes<double> min_lanes(lanes<double> a, lanes<double> b) { return { _mm_min_pd(a.xy, b.xy), _mm_min_pd(a.zw, b.zw) }; }
+	inline lanes<double> max_lanes(lanes<double> a, lanes<double> b) { return { _mm_max_pd(a.xy, b.xy), _mm_max_pd(a.zw, b.zw) }; }
+
+	inline double sum(lanes<double> a) {
+		__m128d s = _mm_add_pd(a.xy, a.zw);
+		return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+	}
+
+	inline lanes<double> yzx(lanes<double> a) { return { _mm_shuffle_pd(a.xy, a.zw, 1), _mm_shuffle_pd(a.xy, a.zw, 2) }; }
+	inline lanes<double> zxy(lanes<double> a) { return { _mm_shuffle_pd(a.zw, a.xy, 0), _mm_shuffle_pd(a.xy, a.zw, 3) }; }
+#endif
+
+#if defined(VEC3_AVX) || defined(VEC3_SSE2)
+	template <>
+	struct lanes<float> { __m128 v; };
+
+	inline lanes<float> load(const float* p) { return { _mm_load_ps(p) }; }
+	inline void store(float* p, lanes<float> a) { _mm_store_ps(p, a.v); }
+	inline lanes<float> broadcast(float t) { return { _mm_set_ps(0, t, t, t) }; }
+	inline lanes<float> add(lanes<float> a, lanes<float> b) { return { _mm_add_ps(a.v, b.v) }; }
+	inline lanes<float> sub(lanes<float> a, lanes<float> b) { return { _mm_sub_ps(a.v, b.v) }; }
+	inline lanes<float> mul(lanes<float> a, lanes<float> b) { return { _mm_mul_ps(a.v, b.v) }; }
+	inline lanes<float> min_lanes(lanes<float> a, lanes<float> b) { return { _mm_min_ps(a.v, b.v) }; }
+	inline lanes<float> max_lanes(lanes<float> a, lanes<float> b) { return { _mm_max_ps(a.v, b.v) }; }
+
+	inline float sum(lanes<float> a) {
+		__m128 s = _mm_add_ps(a.v, _mm_movehl_ps(a.v, a.v));
+		return _mm_cvtss_f32(_mm_add_ss(s, _mm_shuffle_ps(s, s, _MM_SHUFFLE(1, 1, 1, 1))));
+	}
+
+	inline lanes<float> yzx(lanes<float> a) { return { _mm_shuffle_ps(a.v, a.v, _MM_SHUFFLE(3, 0, 2, 1)) }; }
+	inline lanes<float> zxy(lanes<float> a) { return { _mm_shuffle_ps(a.v, a.v, _MM_SHUFFLE(3, 1, 0, 2)) }; }
+#endif
+}
+
+// x, y, z of float or double precision. With RAY_TRACER_SIMD_VEC3 they are
+// padded to four aligned lanes and e[3] is always 0.
+template <typename T>
+class alignas(vec3_lanes::count == 4 ? 4 * sizeof(T) : sizeof(T)) vec3_t {
+	public:
+		T e[vec3_lanes::count];
 
 	public:
-		vec3() : e{ 0, 0, 0 } {}
-		vec3(double e0, double e1, double e2) : e{e0, e1, e2} {}
+		vec3_t() : e{} {}
+		vec3_t(T e0, T e1, T e2) : e{e0, e1, e2} {}
+		explicit vec3_t(vec3_lanes::lanes<T> v) : e{} { vec3_lanes::store(e, v); }
+
+		// Conversion from the other precision
+		template <typename U>
+		explicit vec3_t(const vec3_t<U>& v) : e{ T(v.e[0]), T(v.e[1]), T(v.e[2]) } {}
+
+		vec3_lanes::lanes<T> lanes() const { return vec3_lanes::load(e); }
 
-		double x() const { return e[0]; }
-		double y() const { return e[1]; }
-		double z() const { return e[2]; }
+		T x() const { return e[0]; }
+		T y() const { return e[1]; }
+		T z() const { return e[2]; }
 
-		vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); }
+		vec3_t operator-() const { return vec3_t(vec3_lanes::sub(vec3_lanes::lanes<T>(), lanes())); }
 
-		double operator[](int i) const { return e[i]; }
-		
-		double& operator[](int i) {	return e[i]; }
+		T operator[](int i) const { return e[i]; }
 
-		vec3& operator+= (const vec3& v) {
-			e[0] += v.e[0];
-			e[1] += v.e[1];
-			e[2] += v.e[2];
+		T& operator[](int i) {	return e[i]; }
+
+		vec3_t& operator+= (const vec3_t& v) {
+			vec3_lanes::store(e, vec3_lanes::add(lanes(), v.lanes()));
 			return *this;
 		}
 
-		vec3& operator*= (const double t) {
-			e[0] *= t;
-			e[1] *= t;
-			e[2] *= t;
+		vec3_t& operator*= (const T t) {
+			vec3_lanes::store(e, vec3_lanes::mul(lanes(), vec3_lanes::broadcast(t)));
 			return *this;
 		}
 
-		vec3& operator/= (const double t) {
+		vec3_t& operator/= (const T t) {
 			return *this *= 1 / t;
 		}
 
-		double length_squared() const {
-			return e[0] * e[0] + e[1] * e[1] + e[2] * e[2];
+		T length_squared() const {
+			vec3_lanes::lanes<T> v = lanes();
+			return vec3_lanes::sum(vec3_lanes::mul(v, v));
 		}
 
-		double length() const {
+		T length() const {
 			return sqrt(length_squared());
 		}
 
-		inline static vec3 random() {
-			return vec3(random_double(), random_double(), random_double());
+		inline static vec3_t random() {
+			return vec3_t(T(random_double()), T(random_double()), T(random_double()));
 		}
 
-		inline static vec3 random(double min, double max) {
-			return vec3(random_double(min, max), random_double(min, max), random_double(min, max));
+		inline static vec3_t random(double min, double max) {
+			return vec3_t(T(random_double(min, max)), T(random_double(min, max)), T(random_double(min, max)));
 		}
 
 		// Return true if the vector is close to zero in all dimensions.
 		bool near_zero() const {
 			const auto s = 1e-8; //10^-8
 			//fabs() - absolute value
-			return (fabs(e[0]) < s) && (fabs(e[1]) < s) && (fabs(e[2]) < s); 
+			return (fabs(e[0]) < s) && (fabs(e[1]) < s) && (fabs(e[2]) < s);
+		}
+
+		// Scaling is defined here so that a scalar of either precision
+		// converts, e.g. 0.5 * v in a float build
+		friend vec3_t operator*(T t, const vec3_t& v) {
+			return vec3_t(vec3_lanes::mul(vec3_lanes::broadcast(t), v.lanes()));
+		}
+
+		friend vec3_t operator*(const vec3_t& v, T t) {
+			return t * v;
+		}
+
+		friend vec3_t operator/ (const vec3_t& v, T t) {
+			return (1 / t) * v;
 		}
 };
 
+// Precision of the renderer, chosen at build time. Float halves the memory
+// of every vector and fits twice the lanes in a register; double, the
+// default, keeps scenes with huge coordinates accurate.
+#if defined(RAY_TRACER_FLOAT)
+using real = float;
+#else
+using real = double;
+#endif
+
+using vec3 = vec3_t<real>;
 using point3 = vec3;
 using color = vec3;
 
 //Vec3 Utility functions
 
-inline std::ostream& operator<<(std::ostream& out, const vec3 &v) {
+template <typename T>
+inline std::ostream& operator<<(std::ostream& out, const vec3_t<T> &v) {
 	return out << v.e[0] << ' ' << v.e[1] << ' ' << v.e[2];
 }
 
-inline vec3 operator+(const vec3 &v1, const vec3 &v2) {
-	return vec3(v1.e[0] + v2.e[0], v1.e[1] + v2.e[1], v1.e[2] + v2.e[2]);
+template <typename T>
+inline vec3_t<T> operator+(const vec3_t<T> &v1, const vec3_t<T> &v2) {
+	return vec3_t<T>(vec3_lanes::add(v1.lanes(), v2.lanes()));
 }
 
-inline vec3 operator-(const vec3 &v1, const vec3 &v2) {
-	return vec3(v1.e[0] - v2.e[0], v1.e[1] - v2.e[1], v1.e[2] - v2.e[2]);
+template <typename T>
+inline vec3_t<T> operator-(const vec3_t<T> &v1, const vec3_t<T> &v2) {
+	return vec3_t<T>(vec3_lanes::sub(v1.lanes(), v2.lanes()));
 }
 
-inline vec3 operator*(const vec3 &v1, const vec3 &v2) {
-	return vec3(v1.e[0] * v2.e[0], v1.e[1] * v2.e[1], v1.e[2] * v2.e[2]);
+template <typename T>
+inline vec3_t<T> operator*(const vec3_t<T> &v1, const vec3_t<T> &v2) {
+	return vec3_t<T>(vec3_lanes::mul(v1.lanes(), v2.lanes()));
 }
 
-inline vec3 operator*(double t, const vec3& v) {
-	return vec3(t * v.e[0], t * v.e[1], t * v.e[2]);
+template <typename T>
+inline T dot(const vec3_t<T>& v1, const vec3_t<T>& v2) {
+	return vec3_lanes::sum(vec3_lanes::mul(v1.lanes(), v2.lanes()));
 }
 
-inline vec3 operator*(const vec3 &v, double t) {
-	return t * v;
+template <typename T>
+inline vec3_t<T> cross(const vec3_t<T>& v1, const vec3_t<T>& v2) {
+	using namespace vec3_lanes;
+	lanes<T> a = v1.lanes(), b = v2.lanes();
+	return vec3_t<T>(sub(mul(yzx(a), zxy(b)), mul(zxy(a), yzx(b))));
 }
 
-inline vec3 operator/ (const vec3 v, double t) {
-	return (1 / t) * v;
+// Component-wise minimum and maximum
+template <typename T>
+inline vec3_t<T> component_min(const vec3_t<T>& v1, const vec3_t<T>& v2) {
+	return vec3_t<T>(vec3_lanes::min_lanes(v1.lanes(), v2.lanes()));
 }
 
-inline double dot(const vec3& v1, const vec3& v2) {
-	return (v1.e[0] * v2.e[0]) + (v1.e[1] * v2.e[1]) + (v1.e[2] * v2.e[2]);
+template <typename T>
+inline vec3_t<T> component_max(const vec3_t<T>& v1, const vec3_t<T>& v2) {
+	return vec3_t<T>(vec3_lanes::max_lanes(v1.lanes(), v2.lanes()));
 }
 
-inline vec3 cross(const vec3& v1, const vec3& v2) {
-	return vec3(v1[1] * v2[2] - v1[2] * v2[1],
-		v1[0] * v2[2] - v1[2] * v2[0],
-		v1[0] * v2[1] - v1[1] * v2[0]);
-}
-
-inline vec3 unit_vector(vec3 v) {
+template <typename T>
+inline vec3_t<T> unit_vector(const vec3_t<T>& v) {
 	return v / v.length();
 }
 
-inline vec3 random_in_unit_sphere() {
-	while (true) {
-		vec3 random_p = vec3::random(-1, 1);
-		if (random_p.length_squared() >= 1) {
-			// p > 1 - outside sphere
-			// p = 1 - on the sphere
-			// p < 1 - inside sphere
-			continue;
-		}
-		return random_p;
-	}
-}
-
-vec3 random_unit_vector() {
-	return unit_vector(random_in_unit_sphere());
-}
-
 vec3 reflect(const vec3& v, const vec3& n) {
 	return v - 2 * dot(v, n) * n;
 }
 
-vec3 refract(const vec3& v, const vec3& n, double ref_indices) {
-	auto cos_theta = fmin(dot(-v, n), 1);
-	vec3 r_perp = ref_indices * (v * cos_theta * n);
+vec3 refract(const vec3& v, const vec3& n, real ref_indices) {
+	auto cos_theta = fmin(dot(-v, n), real(1));
+	vec3 r_perp = ref_indices * (v + cos_theta * n);
 	vec3 r_parallel = -sqrt(fabs(1 - r_perp.length_squared())) * n;
 	return r_perp + r_parallel;
 }